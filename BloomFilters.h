@@ -7,51 +7,72 @@
 
 #include <vector>
 #include <cstdint>
+#include <cstring>
 #include "MurmurHash3.h"
+#include "constant.h"
 
 // BF 假设输入元素个数已经确定为 n，每次插入一个元素会计算其 k 个哈希函数的哈希值，并将哈希数组对应的位置置为 1
+// 位数组按 64 位字保存，第 i 位为第 i / 64 个字的第 i % 64 位；按小端序写出即为文件中第 i / 8 字节的第 i % 8 位
 class BloomFilters {
 public:
-    BloomFilters(const uint64_t &numKeys) : n(numKeys){
-        while (bitSet.size() < m) bitSet.push_back(false);
+    BloomFilters(const uint64_t &numKeys) : n(numKeys), words(m / 64, 0){
+        bits = words.data();
+    }
+    // 由序列化的位数组（m / 8 字节）构造；inPlace 为 true 且 src 按 8 字节对齐时直接引用 src，不复制，
+    // 此时 src 须在析构前一直有效，且不能再 set / setBit
+    BloomFilters(const uint64_t &numKeys, const char* src, bool inPlace) : n(numKeys){
+        if(inPlace && reinterpret_cast<uintptr_t>(src) % sizeof(uint64_t) == 0){
+            bits = reinterpret_cast<const uint64_t*>(src);
+        } else {
+            words.resize(m / 64);
+            memcpy(words.data(), src, m / BITS_IN_BYTE);
+            bits = words.data();
+        }
     }
     void set(const uint64_t &key){
+        if(bits != words.data()) throw "ERROR BloomFilter set on a read-only filter";
         doHash(key);
         for(unsigned int i = 0; i < k; ++i) {
             // std::cout << "set data: " << data << "  hash" << i+1 << ": " << hash_val << std::endl;
-            bitSet[hash[i] % m] = true;
+            uint64_t index = hash[i] % m;
+            words[index >> 6] |= 1ULL << (index & 63);
         }
     }
     bool find(const uint64_t & key){
-        bool is_one = true;
         doHash(key);
         for(unsigned int i = 0; i < k; ++i){
-            is_one = is_one && bitSet[hash[i] % m];
+            uint64_t index = hash[i] % m;
+            if(!((bits[index >> 6] >> (index & 63)) & 1)) return false;
             // std::cout << "find data: " << data << "  hash" << i+1 << ": " << hash_val << std::endl;
         }
-        return is_one;
+        return true;
     }
     uint64_t getSize(){return m;}
+    static uint64_t getBytesSize(){return m / BITS_IN_BYTE;}
+    // 序列化的位数组，共 getSize() / 8 字节
+    const char* getData(){return reinterpret_cast<const char*>(bits);}
     bool getBit(const uint64_t & index){
         if(index < 0 || index >= m) throw "ERROR BloomFilter getBit index out of range";
-        return bitSet[index];
+        return (bits[index >> 6] >> (index & 63)) & 1;
     }
     void setBit(const uint64_t & index, bool bitVal){
         if(index < 0 || index >= m) throw "ERROR BloomFilter getBit index out of range";
-        bitSet[index] = bitVal;
+        if(bits != words.data()) throw "ERROR BloomFilter setBit on a read-only filter";
+        if(bitVal) words[index >> 6] |= 1ULL << (index & 63);
+        else words[index >> 6] &= ~(1ULL << (index & 63));
     }
     ~BloomFilters(){
-        bitSet.clear();
+        words.clear();
     }
 private:
     const uint64_t n = 0;  // 插入集合的元素个数 n
     // const uint64_t M_FRAC_N = 6; // m/n
-    const uint64_t m = 10240 * 8;  // 用大小为 m 的哈希数组存储哈希值是否已被插入（ BloomFilter 位数组 bitset 的长度）
+    static const uint64_t m = 10240 * 8;  // 用大小为 m 的哈希数组存储哈希值是否已被插入（ BloomFilter 位数组 bitset 的长度，为 64 的倍数）
     static const unsigned int k = 4;  // 取哈希值范围为 [0, m-1] 的 k 个哈希函数
-    std::vector<bool> bitSet;
+    std::vector<uint64_t> words;  // 自身持有的位数组，引用外部数据时为空
+    const uint64_t* bits = nullptr;  // 实际使用的位数组，指向 words 或外部数据
     uint32_t hash[k] = {0};
     void doHash(const uint64_t & key){
-        hash[k] = {0};
         MurmurHash3_x64_128(&key, sizeof(key), 1, hash);
     }
 };
@@ -0,0 +1,103 @@
+//
+// Created by ENVY on 2022/6/5.
+//
+
+#ifndef LSM_KV_CHECKSUMS_H
+#define LSM_KV_CHECKSUMS_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHECKSUMS_USE_SSE42
+#include <nmmintrin.h>
+#endif
+
+// CRC32C（Castagnoli 多项式，与 iSCSI / ext4 / LevelDB 相同）
+// x86-64 上运行时检测到 SSE4.2 时使用 crc32 指令每次处理 8 字节，否则使用 slicing-by-8 查表，两者结果相同
+class Checksums {
+public:
+    // 计算 data 中 n 字节的 CRC32C；分段计算时 crc 传入之前各段的结果
+    static uint32_t crc32c(const char* data, uint64_t n, uint32_t crc = 0){
+        crc = ~crc;
+#ifdef CHECKSUMS_USE_SSE42
+        if(hardwareSupported()) return ~crc32cHardware(data, n, crc);
+#endif
+        return ~crc32cSoftware(data, n, crc);
+    };
+
+    // 是否使用 SSE4.2 的 crc32 指令
+    static bool hardwareSupported(){
+#ifdef CHECKSUMS_USE_SSE42
+        static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+        return supported;
+#else
+        return false;
+#endif
+    };
+
+private:
+    static const uint32_t POLY = 0x82f63b78;  // 反射后的多项式
+
+    // tables[k][b] 为字节 b 之后再经过 k 个零字节的 CRC，第一次使用时生成
+    struct Tables {
+        uint32_t t[8][256];
+        Tables(){
+            for(uint32_t b = 0; b < 256; ++b){
+                uint32_t crc = b;
+                for(int i = 0; i < 8; ++i) crc = (crc >> 1) ^ ((crc & 1) ? POLY : 0);
+                t[0][b] = crc;
+            }
+            for(uint32_t b = 0; b < 256; ++b){
+                for(int k = 1; k < 8; ++k) t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xff];
+            }
+        }
+    };
+    static const Tables &tables(){
+        static const Tables instance;
+        return instance;
+    };
+
+    static uint32_t crc32cSoftware(const char* data, uint64_t n, uint32_t crc){
+        const uint32_t (*t)[256] = tables().t;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        while(n >= 8){
+            uint32_t low, high;
+            memcpy(&low, p, sizeof(low));
+            memcpy(&high, p + 4, sizeof(high));
+            low ^= crc;
+            crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+                  t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+            p += 8;
+            n -= 8;
+        }
+        while(n > 0){
+            crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+            --n;
+        }
+        return crc;
+    };
+
+#ifdef CHECKSUMS_USE_SSE42
+    __attribute__((target("sse4.2")))
+    static uint32_t crc32cHardware(const char* data, uint64_t n, uint32_t crc){
+        uint64_t crc64 = crc;
+        while(n >= 8){
+            uint64_t word;
+            memcpy(&word, data, sizeof(word));
+            crc64 = _mm_crc32_u64(crc64, word);
+            data += 8;
+            n -= 8;
+        }
+        crc = static_cast<uint32_t>(crc64);
+        while(n > 0){
+            crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data++));
+            --n;
+        }
+        return crc;
+    };
+#endif
+};
+
+
+#endif //LSM_KV_CHECKSUMS_H
@@ -0,0 +1,143 @@
+//
+// Created by ENVY on 2022/6/2.
+//
+
+#ifndef LSM_KV_LZCOMPRESSORS_H
+#define LSM_KV_LZCOMPRESSORS_H
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// LZ77 类的块压缩，格式与 LZ4 的 block 格式相同：由若干个 sequence 组成，每个为
+// token (高 4 位为字面量长度，低 4 位为匹配长度 - 4) | 字面量长度扩展 | 字面量 | offset (2B) | 匹配长度扩展
+// 长度字段为 15 时之后跟若干字节继续累加，每字节为 255 表示还有后续；最后一个 sequence 只有字面量
+// 压缩结果遵守 LZ4 的块尾规则：最后一个匹配在块尾 MF_LIMIT 字节之前开始，最后 LAST_LITERALS 字节总是字面量
+// 压缩时用哈希表记录每个 4 字节前缀最近出现的位置，只找一个候选，不做最优解析，以速度为主；
+// 哈希表在多次 compress 间复用，表项记录 base 之上的位置，每次压缩后 base 增加输入的长度，之前的表项随之失效，不必清空
+class LZCompressors {
+public:
+    LZCompressors(): table(1 << HASH_BITS, 0) {}
+
+    // 将 src 中的 n 字节压缩后追加到 dst
+    void compress(const char* src, uint64_t n, std::string &dst){
+        if(n >= (uint64_t)UINT32_MAX - base){
+            std::fill(table.begin(), table.end(), 0);
+            base = 0;
+            // 位置放不进表项，整块作为字面量
+            if(n >= UINT32_MAX){
+                emitLiterals(src, n, dst);
+                return;
+            }
+        }
+        uint64_t matchLimit = n > LAST_LITERALS ? n - LAST_LITERALS : 0;
+        uint64_t anchor = 0;
+        uint64_t i = 0;
+        while(i + MF_LIMIT <= n){
+            uint32_t seq = read32(src + i);
+            uint32_t h = hash(seq);
+            uint32_t entry = table[h];
+            table[h] = base + i + 1;
+            uint64_t match = entry - base - 1;
+            if(entry > base && i - match <= MAX_OFFSET && read32(src + match) == seq){
+                uint64_t length = MIN_MATCH;
+                while(i + length < matchLimit && src[match + length] == src[i + length]) ++length;
+                emitSequence(src + anchor, i - anchor, i - match, length, dst);
+                i += length;
+                anchor = i;
+            } else {
+                // 连续没有匹配时加大步长，不可压缩的数据很快跳过
+                i += 1 + ((i - anchor) >> 6);
+            }
+        }
+        emitLiterals(src + anchor, n - anchor, dst);
+        base += n;
+    };
+
+    // 将 src 中的 n 字节解压到 dst，解压后的长度必须恰好为 rawSize，数据损坏时返回 false
+    static bool decompress(const char* src, uint64_t n, char* dst, uint64_t rawSize){
+        const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+        const unsigned char* ipEnd = ip + n;
+        uint64_t op = 0;
+        while(ip < ipEnd){
+            unsigned int token = *ip++;
+            uint64_t literalLength = token >> 4;
+            if(literalLength == 15 && !readLength(ip, ipEnd, literalLength)) return false;
+            if(literalLength > (uint64_t)(ipEnd - ip) || literalLength > rawSize - op) return false;
+            memcpy(dst + op, ip, literalLength);
+            ip += literalLength;
+            op += literalLength;
+            // 最后一个 sequence 只有字面量
+            if(ip == ipEnd) break;
+
+            if(ipEnd - ip < 2) return false;
+            uint64_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            uint64_t matchLength = token & 0xf;
+            if(matchLength == 15 && !readLength(ip, ipEnd, matchLength)) return false;
+            matchLength += MIN_MATCH;
+            if(offset == 0 || offset > op || matchLength > rawSize - op) return false;
+            // 匹配区间可能与输出重叠，逐字节复制
+            for(uint64_t k = 0; k < matchLength; ++k, ++op) dst[op] = dst[op - offset];
+        }
+        return op == rawSize;
+    };
+
+private:
+    static const unsigned int HASH_BITS = 12;
+    static const uint64_t MIN_MATCH = 4;
+    static const uint64_t MAX_OFFSET = 65535;
+    static const uint64_t MF_LIMIT = 12;
+    static const uint64_t LAST_LITERALS = 5;
+
+    // 每个哈希值最近出现的位置 + base + 1，不大于 base 的表项无效
+    std::vector<uint32_t> table;
+    uint32_t base = 0;
+
+    static uint32_t read32(const char* p){
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    };
+    static uint32_t hash(uint32_t seq){
+        return (seq * 2654435761U) >> (32 - HASH_BITS);
+    };
+    // 长度字段为 15 之后的扩展字节
+    static void writeLength(uint64_t length, std::string &dst){
+        while(length >= 255){
+            dst.push_back(static_cast<char>(255));
+            length -= 255;
+        }
+        dst.push_back(static_cast<char>(length));
+    };
+    static bool readLength(const unsigned char* &ip, const unsigned char* ipEnd, uint64_t &length){
+        unsigned int byte;
+        do {
+            if(ip == ipEnd) return false;
+            byte = *ip++;
+            length += byte;
+        } while(byte == 255);
+        return true;
+    };
+    static void emitSequence(const char* literals, uint64_t literalLength, uint64_t offset, uint64_t matchLength, std::string &dst){
+        uint64_t matchCode = matchLength - MIN_MATCH;
+        unsigned int token = ((literalLength < 15 ? literalLength : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+        dst.push_back(static_cast<char>(token));
+        if(literalLength >= 15) writeLength(literalLength - 15, dst);
+        dst.append(literals, literalLength);
+        dst.push_back(static_cast<char>(offset & 0xff));
+        dst.push_back(static_cast<char>(offset >> 8));
+        if(matchCode >= 15) writeLength(matchCode - 15, dst);
+    };
+    static void emitLiterals(const char* literals, uint64_t literalLength, std::string &dst){
+        unsigned int token = (literalLength < 15 ? literalLength : 15) << 4;
+        dst.push_back(static_cast<char>(token));
+        if(literalLength >= 15) writeLength(literalLength - 15, dst);
+        dst.append(literals, literalLength);
+    };
+};
+
+
+#endif //LSM_KV_LZCOMPRESSORS_H
@@ -0,0 +1,42 @@
+//
+// Created by ENVY on 2022/5/27.
+//
+
+#ifndef LSM_KV_LOSERTREES_H
+#define LSM_KV_LOSERTREES_H
+
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+// 败者树，用于 compaction 的 k 路归并：每次取出当前最小的一路，该路前进后只需沿叶子到根比较 log k 次
+// less(a, b) 判断第 a 路的当前元素是否应先于第 b 路输出，已读完的路应排在所有未读完的路之后
+template<typename Less>
+class LoserTrees {
+public:
+    LoserTrees(uint64_t k, Less less): k(k), less(less), tree(k, -1) {
+        for(int64_t i = (int64_t)k - 1; i >= 0; --i) adjust(i);
+    }
+
+    // 当前最小的一路
+    uint64_t top() const {return tree[0];};
+    // 第 top() 路前进之后调用，重新选出最小的一路
+    void replay(){ adjust(tree[0]); };
+
+private:
+    uint64_t k;
+    Less less;
+    // tree[0] 为胜者，tree[1..k-1] 为各内部结点上的败者，-1 表示建树时尚未比较过的结点
+    std::vector<int64_t> tree;
+
+    // 叶子 s 沿到根的路径与各结点上的败者比较，败者留在结点上，胜者继续向上
+    void adjust(int64_t s){
+        for(uint64_t t = (s + k) / 2; t > 0; t /= 2){
+            if(s != -1 && (tree[t] == -1 || less(tree[t], s))) std::swap(s, tree[t]);
+        }
+        tree[0] = s;
+    }
+};
+
+
+#endif //LSM_KV_LOSERTREES_H
@@ -23,6 +23,19 @@ void MemTables::reset()
 {
     // reset skipList
     skipList->reset();
+    rangeTombstones.clear();
+}
+
+void MemTables::deleteRange(uint64_t begin, uint64_t end)
+{
+    // erase 同时从大小中减去被删除的项
+    std::list<std::pair<uint64_t, std::string> > covered;
+    skipList->scan(begin, end, covered);
+    for(auto it = covered.begin(); it != covered.end(); ++it){
+        skipList->erase(it->first);
+    }
+    rangeTombstones.add(begin, end);
+    setSize(getSize() + RANGE_TOMBSTONE_BYTES_SIZE);
 }
 
 void MemTables::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &list)
@@ -33,4 +46,18 @@ void MemTables::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t,
 void MemTables::getAll(std::list<std::pair<uint64_t, std::string> > &all, uint64_t &minKey, uint64_t &maxKey, uint64_t &numKey)
 {
     skipList->getAll(all, minKey, maxKey, numKey);
+}
+
+void MemTables::absorb(MemTables &newer)
+{
+    // 逐项并入并随之调整大小，被 newer 的范围删除标记删除或被 newer 覆盖的旧项不再计入
+    const std::vector<std::pair<uint64_t, uint64_t> > &ranges = newer.rangeTombstones.getRanges();
+    for(auto it = ranges.begin(); it != ranges.end(); ++it){
+        deleteRange(it->first, it->second);
+    }
+    newer.forEach([&](uint64_t key, const std::string &value){
+        // put 覆盖时只减去旧项，新项的大小由调用者加上
+        setSize(getSize() + value.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
+        put(key, value);
+    });
 }
\ No newline at end of file
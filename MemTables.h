@@ -8,12 +8,17 @@
 #include "kvstore_api.h"
 #include "SkipLists.h"
 #include "constant.h"
+#include "RangeTombstones.h"
 
 #include <cassert>
 
 class MemTables : public KVStoreAPI {
 private:
     SkipLists* skipList = nullptr;
+    // 范围删除标记，只遮蔽 SSTable 中的数据：调用 deleteRange 时 memTable 中已有的范围内数据会被直接删除，
+    // 之后再 put 的数据比删除标记更新，因此 memTable 中的 key-value 对总是优先
+    RangeTombstones rangeTombstones;
+    uint64_t refs = 1;
 public:
     MemTables(const std::string &dir): KVStoreAPI(dir){
         skipList = new SkipLists(dir);
@@ -26,7 +31,18 @@ public:
     uint64_t getSize() {return skipList->getSize(); };
     void setSize(uint64_t _size) {skipList->setSize(_size); };
     void getAll(std::list<std::pair<uint64_t, std::string> > &all, uint64_t &minKey, uint64_t &maxKey, uint64_t &numKey);
+    // 按 key 顺序访问每个 key-value 对，见 SkipLists::forEach
+    template<typename Visitor>
+    void forEach(Visitor visit) {skipList->forEach(visit); };
     void put(uint64_t key, const std::string &s) override;
+    // 把更新的 newer 的内容并入本 memTable：先按 newer 的范围删除标记删除已有的数据，再写入 newer 中的 key-value 对
+    void absorb(MemTables &newer);
+    // 自上次 reset 以来没有任何写入
+    bool empty() {return getSize() <= INIT_BYTES_SIZE; };
+    // 被快照共享的 memTable 不再修改，KVStore 与每个快照各持有一份引用，最后一份释放时 delete
+    void ref(){ ++refs; };
+    uint64_t unref(){ return --refs; };
+    uint64_t getRefs(){ return refs; };
 
     std::string get(uint64_t key) override;
 
@@ -34,7 +50,13 @@ public:
 
     void reset() override;
 
+    // 删除 [begin, end] 内的所有数据，并记录一个范围删除标记
+    void deleteRange(uint64_t begin, uint64_t end);
+    bool isRangeDeleted(uint64_t key) {return rangeTombstones.covers(key); };
+    const RangeTombstones &getRangeTombstones() {return rangeTombstones; };
+
     void scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &list) override;
+    void approximateStats(uint64_t key1, uint64_t key2, uint64_t &keyCount, uint64_t &byteSize) {skipList->approximateStats(key1, key2, keyCount, byteSize); };
 };
 
 
@@ -1,4 +1,5 @@
 #pragma once
+#include <string.h>
 #if defined(_MSC_VER) && (_MSC_VER < 1600)
 
 typedef unsigned char uint8_t;
@@ -126,6 +127,7 @@ static inline void MurmurHash3_x64_128 ( const void * key, const int len,
   h1 += h2;
   h2 += h1;
 
-  ((uint64_t*)out)[0] = h1;
-  ((uint64_t*)out)[1] = h2;
+  // out 常为 uint32_t[4]，用 memcpy 写入以免违反 strict aliasing（-O2 下读出的哈希值可能早于写入）
+  memcpy(out, &h1, sizeof(h1));
+  memcpy((uint8_t*)out + sizeof(h1), &h2, sizeof(h2));
 }
\ No newline at end of file
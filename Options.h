@@ -0,0 +1,105 @@
+//
+// Created by ENVY on 2022/5/24.
+//
+
+#ifndef LSM_KV_OPTIONS_H
+#define LSM_KV_OPTIONS_H
+
+#include <cstdint>
+
+// compaction 策略
+enum CompactionStyle {
+    // 每层一个有序无交集的 run，每层的大小为上一层的若干倍，数据每下移一层重写一次，读放大小
+    COMPACTION_STYLE_LEVEL,
+    // 每层（以及 level 0 的每个文件）为一个 sorted run，只在 run 的个数或大小比例超过限制时合并大小相近的 run，写放大小、读放大大
+    COMPACTION_STYLE_UNIVERSAL
+};
+
+// leveled 模式下从 level >= 1 的一层中选取 compaction 输入文件的策略
+enum CompactionPri {
+    // 优先选择时间戳最小（最早写入）的文件
+    COMPACTION_PRI_OLDEST_FIRST,
+    // 选择与下一层相交的字节数与自身字节数之比最小的一段连续文件，写放大小；比值相同时按轮转游标依次选择
+    COMPACTION_PRI_MIN_OVERLAP
+};
+
+// SSTable 数据块的压缩方式
+enum CompressionType {
+    COMPRESSION_NONE,
+    // 内置的 LZ77 类压缩（LZCompressors），不依赖外部库
+    COMPRESSION_LZ
+};
+
+// SSTable 校验和（CRC32C）的检查时机，没有校验和的旧文件不检查
+enum ChecksumVerification {
+    // 打开文件时检查 header、bloom filter 与 meta 段，前台读与 compaction 读入的每个数据块都检查
+    CHECKSUM_VERIFY_ALWAYS,
+    // 打开文件时检查 header、bloom filter 与 meta 段，数据块只在 compaction 读入时检查，前台读不计算
+    CHECKSUM_VERIFY_COMPACTION,
+    // 都不检查
+    CHECKSUM_VERIFY_NEVER
+};
+
+// KVStore 的可选配置，在构造 KVStore 时传入，未指定的项使用默认值
+struct Options {
+    // 新写出的 SSTable 是否附带 RangeFilter（key 前缀 Bloom Filter），供 scan 跳过区间内没有数据的文件
+    bool rangeFilter = true;
+    // 新写出的 SSTable 的数据块压缩方式，读取时按文件中记录的方式解压
+    CompressionType compression = COMPRESSION_NONE;
+    // 新写出的 SSTable 中 value 长度都相同的数据块使用定长布局：不保存每项的长度，key 紧密排列，按下标直接算出位置，
+    // 点查在 key 数组上查找而不必逐项解码；适合大多数记录定长的数据，之前的版本无法读取这种块
+    bool fixedWidthValues = false;
+    // SSTable 校验和的检查时机，新写出的文件总是带有校验和
+    ChecksumVerification checksumVerification = CHECKSUM_VERIFY_COMPACTION;
+    // 写出 SSTable（memTable 的写出与 compaction 的输出）后是否 fdatasync，保证安装到缓存中的文件在掉电后仍然完整
+    bool syncTableWrites = false;
+    // memTable 的大小上限（字节，从 SSTable 头部与 bloom filter 的大小开始计），写满后写出为 level 0 的一个 SSTable；
+    // 小于 MIN_WRITE_BUFFER_SIZE 时按 MIN_WRITE_BUFFER_SIZE 处理
+    uint64_t writeBufferSize = 2 * 1024 * 1024;
+    // compaction 输出到 level 1 的 SSTable 的目标大小（字节），之后每层为上一层的 targetFileSizeMultiplier 倍，
+    // 例如 base 为 2MB、倍数为 4 时 level 4 的文件约为 128MB；universal 模式下按输出的 sorted run 所在层计算
+    uint64_t targetFileSizeBase = 2 * 1024 * 1024;
+    uint64_t targetFileSizeMultiplier = 1;
+    // level 0 文件数达到该值时，每次写入先延迟约 1ms，让后台 compaction 追上写入速度；大于 level0StopTrigger 时按 level0StopTrigger 处理
+    uint64_t level0SlowdownTrigger = 8;
+    // level 0 文件数达到该值时，需要写出 memTable 的写入阻塞，直到后台 compaction 完成；不大于 level0CompactionTrigger 时按 level0CompactionTrigger + 1 处理
+    uint64_t level0StopTrigger = 12;
+    // level 0 文件数达到该值时进行 compaction，0 按 1 处理
+    uint64_t level0CompactionTrigger = 3;
+    // level 1 的目标大小（字节），之后每层的目标大小为上一层的 levelSizeMultiplier 倍
+    uint64_t maxBytesForLevelBase = 8 * 1024 * 1024;
+    uint64_t levelSizeMultiplier = 10;
+    // 由最后一层的实际大小自底向上确定中间各层的目标大小（每层为下一层的 1 / levelSizeMultiplier，不小于 maxBytesForLevelBase），
+    // 使大部分数据位于最后一层；关闭时各层使用固定的目标大小
+    bool dynamicLevelBytes = true;
+
+    CompactionStyle compactionStyle = COMPACTION_STYLE_LEVEL;
+    CompactionPri compactionPri = COMPACTION_PRI_MIN_OVERLAP;
+    // universal：下一个 sorted run 不超过已选总大小的 (100 + universalSizeRatio)% 时一并合并
+    uint64_t universalSizeRatio = 1;
+    // universal：sorted run 个数超过该值时合并
+    uint64_t universalMaxSortedRuns = 8;
+    // universal：除最旧的一个外其余 sorted run 的总大小超过最旧的该百分比时全部合并
+    uint64_t universalMaxSizeAmplificationPercent = 200;
+    // leveled：没有层需要 compaction 时，删除标记占比不低于该值的文件（level 0 以外）单独 compaction，0 为关闭
+    double tombstoneCompactionRatio = 0.5;
+    // 一次 compaction 按下一层文件的边界最多切分成的段数，各段由不同线程并行归并
+    uint64_t maxSubcompactions = 4;
+    // compaction 的写入速度上限（字节/秒），0 为不限速；memTable 的写出计入额度但优先进行
+    uint64_t compactionBytesPerSecond = 0;
+    // compaction 读入输入文件是否也计入限速
+    bool rateLimitCompactionReads = false;
+    // compaction 读入与写出的文件不留在页缓存中，避免冲掉前台读的热数据：
+    // 输入文件读过的部分、输出文件落盘后经 posix_fadvise(DONTNEED) 丢弃，因此输出文件总是 fdatasync；前台读不受影响，只在 Linux 上有效
+    // memTable 的写出在持有 mutex 时进行，不受该选项影响，避免额外的 fdatasync 增加写入延迟
+    bool dropCompactionPageCache = false;
+    // key-value 分离：memTable 写出时不小于该字节数的 value 写入值日志（dir/vlog），SSTable 中只保存指针，compaction 只需搬动指针；0 为关闭
+    uint64_t valueLogThreshold = 0;
+    // 值日志单个文件的大小上限，写满后换新文件，只有写满的文件参与垃圾回收
+    uint64_t valueLogFileSize = 16 * 1024 * 1024;
+    // 值日志文件中失效字节的占比不低于该值时，由后台线程把其中仍有效的 value 重新写入值日志后删除该文件，0 为关闭
+    double valueLogGCRatio = 0.5;
+};
+
+
+#endif //LSM_KV_OPTIONS_H
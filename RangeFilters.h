@@ -0,0 +1,98 @@
+//
+// Created by ENVY on 2022/5/24.
+//
+
+#ifndef LSM_KV_RANGEFILTERS_H
+#define LSM_KV_RANGEFILTERS_H
+
+#include <vector>
+#include <cstdint>
+#include "MurmurHash3.h"
+#include "constant.h"
+
+// 基于 key 位前缀的 Bloom Filter（prefix bloom），用于 scan 时判断 SSTable 在 [key1, key2] 中是否可能有数据
+// 每个 key 按 RANGE_FILTER_MIN_SHIFT, MIN_SHIFT + STEP, ..., MAX_SHIFT 各右移一次得到若干层前缀，全部插入同一个位数组
+// 查询时从最细的一层开始，找到区间覆盖的前缀个数不超过 RANGE_FILTER_MAX_PROBES 的一层，逐个检查这些前缀
+// 都不存在则区间内一定没有 key；区间太宽时无法判断，直接返回可能存在
+class RangeFilters {
+public:
+    // 由有序的 key 序列构建：forEachKey(f) 按 key 从小到大对每个 key 调用 f，
+    // 共调用两次，先统计不同前缀的个数确定位数组大小，再插入各个前缀
+    template<typename ForEachKey>
+    explicit RangeFilters(ForEachKey forEachKey){
+        uint64_t prefixNum = 0;
+        bool first = true;
+        uint64_t last = 0;
+        forEachKey([&](uint64_t key){
+            for(unsigned int shift = RANGE_FILTER_MIN_SHIFT; shift <= RANGE_FILTER_MAX_SHIFT; shift += RANGE_FILTER_SHIFT_STEP){
+                if(first || (key >> shift) != (last >> shift)) ++prefixNum;
+            }
+            first = false;
+            last = key;
+        });
+        uint64_t m = prefixNum * RANGE_FILTER_BITS_PER_PREFIX;
+        if(m < 64) m = 64;
+        bits.assign((m + 63) / 64, 0);
+        first = true;
+        forEachKey([&](uint64_t key){
+            for(unsigned int shift = RANGE_FILTER_MIN_SHIFT; shift <= RANGE_FILTER_MAX_SHIFT; shift += RANGE_FILTER_SHIFT_STEP){
+                if(first || (key >> shift) != (last >> shift)) set(key >> shift, shift);
+            }
+            first = false;
+            last = key;
+        });
+    }
+    // 从文件中读出的位数组直接恢复
+    RangeFilters(const uint64_t *words, uint64_t wordNum) : bits(words, words + wordNum) {}
+
+    bool mayContain(uint64_t key1, uint64_t key2){
+        if(key1 > key2) return false;
+        if(bits.empty()) return true;
+        for(unsigned int shift = RANGE_FILTER_MIN_SHIFT; shift <= RANGE_FILTER_MAX_SHIFT; shift += RANGE_FILTER_SHIFT_STEP){
+            uint64_t lo = key1 >> shift;
+            uint64_t hi = key2 >> shift;
+            if(hi - lo >= RANGE_FILTER_MAX_PROBES) continue;
+            for(uint64_t prefix = lo; ; ++prefix){
+                if(find(prefix, shift)) return true;
+                if(prefix == hi) break;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    const std::vector<uint64_t> &getWords(){return bits;};
+
+private:
+    static const unsigned int k = 3;  // 每个前缀使用的哈希函数个数
+    std::vector<uint64_t> bits;
+    uint64_t hash[2] = {0};
+
+    void doHash(uint64_t prefix, unsigned int shift){
+        // 不同层的前缀数值可能相同，把层号一并哈希
+        uint64_t data[2] = {prefix, shift};
+        MurmurHash3_x64_128(data, sizeof(data), 2, hash);
+    }
+    // 双重哈希得到 k 个位置
+    uint64_t position(unsigned int i){
+        return (hash[0] + i * hash[1]) % (bits.size() * 64);
+    }
+    void set(uint64_t prefix, unsigned int shift){
+        doHash(prefix, shift);
+        for(unsigned int i = 0; i < k; ++i){
+            uint64_t pos = position(i);
+            bits[pos / 64] |= (1ULL << (pos % 64));
+        }
+    }
+    bool find(uint64_t prefix, unsigned int shift){
+        doHash(prefix, shift);
+        for(unsigned int i = 0; i < k; ++i){
+            uint64_t pos = position(i);
+            if(!(bits[pos / 64] & (1ULL << (pos % 64)))) return false;
+        }
+        return true;
+    }
+};
+
+
+#endif //LSM_KV_RANGEFILTERS_H
@@ -0,0 +1,92 @@
+//
+// Created by ENVY on 2022/5/20.
+//
+
+#ifndef LSM_KV_RANGETOMBSTONES_H
+#define LSM_KV_RANGETOMBSTONES_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+// 范围删除标记集合，每个区间 [begin, end] 为闭区间
+// 内部按 begin 有序保存，重叠或相邻的区间在插入时即合并，因此任意 key 至多落在一个区间内
+class RangeTombstones {
+public:
+    void add(uint64_t begin, uint64_t end){
+        if(begin > end) return;
+        // 找到第一个可能与 [begin, end] 重叠或相邻的区间
+        auto it = std::lower_bound(ranges.begin(), ranges.end(), begin,
+                                   [](const std::pair<uint64_t, uint64_t> &a, uint64_t key){
+                                       return a.second < key && a.second + 1 < key;
+                                   });
+        auto last = it;
+        while(last != ranges.end() && (end == UINT64_MAX || last->first <= end + 1)){
+            begin = std::min(begin, last->first);
+            end = std::max(end, last->second);
+            ++last;
+        }
+        it = ranges.erase(it, last);
+        ranges.insert(it, std::make_pair(begin, end));
+    }
+    void add(const RangeTombstones &other){
+        for(auto it = other.ranges.begin(); it != other.ranges.end(); ++it){
+            add(it->first, it->second);
+        }
+    }
+
+    // key 是否落在某个区间内
+    bool covers(uint64_t key) const{
+        auto it = findRange(key);
+        return it != ranges.end() && it->second >= key;
+    }
+    // [begin, end] 是否整体落在某个区间内
+    bool coversRange(uint64_t begin, uint64_t end) const{
+        auto it = findRange(begin);
+        return it != ranges.end() && it->second >= end;
+    }
+    // 是否有区间与 [begin, end] 相交
+    bool intersects(uint64_t begin, uint64_t end) const{
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), end,
+                                   [](uint64_t key, const std::pair<uint64_t, uint64_t> &a){ return key < a.first; });
+        return it != ranges.begin() && (it - 1)->second >= begin;
+    }
+
+    // 取出所有起点不大于 upto 的区间放入 out，跨过 upto 的区间在 upto 处切开，剩余部分保留
+    // 用于 compaction 输出时将删除标记按 key 顺序分配给各个 SSTable
+    void takeUpTo(uint64_t upto, RangeTombstones &out){
+        auto it = ranges.begin();
+        while(it != ranges.end() && it->first <= upto){
+            if(it->second <= upto){
+                out.add(it->first, it->second);
+                ++it;
+            } else {
+                out.add(it->first, upto);
+                it->first = upto + 1;
+                break;
+            }
+        }
+        ranges.erase(ranges.begin(), it);
+    }
+
+    bool empty() const {return ranges.empty();};
+    uint64_t size() const {return ranges.size();};
+    void clear(){ranges.clear();};
+    uint64_t getMinKey() const {return ranges.front().first;};
+    uint64_t getMaxKey() const {return ranges.back().second;};
+    const std::vector<std::pair<uint64_t, uint64_t> > &getRanges() const {return ranges;};
+
+private:
+    std::vector<std::pair<uint64_t, uint64_t> > ranges;
+
+    // 返回 begin 不大于 key 的最后一个区间，不存在时返回 end()
+    std::vector<std::pair<uint64_t, uint64_t> >::const_iterator findRange(uint64_t key) const{
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), key,
+                                   [](uint64_t k, const std::pair<uint64_t, uint64_t> &a){ return k < a.first; });
+        if(it == ranges.begin()) return ranges.end();
+        return it - 1;
+    }
+};
+
+
+#endif //LSM_KV_RANGETOMBSTONES_H
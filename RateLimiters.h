@@ -0,0 +1,80 @@
+//
+// Created by ENVY on 2022/5/28.
+//
+
+#ifndef LSM_KV_RATELIMITERS_H
+#define LSM_KV_RATELIMITERS_H
+
+#include "constant.h"
+#include <cstdint>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// 令牌桶限速器，限制 compaction 的读写速度，避免突发的 compaction I/O 占满磁盘带宽、拖慢前台的 get
+// 每秒补充 bytesPerSecond 字节的额度，最多积累一秒的额度；bytesPerSecond 为 0 时不限速
+// 低优先级（compaction）的请求先扣除额度，额度为负时按先后顺序等待到补足为止，期间调整速度时按新的速度重新计算；
+// 高优先级（memTable 写出）的请求扣除额度但从不等待，欠下的额度由之后的 compaction 等待偿还
+class RateLimiters {
+public:
+    explicit RateLimiters(uint64_t bytesPerSecond = 0): bytesPerSecond(bytesPerSecond), available(bytesPerSecond), lastRefill(std::chrono::steady_clock::now()) {}
+
+    // 运行时调整速度，唤醒等待中的请求；改为不限速时免除欠下的额度，等待中的请求立即返回
+    void setBytesPerSecond(uint64_t rate){
+        std::lock_guard<std::mutex> lock(mutex);
+        refill();
+        bytesPerSecond = rate;
+        if(available > (double)rate || rate == 0) available = rate;
+        rateChanged.notify_all();
+    }
+    uint64_t getBytesPerSecond(){
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytesPerSecond;
+    }
+
+    // 申请读写 bytes 字节，必要时等待
+    void request(uint64_t bytes, bool highPriority){
+        std::unique_lock<std::mutex> lock(mutex);
+        if(bytesPerSecond == 0) return;
+        refill();
+        available -= (double)bytes;
+        if(highPriority || available >= 0) return;
+        // 累计补充的额度达到 target 时轮到本次请求
+        double target = refilled - available;
+        while(bytesPerSecond != 0 && refilled < target){
+            auto wait = std::min<uint64_t>((uint64_t)((target - refilled) * 1000000 / bytesPerSecond) + 1, RATE_LIMITER_WAIT_SLICE_MICROS);
+            auto start = std::chrono::steady_clock::now();
+            rateChanged.wait_for(lock, std::chrono::microseconds(wait));
+            throttledMicros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            refill();
+        }
+    }
+
+    // 低优先级请求累计等待的时长（微秒）
+    uint64_t getThrottledMicros(){
+        std::lock_guard<std::mutex> lock(mutex);
+        return throttledMicros;
+    }
+
+private:
+    std::mutex mutex;
+    uint64_t bytesPerSecond;
+    double available;  // 当前额度，可以为负
+    double refilled = 0;  // 累计补充的额度（不受一秒额度上限的限制），等待中的请求按它排队
+    std::chrono::steady_clock::time_point lastRefill;
+    uint64_t throttledMicros = 0;
+    std::condition_variable rateChanged;
+
+    void refill(){
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - lastRefill).count();
+        lastRefill = now;
+        available += seconds * bytesPerSecond;
+        refilled += seconds * bytesPerSecond;
+        if(available > (double)bytesPerSecond) available = bytesPerSecond;
+    }
+};
+
+
+#endif //LSM_KV_RATELIMITERS_H
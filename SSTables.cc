@@ -6,52 +6,242 @@
 
 #include <iostream>
 #include <cassert>
-
-SSTables::SSTables(const std::string dir, std::list<std::pair<uint64_t, std::string> > &allList, uint64_t &minKey, uint64_t &maxKey, uint64_t &numKey, const uint64_t &timeStamp, const std::string fileName){
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define SSTABLES_USE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// 写出文件使用 writev 与 fdatasync，不支持时经 ofstream 写出
+#if defined(__linux__) || defined(__APPLE__)
+#define SSTABLES_USE_WRITEV
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#endif
+
+#if defined(__linux__)
+#define SSTABLES_USE_FADVISE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#define SSTABLES_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+SSTables::SSTables(const std::string dir, SSTableBuilders &builder, uint64_t minKey, uint64_t maxKey, const uint64_t &timeStamp, const std::string fileName, const RangeTombstones &rangeTombstones, bool withRangeFilter, ChecksumVerification verification, bool syncWrite, bool dropCache){
+    this->verification = verification;
     this->fileName = fileName;
     this->dir = dir;
+    this->rangeTombstones = rangeTombstones;
     header.minKey = minKey;
     header.maxKey = maxKey;
-    header.pairsNum = numKey;
+    header.pairsNum = builder.pairsNum;
     header.timeStamp = timeStamp;
-    // std::cout << "header.pairsNum: " << header.pairsNum << std::endl;
-    bloomFilter = new BloomFilters(header.pairsNum);
-    auto it= allList.begin();
-    while(it != allList.end())
-    {
-        bloomFilter->set(it->first);
-        ++it;
-    }
+    deletedNum = builder.deletedNum;
+    // bloom filter 已在 builder 中随 key 的加入生成
+    bloomFilter = builder.bloomFilter;
+    builder.bloomFilter = nullptr;
+    if(withRangeFilter) rangeFilter = new RangeFilters([&](auto f){ builder.forEachKey(f); });
 
-    // Index is written in writeIndexAndData
-    writeSSTable( allList);
+    writeSSTable(builder, syncWrite, dropCache);
 }
 
-SSTables::SSTables(const std::string dir, const std::string fileName)
+SSTables::SSTables(const std::string dir, const std::string fileName, ChecksumVerification verification)
 {
     this->dir = dir;
     this->fileName = fileName;
+    this->verification = verification;
     readSSTable();
 }
 
-void SSTables::writeSSTable(std::list<std::pair<uint64_t, std::string> > &allList)
+void SSTables::relocate(const std::string &newDir, const std::string &newFileName)
+{
+    if(!utils::dirExists(newDir)) {
+        utils::mkdir(newDir.c_str());
+    }
+    std::string newPath = newDir + "/" + newFileName + ".sst";
+    if(std::rename(getFilePath().c_str(), newPath.c_str())) throw("ERROR  SSTables::relocate rename failed");
+    this->dir = newDir;
+    this->fileName = newFileName;
+}
+
+// 已经结束的数据块由 builder 写入了临时文件，这里写出剩下的块、meta 段与 footer，再补上文件开头的 header 与 bloom filter，
+// 落盘后把临时文件改名为本文件，内存中只保留块索引
+void SSTables::writeSSTable(SSTableBuilders &builder, bool sync, bool dropCache)
 {
     if(!utils::dirExists(dir)) {
         utils::mkdir(dir.c_str());
     }
-    std::string filepath = dir + "/" + this->fileName + ".sst";
-    std::ofstream ostrm(filepath, std::ios::binary);
 
-    // Header
-    writeHeader(ostrm);
+    // Header 与 BloomFilter，之后补 0 到 INIT_BYTES_SIZE，计算校验和
+    std::string head(INIT_BYTES_SIZE, '\0');
+    char* p = &head[0];
+    writeHeader(p);
+    writeBloomFilter(p);
+    headerOnlyChecksum = Checksums::crc32c(head.data(), sizeof(Header));
+    filterChecksum = Checksums::crc32c(head.data() + sizeof(Header), INIT_BYTES_SIZE - sizeof(Header));
+    headerChecksum = Checksums::crc32c(head.data() + sizeof(Header), INIT_BYTES_SIZE - sizeof(Header), headerOnlyChecksum);
+    checksummed = true;
+    hasFilterChecksum = true;
+
+    // Data，块索引中已是在文件中的位置
+    builder.finishBlock();
+    dataEnd = builder.flushedBytes + builder.data.size();
+    formatVersion = builder.hasFixedBlocks ? 4 : 3;
+    codec = builder.codec;
+    rawDataBytes = builder.rawDataBytes;
+    blocks = builder.blocks;
+
+    // Meta and Footer
+    std::string meta;
+    writeMetaAndFooter(meta);
+
+    std::vector<std::pair<const char*, uint64_t> > parts;
+    parts.push_back(std::make_pair(builder.data.data(), builder.data.size()));
+    parts.push_back(std::make_pair(meta.data(), meta.size()));
+    builder.writer.append(parts);
+    builder.writer.writeAt(0, head.data(), head.size());
+    builder.writer.finish(sync, dropCache);
+    if(std::rename(builder.writer.getPath().c_str(), getFilePath().c_str())) throw("ERROR  SSTables::writeSSTable rename failed");
+}
 
-    // BloomFilter
-    writeBloomFilter(ostrm);
+SSTableWriters::SSTableWriters(const std::string &path, RateLimiters* rateLimiter, bool highPriority): path(path), rateLimiter(rateLimiter), highPriority(highPriority)
+{
+#ifdef SSTABLES_USE_WRITEV
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) throw("ERROR  SSTableWriters open failed");
+#else
+    ostrm.open(path, std::ios::binary);
+    if(!ostrm) throw("ERROR  SSTableWriters open failed");
+#endif
+}
 
-    // Index and Data
-    writeIndexAndData(ostrm, allList);
+SSTableWriters::~SSTableWriters()
+{
+    if(finished) return;
+#ifdef SSTABLES_USE_WRITEV
+    if(fd >= 0) close(fd);
+#else
+    ostrm.close();
+#endif
+    std::remove(path.c_str());
+}
 
+// 支持 POSIX 时用 writev 写出（处理部分写入与 EINTR），否则经 ofstream 依次写出
+// 限速时各段切成不超过 RATE_LIMITER_WRITE_CHUNK_BYTES 的片，每次写出不超过该字节数，写出前申请额度
+void SSTableWriters::append(const std::vector<std::pair<const char*, uint64_t> > &parts)
+{
+    uint64_t chunk = (rateLimiter != nullptr && rateLimiter->getBytesPerSecond() != 0) ? RATE_LIMITER_WRITE_CHUNK_BYTES : UINT64_MAX;
+#ifdef SSTABLES_USE_WRITEV
+    std::vector<struct iovec> iov;
+    for(auto it = parts.begin(); it != parts.end(); ++it){
+        for(uint64_t pos = 0; pos < it->second; pos += iov.back().iov_len){
+            struct iovec part;
+            part.iov_base = const_cast<char*>(it->first + pos);
+            part.iov_len = std::min(it->second - pos, chunk);
+            iov.push_back(part);
+        }
+    }
+    size_t first = 0;
+    // 已申请额度但上次只写出一部分的字节数
+    uint64_t prepaid = 0;
+    while(first < iov.size()){
+        // 本次写出 [first, last) 中的各片，总长不超过 chunk（至少一片）
+        size_t last = first;
+        uint64_t bytes = 0;
+        while(last < iov.size() && last - first < IOV_MAX && (last == first || bytes + iov[last].iov_len <= chunk)){
+            bytes += iov[last].iov_len;
+            ++last;
+        }
+        if(rateLimiter != nullptr && bytes > prepaid) rateLimiter->request(bytes - prepaid, highPriority);
+        prepaid = std::max(bytes, prepaid);
+        ssize_t written = writev(fd, &iov[first], (int)(last - first));
+        if(written < 0){
+            if(errno == EINTR) continue;
+            throw("ERROR  SSTableWriters::append write failed");
+        }
+        prepaid -= written;
+        // 跳过已经写完的片，剩余部分从未写完的片中间继续
+        size_t rest = written;
+        while(first < iov.size() && rest >= iov[first].iov_len){
+            rest -= iov[first].iov_len;
+            ++first;
+        }
+        if(first < iov.size()){
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + rest;
+            iov[first].iov_len -= rest;
+        }
+    }
+#else
+    for(auto it = parts.begin(); it != parts.end(); ++it){
+        uint64_t bytes;
+        for(uint64_t pos = 0; pos < it->second; pos += bytes){
+            bytes = std::min(it->second - pos, chunk);
+            if(rateLimiter != nullptr) rateLimiter->request(bytes, highPriority);
+            ostrm.write(it->first + pos, bytes);
+        }
+    }
+    if(!ostrm) throw("ERROR  SSTableWriters::append write failed");
+#endif
+}
+
+void SSTableWriters::writeAt(uint64_t offset, const char* data, uint64_t size)
+{
+    if(rateLimiter != nullptr) rateLimiter->request(size, highPriority);
+#ifdef SSTABLES_USE_WRITEV
+    while(size > 0){
+        ssize_t written = pwrite(fd, data, size, offset);
+        if(written < 0){
+            if(errno == EINTR) continue;
+            throw("ERROR  SSTableWriters::writeAt write failed");
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+#else
+    ostrm.seekp(offset);
+    ostrm.write(data, size);
+    ostrm.seekp(0, std::ios::end);
+    if(!ostrm) throw("ERROR  SSTableWriters::writeAt write failed");
+#endif
+}
+
+// 脏页不能直接丢弃，dropCache 时总是先 fdatasync
+void SSTableWriters::finish(bool sync, bool dropCache)
+{
+#ifdef SSTABLES_USE_WRITEV
+#ifdef SSTABLES_USE_FADVISE
+    if(dropCache) sync = true;
+#endif
+#ifdef __APPLE__
+    int synced = sync ? fsync(fd) : 0;
+#else
+    int synced = sync ? fdatasync(fd) : 0;
+#endif
+#ifdef SSTABLES_USE_FADVISE
+    if(dropCache && synced == 0) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    int closed = close(fd);
+    fd = -1;
+    if(closed != 0 || synced != 0) throw("ERROR  SSTableWriters::finish sync or close failed");
+#else
+    ostrm.flush();
     ostrm.close();
+    if(!ostrm) throw("ERROR  SSTableWriters::finish write failed");
+#endif
+    finished = true;
 }
 
 void SSTables::readSSTable()
@@ -64,21 +254,48 @@ void SSTables::readSSTable()
 
     // Header
     readHeader(istrm);
-    // BloomFilter
-    readBloomFilter(istrm);
-    // Index
-    readAllIndex(istrm);
+    // Meta and Footer
+    readMetaAndFooter(istrm);
+    // 先确认 header 可信，再按其中的 pairsNum 读入
+    if(checksummed && verification != CHECKSUM_VERIFY_NEVER) verifyHeader(istrm);
+    // BloomFilter 在第一次 find 时才载入（并检查校验和）
+    // Index，v2 及以后格式只有 meta 段中的块索引
+    if(formatVersion == 1){
+        // 没有校验和的旧文件，至少保证索引区在数据区之内
+        if(dataEnd < INIT_BYTES_SIZE || header.pairsNum > (dataEnd - INIT_BYTES_SIZE) / (KEY_BYTES_SIZE + OFFSET_BYTES_SIZE)) throw("ERROR  SSTables::readSSTable pairsNum out of range");
+        readAllIndex(istrm);
+    } else {
+        uint64_t pairsNum = blocks.empty() ? 0 : blocks.back().firstOrdinal + blocks.back().entryNum;
+        if(pairsNum != header.pairsNum) throw("ERROR  SSTables::readSSTable block index does not match header");
+    }
 
     istrm.close();
 }
 
-void SSTables::writeHeader(std::ofstream &ostrm)
+void SSTables::verifyHeader(std::ifstream &istrm)
+{
+    // header 已经读入，重新编码后计算，不必再读文件
+    if(hasFilterChecksum){
+        char head[sizeof(Header)];
+        char* p = head;
+        writeHeader(p);
+        if(Checksums::crc32c(head, sizeof(Header)) != headerOnlyChecksum) throw("ERROR  SSTables::verifyHeader header checksum mismatch");
+        return;
+    }
+    std::vector<char> head(INIT_BYTES_SIZE);
+    istrm.seekg(0, std::ios::beg);
+    istrm.read(head.data(), head.size());
+    if(!istrm || Checksums::crc32c(head.data(), head.size()) != headerChecksum) throw("ERROR  SSTables::verifyHeader header or bloom filter checksum mismatch");
+}
+
+void SSTables::writeHeader(char* &dst)
 {
     // Header
-    ostrm.write(reinterpret_cast<char*>(&header.timeStamp), sizeof(header.timeStamp));
-    ostrm.write(reinterpret_cast<char*>(&header.pairsNum), sizeof(header.pairsNum));
-    ostrm.write(reinterpret_cast<char*>(&header.minKey), sizeof(header.minKey));
-    ostrm.write(reinterpret_cast<char*>(&header.maxKey), sizeof(header.maxKey));
+    memcpy(dst, &header.timeStamp, sizeof(header.timeStamp));
+    memcpy(dst + 8, &header.pairsNum, sizeof(header.pairsNum));
+    memcpy(dst + 16, &header.minKey, sizeof(header.minKey));
+    memcpy(dst + 24, &header.maxKey, sizeof(header.maxKey));
+    dst += sizeof(Header);
 
     /*std::cout << "WRITE header.timeStamp " << header.timeStamp
               << " header.pairsNum " << header.pairsNum
@@ -86,7 +303,7 @@ void SSTables::writeHeader(std::ofstream &ostrm)
               << " header.maxKey " << header.maxKey << std::endl;*/
 }
 
-void SSTables::writeBloomFilter(std::ofstream &ostrm)
+void SSTables::writeBloomFilter(char* &dst)
 {
     if(bloomFilter == nullptr) throw("ERROR null bloomFilter !");
     uint64_t size = bloomFilter->getSize();
@@ -94,71 +311,110 @@ void SSTables::writeBloomFilter(std::ofstream &ostrm)
         std::cout << "bloomFilter->getSize(): " << size << std::endl;
         throw("ERROR bloomFilter size larger than BF_BYTES_SIZE !");
     }
-    uint64_t times = size / BITS_IN_BYTE;
-    int restBitNum = size % BITS_IN_BYTE;
-    uint64_t index = 0;
-    bool val[BITS_IN_BYTE] = {false};
-    char packedVal = 0;
-    while(index < times){
-        for(int i = 0; i < BITS_IN_BYTE; ++i){
-            val[i] = bloomFilter->getBit((index * BITS_IN_BYTE) + i);
-            // std::cout << "bloomFilter index: " << ((index * BITS_IN_BYTE) + i) << " bitVal: " << val[i] << std::endl;
+    // 位数组按 64 位字整体拷贝
+    memcpy(dst, bloomFilter->getData(), size / BITS_IN_BYTE);
+    dst += size / BITS_IN_BYTE;
+}
+
+void SSTables::writeMetaAndFooter(std::string &out)
+{
+    // meta 段先写入内存，计算校验和后与校验和段、footer 一起追加到 out
+    std::ostringstream metaStrm;
+
+    // 范围删除标记段：count (8B) | (begin, end) * count
+    if(!rangeTombstones.empty()){
+        uint32_t type = META_RANGE_TOMBSTONES;
+        uint64_t count = rangeTombstones.size();
+        uint64_t length = sizeof(count) + count * RANGE_TOMBSTONE_BYTES_SIZE;
+        metaStrm.write(reinterpret_cast<char*>(&type), sizeof(type));
+        metaStrm.write(reinterpret_cast<char*>(&length), sizeof(length));
+        metaStrm.write(reinterpret_cast<char*>(&count), sizeof(count));
+        for(auto it = rangeTombstones.getRanges().begin(); it != rangeTombstones.getRanges().end(); ++it){
+            metaStrm.write(reinterpret_cast<const char*>(&it->first), sizeof(it->first));
+            metaStrm.write(reinterpret_cast<const char*>(&it->second), sizeof(it->second));
         }
-        packedVal = PACK_BYTE(val);
-        ostrm.write((char*)&packedVal, 1);
-        ++index;
     }
-    for(int i = 0; i < BITS_IN_BYTE; ++i){
-        if(i >= restBitNum) val[i] = 0;
-        else val[i] = bloomFilter->getBit((index * BITS_IN_BYTE) + i);
-        // std::cout << "bloomFilter index: " << ((index * BITS_IN_BYTE) + i) << " bitVal: " << val[i] << std::endl;
+
+    // RangeFilter 段：wordNum (8B) | 位数组（按 64 位字写入）
+    if(rangeFilter != nullptr){
+        uint32_t type = META_RANGE_FILTER;
+        const std::vector<uint64_t> &words = rangeFilter->getWords();
+        uint64_t wordNum = words.size();
+        uint64_t length = sizeof(wordNum) + wordNum * sizeof(uint64_t);
+        metaStrm.write(reinterpret_cast<char*>(&type), sizeof(type));
+        metaStrm.write(reinterpret_cast<char*>(&length), sizeof(length));
+        metaStrm.write(reinterpret_cast<char*>(&wordNum), sizeof(wordNum));
+        metaStrm.write(reinterpret_cast<const char*>(words.data()), wordNum * sizeof(uint64_t));
     }
-    packedVal = PACK_BYTE(val);
-    ostrm.write((char*)&packedVal, 1);
-}
 
-void SSTables::writeIndexAndData(std::ofstream &ostrm, std::list<std::pair<uint64_t, std::string> > &allList)
-{
-    // 索引区总长度计算
-    uint64_t indexLength = (KEY_BYTES_SIZE + OFFSET_BYTES_SIZE) * header.pairsNum;
+    // 表属性段：deletedNum (8B) | rawDataBytes (8B) | codec (4B)
+    {
+        uint32_t type = META_TABLE_PROPERTIES;
+        uint64_t length = sizeof(deletedNum) + sizeof(rawDataBytes) + sizeof(codec);
+        metaStrm.write(reinterpret_cast<char*>(&type), sizeof(type));
+        metaStrm.write(reinterpret_cast<char*>(&length), sizeof(length));
+        metaStrm.write(reinterpret_cast<char*>(&deletedNum), sizeof(deletedNum));
+        metaStrm.write(reinterpret_cast<char*>(&rawDataBytes), sizeof(rawDataBytes));
+        metaStrm.write(reinterpret_cast<char*>(&codec), sizeof(codec));
+    }
 
-    // 索引区和数据区开头位置计算
-    uint64_t posIndex = INIT_BYTES_SIZE;
-    uint64_t posData = indexLength + INIT_BYTES_SIZE;
+    // 块索引段：count (8B) | (varint(lastKey 与上一块之差), varint(块长度), varint(entryNum)) * count
+    {
+        uint32_t type = META_BLOCK_INDEX;
+        uint64_t count = blocks.size();
+        std::string payload;
+        uint64_t lastKey = 0;
+        for(uint64_t b = 0; b < count; ++b){
+            putVarint(payload, blocks[b].lastKey - lastKey);
+            putVarint(payload, getBlockEnd(b) - blocks[b].offset);
+            putVarint(payload, blocks[b].entryNum);
+            lastKey = blocks[b].lastKey;
+        }
+        uint64_t length = sizeof(count) + payload.size();
+        metaStrm.write(reinterpret_cast<char*>(&type), sizeof(type));
+        metaStrm.write(reinterpret_cast<char*>(&length), sizeof(length));
+        metaStrm.write(reinterpret_cast<char*>(&count), sizeof(count));
+        metaStrm.write(payload.data(), payload.size());
+    }
 
-    std::pair<uint64_t, std::string> tmp;
-    uint64_t tmpKey;
-    char* tmpVal;
-    uint32_t tmpValSize;
-    uint32_t offset;  // 数据起始位置与文件开头 ios::beg 的距离
-    // 写入索引区和数据区
-    while (!allList.empty()){
-
-        tmp = allList.front();
-        tmpKey = tmp.first;
-        tmpValSize = tmp.second.length();
-        tmpVal = new char [tmpValSize + 1];
-        strcpy(tmpVal, tmp.second.c_str());
-        allList.pop_front();
-        ostrm.seekp(posIndex, std::ios::beg);
-        // 写入 Key
-        ostrm.write(reinterpret_cast<char*>(&tmpKey), KEY_BYTES_SIZE);
-        // 写入 Offset
-        offset = posData;
-        ostrm.write(reinterpret_cast<char*>(&(offset)), OFFSET_BYTES_SIZE);
-        posIndex += (KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-        // add in index
-        Index tmp;
-        tmp.key = tmpKey;
-        tmp.offset = offset;
-        index.push_back(tmp);
-        ostrm.seekp(posData, std::ios::beg);
-        // 写入 Value
-        ostrm.write(reinterpret_cast<char*>(tmpVal), tmpValSize);
-        posData += tmpValSize;
-        // std::cout << "WRITE   KEY: " << tmpKey << " offset: " << offset << " tmpVal: " << tmpVal << std::endl;
-        delete tmpVal;
+    // header 与 bloom filter 分开的校验和段
+    {
+        uint32_t type = META_FILTER_CHECKSUMS;
+        uint64_t length = 2 * CHECKSUM_BYTES_SIZE;
+        metaStrm.write(reinterpret_cast<char*>(&type), sizeof(type));
+        metaStrm.write(reinterpret_cast<char*>(&length), sizeof(length));
+        metaStrm.write(reinterpret_cast<char*>(&headerOnlyChecksum), sizeof(headerOnlyChecksum));
+        metaStrm.write(reinterpret_cast<char*>(&filterChecksum), sizeof(filterChecksum));
     }
+
+    // 校验和段：之前各 meta 段的校验和、各块的校验和，最后是本段自身的校验和
+    std::string meta = metaStrm.str();
+    {
+        uint32_t type = META_CHECKSUMS;
+        uint64_t count = blocks.size();
+        uint64_t length = 2 * CHECKSUM_BYTES_SIZE + sizeof(count) + count * CHECKSUM_BYTES_SIZE + CHECKSUM_BYTES_SIZE;
+        uint32_t metaChecksum = Checksums::crc32c(meta.data(), meta.size());
+        std::string section;
+        section.append(reinterpret_cast<char*>(&type), sizeof(type));
+        section.append(reinterpret_cast<char*>(&length), sizeof(length));
+        section.append(reinterpret_cast<char*>(&headerChecksum), sizeof(headerChecksum));
+        section.append(reinterpret_cast<char*>(&metaChecksum), sizeof(metaChecksum));
+        section.append(reinterpret_cast<char*>(&count), sizeof(count));
+        for(auto it = blocks.begin(); it != blocks.end(); ++it){
+            section.append(reinterpret_cast<const char*>(&it->checksum), sizeof(it->checksum));
+        }
+        uint32_t sectionChecksum = Checksums::crc32c(section.data(), section.size());
+        section.append(reinterpret_cast<char*>(&sectionChecksum), sizeof(sectionChecksum));
+        meta.append(section);
+    }
+    out.append(meta);
+
+    // Footer
+    uint64_t metaOffset = dataEnd;
+    uint64_t magic = (formatVersion == 4) ? SSTABLE_MAGIC_V4 : SSTABLE_MAGIC_V3;
+    out.append(reinterpret_cast<char*>(&metaOffset), sizeof(metaOffset));
+    out.append(reinterpret_cast<char*>(&magic), sizeof(magic));
+    fileSize = dataEnd + out.size();
 }
 
 void SSTables::readHeader(std::ifstream &istrm)
@@ -167,6 +423,7 @@ void SSTables::readHeader(std::ifstream &istrm)
     istrm.read(reinterpret_cast<char*>(&header.pairsNum), sizeof(header.pairsNum));
     istrm.read(reinterpret_cast<char*>(&header.minKey), sizeof(header.minKey));
     istrm.read(reinterpret_cast<char*>(&header.maxKey), sizeof(header.maxKey));
+    if(!istrm) throw("ERROR  SSTables::readHeader file too short");
 
     // if(header.timeStamp != 0) std::cout << "READ header.timeStamp " << header.timeStamp << std::endl;
     /*std::cout << "READ header.timeStamp " << header.timeStamp
@@ -174,36 +431,198 @@ void SSTables::readHeader(std::ifstream &istrm)
               << " header.minKey " << header.minKey
               << " header.maxKey " << header.maxKey << std::endl;*/
 }
-void SSTables::readBloomFilter(std::ifstream &istrm)
+void SSTables::readMetaAndFooter(std::ifstream &istrm)
 {
-    if(bloomFilter != nullptr) delete bloomFilter;
-    bloomFilter = new BloomFilters(header.pairsNum);
-    uint64_t size = bloomFilter->getSize();
-
-    uint64_t times = size / BITS_IN_BYTE;
-    int restBitNum = size % BITS_IN_BYTE;
-    uint64_t index = 0;
-    bool val[BITS_IN_BYTE] = {false};
-    char packedVal = 0;
-    while(index < times){
-        istrm.read((char*)&packedVal, 1);
-        for(int i = 0; i < BITS_IN_BYTE; ++i){
-            val[i] = GET_BIT(i,packedVal);
-            bloomFilter->setBit(((index * BITS_IN_BYTE) + i), val[i]);
-            // std::cout << "bloomFilter index: " << ((index * BITS_IN_BYTE) + i) << " bitVal: " << val[i] << std::endl;
+    istrm.seekg(0, std::ios::end);
+    uint64_t fileSize = istrm.tellg();
+    dataEnd = fileSize;
+    this->fileSize = fileSize;
+    rangeTombstones.clear();
+    deletedNum = 0;
+    formatVersion = 1;
+    blocks.clear();
+    loadedBlock = -1;
+    hasFoundEntry = false;
+    codec = BLOCK_CODEC_NONE;
+    // 没有记录压缩前大小的旧文件，数据区没有压缩
+    rawDataBytes = (fileSize > INIT_BYTES_SIZE) ? fileSize - INIT_BYTES_SIZE : 0;
+    decodedBlockIndex = -1;
+    bool hasRawDataBytes = false;
+    if(rangeFilter != nullptr) { delete rangeFilter; rangeFilter = nullptr; }
+    checksummed = false;
+    hasFilterChecksum = false;
+    if(fileSize < INIT_BYTES_SIZE + FOOTER_BYTES_SIZE) return;
+
+    uint64_t metaOffset, magic;
+    istrm.seekg(fileSize - FOOTER_BYTES_SIZE, std::ios::beg);
+    istrm.read(reinterpret_cast<char*>(&metaOffset), sizeof(metaOffset));
+    istrm.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    // 没有 footer 的旧格式文件
+    if((magic != SSTABLE_MAGIC && magic != SSTABLE_MAGIC_V2 && magic != SSTABLE_MAGIC_V3 && magic != SSTABLE_MAGIC_V4) || metaOffset < INIT_BYTES_SIZE || metaOffset > fileSize - FOOTER_BYTES_SIZE) return;
+    dataEnd = metaOffset;
+    if(magic == SSTABLE_MAGIC_V2) formatVersion = 2;
+    if(magic == SSTABLE_MAGIC_V3) formatVersion = 3;
+    if(magic == SSTABLE_MAGIC_V4) formatVersion = 4;
+
+    // 整个 meta 区一次读入
+    uint64_t metaEnd = fileSize - FOOTER_BYTES_SIZE;
+    std::vector<char> meta(metaEnd - metaOffset);
+    istrm.seekg(metaOffset, std::ios::beg);
+    istrm.read(meta.data(), meta.size());
+    if(!istrm) throw("ERROR  SSTables::readMetaAndFooter read meta failed");
+
+    // 先找到校验和段（总是最后一段），检查通过后再解析其余各段
+    uint64_t pos = 0;
+    uint64_t checksumPos = meta.size();
+    while(pos + META_HEADER_BYTES_SIZE <= meta.size()){
+        uint32_t type;
+        uint64_t length;
+        memcpy(&type, &meta[pos], sizeof(type));
+        memcpy(&length, &meta[pos + sizeof(type)], sizeof(length));
+        if(length > meta.size() - pos - META_HEADER_BYTES_SIZE) throw("ERROR  SSTables::readMetaAndFooter meta length out of range");
+        if(type == META_CHECKSUMS) checksumPos = pos;
+        pos += META_HEADER_BYTES_SIZE + length;
+    }
+    std::vector<uint32_t> blockChecksums;
+    if(checksumPos < meta.size()){
+        const char* p = &meta[checksumPos + META_HEADER_BYTES_SIZE];
+        uint64_t length;
+        memcpy(&length, &meta[checksumPos + sizeof(uint32_t)], sizeof(length));
+        uint32_t metaChecksum, sectionChecksum;
+        uint64_t count;
+        if(length < 3 * CHECKSUM_BYTES_SIZE + sizeof(count)) throw("ERROR  SSTables::readMetaAndFooter bad checksums");
+        memcpy(&headerChecksum, p, CHECKSUM_BYTES_SIZE);
+        memcpy(&metaChecksum, p + CHECKSUM_BYTES_SIZE, CHECKSUM_BYTES_SIZE);
+        memcpy(&count, p + 2 * CHECKSUM_BYTES_SIZE, sizeof(count));
+        if(count != (length - 3 * CHECKSUM_BYTES_SIZE - sizeof(count)) / CHECKSUM_BYTES_SIZE) throw("ERROR  SSTables::readMetaAndFooter bad checksums");
+        memcpy(&sectionChecksum, p + length - CHECKSUM_BYTES_SIZE, CHECKSUM_BYTES_SIZE);
+        if(verification != CHECKSUM_VERIFY_NEVER){
+            if(Checksums::crc32c(&meta[checksumPos], META_HEADER_BYTES_SIZE + length - CHECKSUM_BYTES_SIZE) != sectionChecksum)
+                throw("ERROR  SSTables::readMetaAndFooter checksums section corrupted");
+            if(Checksums::crc32c(meta.data(), checksumPos) != metaChecksum) throw("ERROR  SSTables::readMetaAndFooter meta checksum mismatch");
         }
-        ++index;
-    }
-    istrm.read((char*)&packedVal, 1);
-    for(int i = 0; i < BITS_IN_BYTE; ++i){
-        if(i >= restBitNum) { break; }
-        else {
-            val[i] = GET_BIT(i,packedVal);
-            bloomFilter->setBit(((index * BITS_IN_BYTE) + i), val[i]);
-            // std::cout << "bloomFilter index: " << ((index * BITS_IN_BYTE) + i) << " bitVal: " << val[i] << std::endl;
+        blockChecksums.resize(count);
+        if(count > 0) memcpy(blockChecksums.data(), p + 2 * CHECKSUM_BYTES_SIZE + sizeof(count), count * CHECKSUM_BYTES_SIZE);
+        checksummed = true;
+    }
+
+    // 逐段解析 meta，不认识的段直接跳过
+    pos = 0;
+    while(pos + META_HEADER_BYTES_SIZE <= meta.size()){
+        uint32_t type;
+        uint64_t length;
+        memcpy(&type, &meta[pos], sizeof(type));
+        memcpy(&length, &meta[pos + sizeof(type)], sizeof(length));
+        const char* p = &meta[pos + META_HEADER_BYTES_SIZE];
+        const char* limit = p + length;
+        // 从本段中按顺序取出 n 字节
+        auto take = [&](void* dst, uint64_t n){
+            if(n > (uint64_t)(limit - p)) throw("ERROR  SSTables::readMetaAndFooter truncated meta");
+            memcpy(dst, p, n);
+            p += n;
+        };
+        if(type == META_RANGE_TOMBSTONES){
+            uint64_t count;
+            take(&count, sizeof(count));
+            if(count != (length - sizeof(count)) / RANGE_TOMBSTONE_BYTES_SIZE || sizeof(count) + count * RANGE_TOMBSTONE_BYTES_SIZE != length) throw("ERROR  SSTables::readMetaAndFooter bad range tombstones");
+            for(uint64_t i = 0; i < count; ++i){
+                uint64_t begin, end;
+                take(&begin, sizeof(begin));
+                take(&end, sizeof(end));
+                rangeTombstones.add(begin, end);
+            }
+        } else if(type == META_RANGE_FILTER){
+            uint64_t wordNum;
+            take(&wordNum, sizeof(wordNum));
+            if(wordNum != (length - sizeof(wordNum)) / sizeof(uint64_t) || sizeof(wordNum) + wordNum * sizeof(uint64_t) != length) throw("ERROR  SSTables::readMetaAndFooter bad range filter");
+            std::vector<uint64_t> words(wordNum);
+            take(words.data(), wordNum * sizeof(uint64_t));
+            if(rangeFilter != nullptr) delete rangeFilter;
+            rangeFilter = new RangeFilters(words.data(), wordNum);
+        } else if(type == META_BLOCK_INDEX && formatVersion == 2){
+            uint64_t count;
+            take(&count, sizeof(count));
+            if(count != (length - sizeof(count)) / BLOCK_INDEX_ENTRY_BYTES_SIZE || sizeof(count) + count * BLOCK_INDEX_ENTRY_BYTES_SIZE != length) throw("ERROR  SSTables::readMetaAndFooter bad block index");
+            blocks.resize(count);
+            uint64_t ordinal = 0;
+            for(uint64_t i = 0; i < count; ++i){
+                take(&blocks[i].lastKey, sizeof(blocks[i].lastKey));
+                take(&blocks[i].offset, sizeof(blocks[i].offset));
+                take(&blocks[i].entryNum, sizeof(blocks[i].entryNum));
+                if(blocks[i].offset < INIT_BYTES_SIZE || blocks[i].offset >= metaOffset) throw("ERROR  SSTables::readMetaAndFooter bad block offset");
+                blocks[i].firstOrdinal = ordinal;
+                blocks[i].checksum = 0;
+                ordinal += blocks[i].entryNum;
+            }
+        } else if(type == META_BLOCK_INDEX && formatVersion >= 3){
+            uint64_t count;
+            take(&count, sizeof(count));
+            // 每块至少占 3 字节
+            if(count > length / 3) throw("ERROR  SSTables::readMetaAndFooter bad block index");
+            blocks.resize(count);
+            uint64_t lastKey = 0, offset = INIT_BYTES_SIZE, ordinal = 0;
+            for(uint64_t i = 0; i < count; ++i){
+                uint64_t keyDelta, blockLength, entryNum;
+                if(p != nullptr) p = getVarint(p, limit, keyDelta);
+                if(p != nullptr) p = getVarint(p, limit, blockLength);
+                if(p != nullptr) p = getVarint(p, limit, entryNum);
+                if(p == nullptr || blockLength > metaOffset - offset) throw("ERROR  SSTables::readMetaAndFooter bad block index");
+                lastKey += keyDelta;
+                blocks[i].lastKey = lastKey;
+                blocks[i].offset = offset;
+                blocks[i].firstOrdinal = ordinal;
+                blocks[i].entryNum = entryNum;
+                blocks[i].checksum = 0;
+                offset += blockLength;
+                ordinal += entryNum;
+            }
+        } else if(type == META_FILTER_CHECKSUMS){
+            if(length != 2 * CHECKSUM_BYTES_SIZE) throw("ERROR  SSTables::readMetaAndFooter bad filter checksums");
+            take(&headerOnlyChecksum, sizeof(headerOnlyChecksum));
+            take(&filterChecksum, sizeof(filterChecksum));
+            hasFilterChecksum = true;
+        } else if(type == META_TABLE_PROPERTIES){
+            take(&deletedNum, sizeof(deletedNum));
+            if(length >= sizeof(deletedNum) + sizeof(rawDataBytes)){
+                take(&rawDataBytes, sizeof(rawDataBytes));
+                hasRawDataBytes = true;
+            }
+            if(length >= sizeof(deletedNum) + sizeof(rawDataBytes) + sizeof(codec)){
+                take(&codec, sizeof(codec));
+                if(codec != BLOCK_CODEC_NONE && codec != BLOCK_CODEC_LZ) throw("ERROR  SSTables::readMetaAndFooter unknown codec");
+            }
         }
+        pos += META_HEADER_BYTES_SIZE + length;
+    }
+    if(checksummed){
+        if(blockChecksums.size() != blocks.size()) throw("ERROR  SSTables::readMetaAndFooter block checksums do not match block index");
+        for(uint64_t i = 0; i < blocks.size(); ++i) blocks[i].checksum = blockChecksums[i];
     }
+    if(!hasRawDataBytes) rawDataBytes = dataEnd - INIT_BYTES_SIZE;
 }
+
+// 第一次查询时载入 bloom filter：有映射时直接引用映射中的位数组，否则一次读入
+// 有分开的校验和时先检查 bloom filter 区（没有的文件在打开时已经检查过）
+void SSTables::loadBloomFilter()
+{
+    if(bloomFilter != nullptr) return;
+    uint64_t bytes = BloomFilters::getBytesSize();
+    bool verify = hasFilterChecksum && verification != CHECKSUM_VERIFY_NEVER;
+    mapFile();
+    if(mappedData != nullptr && sizeof(Header) + bytes <= mappedSize){
+        if(verify && Checksums::crc32c(mappedData + sizeof(Header), bytes) != filterChecksum) throw("ERROR  SSTables::loadBloomFilter bloom filter checksum mismatch");
+        bloomFilter = new BloomFilters(header.pairsNum, mappedData + sizeof(Header), true);
+        return;
+    }
+    std::vector<char> buffer(bytes);
+    std::ifstream istrm(getFilePath(), std::ios::binary);
+    istrm.seekg(sizeof(Header), std::ios::beg);
+    istrm.read(buffer.data(), bytes);
+    if(!istrm) throw("ERROR  SSTables::loadBloomFilter read failed");
+    if(verify && Checksums::crc32c(buffer.data(), bytes) != filterChecksum) throw("ERROR  SSTables::loadBloomFilter bloom filter checksum mismatch");
+    bloomFilter = new BloomFilters(header.pairsNum, buffer.data(), false);
+}
+
 void SSTables::readAllIndex(std::ifstream &istrm) {
 
     if(!index.empty()) throw("ERROR  SSTables::readAllIndex  original index vector not empty");
@@ -222,6 +641,9 @@ void SSTables::readAllIndex(std::ifstream &istrm) {
         istrm.read(reinterpret_cast<char *>(&tmpKey), KEY_BYTES_SIZE);
         // 读出 Offset
         istrm.read(reinterpret_cast<char *>(&(offset)), OFFSET_BYTES_SIZE);
+        // value 的位置须在数据区内且不减
+        if(!istrm || offset < posIndex + header.pairsNum * (KEY_BYTES_SIZE + OFFSET_BYTES_SIZE) || offset > dataEnd || (!index.empty() && offset < index.back().offset))
+            throw("ERROR  SSTables::readAllIndex bad index entry");
 
         Index tmp;
         tmp.key = tmpKey;
@@ -233,259 +655,521 @@ void SSTables::readAllIndex(std::ifstream &istrm) {
 
 }
 
-std::string SSTables::get(uint64_t key, const std::string &filePath)
+int64_t SSTables::find(uint64_t key)
 {
     // 检查 key 是否在上下界范围内
-    if(key > header.maxKey || key < header.minKey) return "";
+    if(header.pairsNum == 0 || key > header.maxKey || key < header.minKey) return -1;
 
     // 用 Bloom Filter 快速判断 SSTable 中是否存在该 key
-    if(!bloomFilter->find(key)) return "";
+    loadBloomFilter();
+    if(!bloomFilter->find(key)) return -1;
+
+    // v3 及以后格式在块索引中找到可能包含 key 的块后，块内经重启点二分查找，不解析整块
+    if(formatVersion >= 3){
+        uint64_t b = seekBlock(key);
+        if(b == blocks.size() || !seekInBlock(b, key)) return -1;
+        return foundOrdinal;
+    }
 
-    // 二分查找
-    size_t left = 0;
-    size_t right = index.size() - 1;
-    size_t mid;
-    while(left <= right)
-    {
-        mid = (left + right) / 2;
-        if(index[mid].key == key)  // found
-        {
-            // std::cout << "check in sstable, FOUND key : " << key << std::endl;
-
-            if(mid != index.size() - 1) // not the last data
-            return getData(index[mid].offset, index[mid+1].offset, filePath);
-            else return getData(index[mid].offset, 0, filePath);
-        }
-        if(index[mid].key < key)
-        {
-            left = mid + 1;
+    // 二分查找，v2 格式先在块索引中找到可能包含 key 的块，再在块内查找
+    uint64_t i = seekOrdinal(key, false);
+    if(i == header.pairsNum || getKey(i) != key) return -1;  // not found
+    return i;
+}
+
+uint64_t SSTables::seekBlock(uint64_t key)
+{
+    auto it = std::lower_bound(blocks.begin(), blocks.end(), key,
+                               [](const BlockHandle &a, const uint64_t &key){ return a.lastKey < key; });
+    return it - blocks.begin();
+}
+
+uint64_t SSTables::seekOrdinal(uint64_t key, bool upper)
+{
+    if(formatVersion == 1){
+        if(upper) return std::upper_bound(index.begin(), index.end(), key,
+                                          [](const uint64_t &key, const Index &a){ return key < a.key; }) - index.begin();
+        return std::lower_bound(index.begin(), index.end(), key,
+                                [](const Index &a, const uint64_t &key){ return a.key < key; }) - index.begin();
+    }
+    // 第一个 lastKey 不小于（upper 时大于）key 的块中一定有所求的 key
+    uint64_t b = upper ? (std::upper_bound(blocks.begin(), blocks.end(), key,
+                                           [](const uint64_t &key, const BlockHandle &a){ return key < a.lastKey; }) - blocks.begin())
+                       : seekBlock(key);
+    if(b == blocks.size()) return header.pairsNum;
+    loadBlock(b);
+    auto it = upper ? std::upper_bound(loadedEntries.begin(), loadedEntries.end(), key,
+                                       [](const uint64_t &key, const BlockEntry &a){ return key < a.key; })
+                    : std::lower_bound(loadedEntries.begin(), loadedEntries.end(), key,
+                                       [](const BlockEntry &a, const uint64_t &key){ return a.key < key; });
+    return blocks[b].firstOrdinal + (it - loadedEntries.begin());
+}
+
+void SSTables::parseBlock(const char* data, uint64_t length, uint64_t baseOffset, uint64_t formatVersion, std::vector<BlockEntry> &entries)
+{
+    entries.clear();
+    if(formatVersion == 2){
+        uint64_t pos = 0;
+        while(pos < length){
+            if(pos + KEY_BYTES_SIZE + VALUE_SIZE_BYTES_SIZE > length) throw("ERROR  SSTables::parseBlock truncated entry");
+            BlockEntry entry;
+            memcpy(&entry.key, data + pos, KEY_BYTES_SIZE);
+            memcpy(&entry.size, data + pos + KEY_BYTES_SIZE, VALUE_SIZE_BYTES_SIZE);
+            pos += KEY_BYTES_SIZE + VALUE_SIZE_BYTES_SIZE;
+            if(pos + entry.size > length) throw("ERROR  SSTables::parseBlock truncated value");
+            entry.offset = baseOffset + pos;
+            pos += entry.size;
+            entries.push_back(entry);
         }
-        else
-        {
-            right = mid - 1;
+        return;
+    }
+
+    // 定长块（只出现在 v4 文件中）：各项的位置由下标算出
+    uint32_t valueWidth, entryNum;
+    if(formatVersion >= 4 && parseFixedTrailer(data, length, valueWidth, entryNum)){
+        const char* values = data + (uint64_t)entryNum * KEY_BYTES_SIZE;
+        entries.resize(entryNum);
+        for(uint32_t i = 0; i < entryNum; ++i){
+            memcpy(&entries[i].key, data + (uint64_t)i * KEY_BYTES_SIZE, KEY_BYTES_SIZE);
+            entries[i].size = valueWidth;
+            entries[i].offset = baseOffset + (values - data) + (uint64_t)i * valueWidth;
         }
+        return;
+    }
+
+    // v3：先由块尾得到各项所在区域的长度，再顺序解码，重启点处的 key 为其本身
+    uint32_t interval, restartNum;
+    if(length < BLOCK_TRAILER_BYTES_SIZE) throw("ERROR  SSTables::parseBlock truncated trailer");
+    memcpy(&interval, data + length - BLOCK_TRAILER_BYTES_SIZE, sizeof(interval));
+    memcpy(&restartNum, data + length - sizeof(restartNum), sizeof(restartNum));
+    if(interval == 0 || (uint64_t)restartNum * RESTART_OFFSET_BYTES_SIZE + BLOCK_TRAILER_BYTES_SIZE > length) throw("ERROR  SSTables::parseBlock bad trailer");
+    const char* p = data;
+    const char* limit = data + length - BLOCK_TRAILER_BYTES_SIZE - restartNum * RESTART_OFFSET_BYTES_SIZE;
+    uint64_t key = 0;
+    while(p < limit){
+        uint64_t delta, size;
+        p = getVarint(p, limit, delta);
+        if(p != nullptr) p = getVarint(p, limit, size);
+        if(p == nullptr || size > (uint64_t)(limit - p)) throw("ERROR  SSTables::parseBlock truncated entry");
+        key = (entries.size() % interval == 0) ? delta : key + delta;
+        BlockEntry entry;
+        entry.key = key;
+        entry.size = size;
+        entry.offset = baseOffset + (p - data);
+        entries.push_back(entry);
+        p += size;
     }
-    return "";  // not found
 }
 
-std::string SSTables::getData(const uint32_t &posDataStart, uint32_t posDataEnd, const std::string &filePath)
+bool SSTables::parseFixedTrailer(const char* data, uint64_t length, uint32_t &valueWidth, uint32_t &entryNum)
 {
-    std::ifstream istrm(filePath, std::ios::binary);
-    if(!istrm) throw("file not exist!");
-    if(posDataEnd == 0) {  // last val
-        istrm.seekg(0, std::ios::end);
-        posDataEnd = istrm.tellg();
+    uint32_t interval;
+    if(length < BLOCK_TRAILER_BYTES_SIZE) throw("ERROR  SSTables::parseFixedTrailer truncated trailer");
+    memcpy(&interval, data + length - BLOCK_TRAILER_BYTES_SIZE, sizeof(interval));
+    if(interval != 0) return false;
+    if(length < FIXED_BLOCK_TRAILER_BYTES_SIZE) throw("ERROR  SSTables::parseFixedTrailer truncated trailer");
+    memcpy(&valueWidth, data + length - FIXED_BLOCK_TRAILER_BYTES_SIZE, sizeof(valueWidth));
+    memcpy(&entryNum, data + length - sizeof(entryNum), sizeof(entryNum));
+    if((uint64_t)entryNum * (KEY_BYTES_SIZE + (uint64_t)valueWidth) + FIXED_BLOCK_TRAILER_BYTES_SIZE != length) throw("ERROR  SSTables::parseFixedTrailer bad trailer");
+    return true;
+}
+
+// 先二分查找缩小到不超过 FIXED_BLOCK_SCAN_KEYS 个候选，再顺序比较，支持 SSE2 时每次比较两个 key
+int64_t SSTables::searchKeys(const char* keys, uint32_t n, uint64_t key)
+{
+    auto keyAt = [&](uint32_t i){
+        uint64_t value;
+        memcpy(&value, keys + (uint64_t)i * KEY_BYTES_SIZE, KEY_BYTES_SIZE);
+        return value;
+    };
+    // 第一个不小于 key 的下标始终在 [lo, hi] 内
+    uint32_t lo = 0, hi = n;
+    while(hi - lo > FIXED_BLOCK_SCAN_KEYS){
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(keyAt(mid) < key) lo = mid + 1;
+        else hi = mid;
     }
-    istrm.seekg(posDataStart, std::ios::beg);
-    // 读出 Value
-    char* tmpVal = new char [posDataEnd - posDataStart + 1];
-    istrm.read((char*)tmpVal, posDataEnd - posDataStart);
-    tmpVal[posDataEnd - posDataStart] = '\0';
-    std::string val = tmpVal;
-    delete [] tmpVal;
-    istrm.close();
-    return val;
+    uint32_t end = (hi < n) ? hi + 1 : n;
+    uint32_t i = lo;
+#ifdef SSTABLES_USE_SSE2
+    const __m128i target = _mm_set1_epi64x(static_cast<long long>(key));
+    for(; i + 2 <= end; i += 2){
+        // SSE2 没有 64 位比较，按 32 位比较后两半都相等才算相等
+        __m128i candidates = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + (uint64_t)i * KEY_BYTES_SIZE));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(candidates, target));
+        if((mask & 0xff) == 0xff) return i;
+        if((mask & 0xff00) == 0xff00) return i + 1;
+    }
+#endif
+    for(; i < end; ++i){
+        if(keyAt(i) == key) return i;
+    }
+    return -1;
 }
 
-void SSTables::readAllIndexAndData(std::list<std::pair<uint64_t, std::string> > &all) {
+void SSTables::decodeBlock(const char* stored, uint64_t storedLength, uint32_t codec, uint64_t maxRawLength, std::vector<char> &out, const char* &data, uint64_t &length)
+{
+    data = stored;
+    length = storedLength;
+    if(codec == BLOCK_CODEC_NONE) return;
+    // 末尾 1 字节为该块的实际编码
+    if(storedLength == 0) throw("ERROR  SSTables::decodeBlock empty block");
+    uint8_t type = stored[storedLength - 1];
+    length = storedLength - 1;
+    if(type == BLOCK_CODEC_NONE) return;
+    if(type != BLOCK_CODEC_LZ) throw("ERROR  SSTables::decodeBlock unknown block codec");
+    uint64_t rawLength;
+    const char* p = getVarint(stored, stored + length, rawLength);
+    if(p == nullptr || rawLength > maxRawLength) throw("ERROR  SSTables::decodeBlock bad raw length");
+    out.resize(rawLength);
+    if(!LZCompressors::decompress(p, stored + length - p, out.data(), rawLength)) throw("ERROR  SSTables::decodeBlock corrupted block");
+    data = out.data();
+    length = rawLength;
+}
 
-    if(!utils::dirExists(this->dir)) {
-        utils::mkdir((this->dir).c_str());
+const char* SSTables::readBlockData(uint64_t b, uint64_t &length)
+{
+    if(decodedBlockIndex == (int64_t)b){
+        length = decodedLength;
+        return decodedData;
     }
-    std::string filepath = (this->dir) + "/" + (this->fileName) + ".sst";
-    std::ifstream istrm(filepath, std::ios::binary);
+    uint64_t offset = blocks[b].offset;
+    uint64_t storedLength = getBlockEnd(b) - offset;
+    const char* stored;
+    mapFile();
+    if(mappedData != nullptr && offset + storedLength <= mappedSize){
+        stored = mappedData + offset;
+    } else {
+        std::ifstream istrm(getFilePath(), std::ios::binary);
+        if(!istrm) throw("file not exist!");
+        blockBuffer.resize(storedLength);
+        istrm.seekg(offset, std::ios::beg);
+        istrm.read(blockBuffer.data(), storedLength);
+        if(!istrm) throw("ERROR  SSTables::readBlockData read failed");
+        stored = blockBuffer.data();
+    }
+    if(checksummed && verification == CHECKSUM_VERIFY_ALWAYS) verifyBlock(stored, storedLength, blocks[b]);
+    decodeBlock(stored, storedLength, codec, rawDataBytes, decodedBlock, decodedData, decodedLength);
+    decodedBlockIndex = b;
+    length = decodedLength;
+    return decodedData;
+}
 
-    // 索引区和数据区开头位置计算
-    uint64_t posIndex = INIT_BYTES_SIZE;
-    uint32_t posDataStart = posIndex;  // 数据起始位置与文件开头 ios::beg 的距离
-    uint32_t posDataEnd = posIndex;  // 数据终止位置与文件开头 ios::beg 的距离
-    uint64_t readed = 0;
-    uint64_t tmpKey;
+void SSTables::loadBlock(uint64_t b)
+{
+    if(loadedBlock == (int64_t)b) return;
+    // 没有压缩时 value 的位置为文件中的位置，可以直接从映射中读取；压缩时为解压后的块中的位置
+    uint64_t length;
+    const char* data = readBlockData(b, length);
+    parseBlock(data, length, (codec == BLOCK_CODEC_NONE) ? blocks[b].offset : 0, formatVersion, loadedEntries);
+    if(loadedEntries.size() != blocks[b].entryNum) throw("ERROR  SSTables::loadBlock entry number mismatch");
+    loadedBlock = b;
+}
 
-    // 读出索引区和数据区
-    while(readed < (this->header.pairsNum)){
+bool SSTables::seekInBlock(uint64_t b, uint64_t key)
+{
+    uint64_t offset = (codec == BLOCK_CODEC_NONE) ? blocks[b].offset : 0;
+    uint64_t length;
+    const char* data = readBlockData(b, length);
+
+    // 定长块直接在 key 数组上查找，value 的位置由下标算出
+    uint32_t valueWidth, entryNum;
+    if(formatVersion >= 4 && parseFixedTrailer(data, length, valueWidth, entryNum)){
+        int64_t i = searchKeys(data, entryNum, key);
+        if(i < 0) return false;
+        hasFoundEntry = true;
+        foundOrdinal = blocks[b].firstOrdinal + i;
+        foundEntry.key = key;
+        foundEntry.size = valueWidth;
+        foundEntry.offset = offset + (uint64_t)entryNum * KEY_BYTES_SIZE + (uint64_t)i * valueWidth;
+        return true;
+    }
 
-        // TODO 可以利用 index 而不必每次都从文件读出 key 和 offset
+    uint32_t interval, restartNum;
+    if(length < BLOCK_TRAILER_BYTES_SIZE) throw("ERROR  SSTables::seekInBlock truncated trailer");
+    memcpy(&interval, data + length - BLOCK_TRAILER_BYTES_SIZE, sizeof(interval));
+    memcpy(&restartNum, data + length - sizeof(restartNum), sizeof(restartNum));
+    if(interval == 0 || restartNum == 0 || (uint64_t)restartNum * RESTART_OFFSET_BYTES_SIZE + BLOCK_TRAILER_BYTES_SIZE > length) throw("ERROR  SSTables::seekInBlock bad trailer");
+    const char* restarts = data + length - BLOCK_TRAILER_BYTES_SIZE - restartNum * RESTART_OFFSET_BYTES_SIZE;
+    auto restartOffset = [&](uint32_t r){
+        uint32_t value;
+        memcpy(&value, restarts + r * RESTART_OFFSET_BYTES_SIZE, sizeof(value));
+        if(value >= (uint64_t)(restarts - data)) throw("ERROR  SSTables::seekInBlock bad restart offset");
+        return value;
+    };
+
+    // 最后一个 key 不大于所求 key 的重启点
+    uint32_t lo = 0, hi = restartNum - 1;
+    while(lo < hi){
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        uint64_t restartKey;
+        if(getVarint(data + restartOffset(mid), restarts, restartKey) == nullptr) throw("ERROR  SSTables::seekInBlock bad restart key");
+        if(restartKey <= key) lo = mid;
+        else hi = mid - 1;
+    }
 
-        istrm.seekg(posIndex, std::ios::beg);
-        // 读出 Key
-        istrm.read(reinterpret_cast<char*>(&tmpKey), KEY_BYTES_SIZE);
-        // 读出 Offset
-        istrm.read(reinterpret_cast<char*>(&(posDataStart)), OFFSET_BYTES_SIZE);
-        posIndex += OFFSET_BYTES_SIZE + KEY_BYTES_SIZE;
-        if(readed != this->header.pairsNum - 1){
-            istrm.seekg((posIndex + KEY_BYTES_SIZE), std::ios::beg);
-            istrm.read(reinterpret_cast<char*>(&(posDataEnd)), OFFSET_BYTES_SIZE);
-        } else {  // last one
-            istrm.seekg(0, std::ios::end);
-            posDataEnd = istrm.tellg();
+    // 从该重启点开始顺序解码至多 interval 项
+    const char* p = data + restartOffset(lo);
+    uint64_t current = 0;
+    for(uint32_t i = 0; i < interval && p < restarts; ++i){
+        uint64_t delta, size;
+        p = getVarint(p, restarts, delta);
+        if(p != nullptr) p = getVarint(p, restarts, size);
+        if(p == nullptr || size > (uint64_t)(restarts - p)) throw("ERROR  SSTables::seekInBlock truncated entry");
+        current = (i == 0) ? delta : current + delta;
+        if(current > key) return false;
+        if(current == key){
+            hasFoundEntry = true;
+            foundOrdinal = blocks[b].firstOrdinal + (uint64_t)lo * interval + i;
+            foundEntry.key = current;
+            foundEntry.size = size;
+            foundEntry.offset = offset + (p - data);
+            return true;
         }
-
-        istrm.seekg(posDataStart, std::ios::beg);
-        // 读出 Value
-        char* tmpVal = new char [posDataEnd - posDataStart + 1];
-        istrm.read((char*)tmpVal, posDataEnd - posDataStart);
-        tmpVal[posDataEnd - posDataStart] = '\0';
-        std::string val = tmpVal;
-        delete [] tmpVal;
-
-        std::pair<uint64_t, std::string> tmp(tmpKey, val);
-        all.push_back(tmp);
-
-        ++readed;
+        p += size;
     }
-    istrm.close();
+    return false;
 }
 
-// 其中最外层 pair 的 second 的 uint64_t 放当前 table 的时间戳
-void SSTables::readAllIndexAndDataWithTimeStamp(std::list<std::pair<std::pair<uint64_t, std::string>, uint64_t> > &all)
+uint64_t SSTables::blockIndexOf(uint64_t i)
 {
-    uint64_t timeStamp = this->header.timeStamp;
-    if(!utils::dirExists(this->dir)) {
-        utils::mkdir((this->dir).c_str());
-    }
-    std::string filepath = (this->dir) + "/" + (this->fileName) + ".sst";
-    std::ifstream istrm(filepath, std::ios::binary);
+    // 最后一个 firstOrdinal 不大于 i 的块
+    auto it = std::upper_bound(blocks.begin(), blocks.end(), i,
+                               [](const uint64_t &i, const BlockHandle &a){ return i < a.firstOrdinal; });
+    return (it - blocks.begin()) - 1;
+}
 
-    // 索引区和数据区开头位置计算
-    uint64_t posIndex = INIT_BYTES_SIZE;
-    uint32_t posDataStart = posIndex;  // 数据起始位置与文件开头 ios::beg 的距离
-    uint32_t posDataEnd = posIndex;  // 数据终止位置与文件开头 ios::beg 的距离
-    int readed = 0;
-    uint64_t tmpKey;
+const BlockEntry &SSTables::blockEntry(uint64_t i)
+{
+    if(hasFoundEntry && foundOrdinal == i) return foundEntry;
+    uint64_t b = blockIndexOf(i);
+    loadBlock(b);
+    return loadedEntries[i - blocks[b].firstOrdinal];
+}
+
+uint64_t SSTables::getKey(uint64_t i)
+{
+    if(formatVersion == 1) return index[i].key;
+    return blockEntry(i).key;
+}
 
-    // 读出索引区和数据区
-    while(readed < (this->header.pairsNum)){
+uint64_t SSTables::getValueSize(uint64_t i)
+{
+    if(formatVersion == 1) return ((i + 1 < index.size()) ? index[i + 1].offset : dataEnd) - index[i].offset;
+    return blockEntry(i).size;
+}
 
-        istrm.seekg(posIndex, std::ios::beg);
+uint64_t SSTables::getValueOffset(uint64_t i)
+{
+    if(formatVersion == 1) return index[i].offset;
+    return blockEntry(i).offset;
+}
 
-        // TODO 可以利用 index 而不必每次都从文件读出 key 和 offset
+std::string SSTables::get(uint64_t key)
+{
+    int64_t i = find(key);
+    if(i < 0) return "";
+    return getValue(i);
+}
 
-        // 读出 Key
-        istrm.read(reinterpret_cast<char*>(&tmpKey), KEY_BYTES_SIZE);
-        // 读出 Offset
-        istrm.read(reinterpret_cast<char*>(&(posDataStart)), OFFSET_BYTES_SIZE);
-        posIndex += OFFSET_BYTES_SIZE + KEY_BYTES_SIZE;
-        if(readed != this->header.pairsNum - 1){
-            istrm.seekg((posIndex + KEY_BYTES_SIZE), std::ios::beg);
-            istrm.read(reinterpret_cast<char*>(&(posDataEnd)), OFFSET_BYTES_SIZE);
-        } else {  // last one
-            istrm.seekg(0, std::ios::end);
-            posDataEnd = istrm.tellg();
+void SSTables::mapFile()
+{
+    if(mappedData != nullptr || mapFailed) return;
+#ifdef SSTABLES_USE_MMAP
+    int fd = open(getFilePath().c_str(), O_RDONLY);
+    if(fd < 0) throw("file not exist!");
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0){
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(addr != MAP_FAILED){
+            mappedData = static_cast<const char*>(addr);
+            mappedSize = st.st_size;
         }
+    }
+    close(fd);
+#endif
+    if(mappedData == nullptr) mapFailed = true;
+}
 
-        istrm.seekg(posDataStart, std::ios::beg);
-        // 读出 Value
-        char* tmpVal = new char [posDataEnd - posDataStart + 1];
-        istrm.read((char*)tmpVal, posDataEnd - posDataStart);
-        tmpVal[posDataEnd - posDataStart] = '\0';
-        std::string val = tmpVal;
-        delete [] tmpVal;
+void SSTables::unmapFile()
+{
+#ifdef SSTABLES_USE_MMAP
+    if(mappedData != nullptr) munmap(const_cast<char*>(mappedData), mappedSize);
+#endif
+    mappedData = nullptr;
+    mappedSize = 0;
+}
 
-        std::pair<uint64_t, std::string> tmp(tmpKey, val);
-        all.emplace_back(tmp, timeStamp);
+const char* SSTables::getValueData(uint64_t i)
+{
+    if(codec != BLOCK_CODEC_NONE) return nullptr;
+    mapFile();
+    uint64_t offset = getValueOffset(i);
+    if(mappedData == nullptr || offset + getValueSize(i) > mappedSize) return nullptr;
+    return mappedData + offset;
+}
 
-        ++readed;
+void SSTables::readValue(uint64_t i, char* buf)
+{
+    uint64_t size = getValueSize(i);
+    if(codec != BLOCK_CODEC_NONE){
+        // 从解压后的块中拷贝
+        uint64_t offset = getValueOffset(i);
+        uint64_t length;
+        const char* block = readBlockData(blockIndexOf(i), length);
+        memcpy(buf, block + offset, size);
+        return;
+    }
+    const char* data = getValueData(i);
+    if(data != nullptr){
+        memcpy(buf, data, size);
+        return;
     }
+    std::ifstream istrm(getFilePath(), std::ios::binary);
+    if(!istrm) throw("file not exist!");
+    istrm.seekg(getValueOffset(i), std::ios::beg);
+    // 读出 Value
+    istrm.read(buf, size);
     istrm.close();
 }
 
-// 返回的 all 包括 key1 与 key2 （如果这两个 key 出现在文件中）
-void SSTables::readIndexAndDataForScan(std::list<std::pair<uint64_t, std::string>> &all, const uint64_t &key1,const uint64_t &key2)
+std::string SSTables::getValue(uint64_t i)
 {
-    // 实际有在当前文件中出现的起始 key
-    uint64_t startKey;
-    uint64_t startKeyIndex;
-    // 检查 key1 是否在上下界范围内
-    if(key1 > header.maxKey) throw("ERROR  readIndexAndDataForScan key1 bigger than maxKey");
-    if(key1 < header.minKey)
-    {
-        startKey = header.minKey;
-        startKeyIndex = 0;
-    }
-    else{
-        // 二分查找 key1
-        size_t left = 0;
-        size_t right = index.size() - 1;
-        size_t mid;
-        while(left <= right)
-        {
-            mid = (left + right) / 2;
-            if(index[mid].key == key1)  // found
-            {
-                startKey = key1;
-                startKeyIndex = mid;
-                break;
-            }
-            if(index[mid].key < key1)
-            {
-                left = mid + 1;
-            }
-            else
-            {
-                right = mid - 1;
-            }
-        }
-        if(left > right){  // not found
-            if(left >= index.size()) throw("ERROR  readIndexAndDataForScan left bigger than size");
-            startKey = index[left].key;
-            startKeyIndex = left;
-        }
-    }
-
-    if(!utils::dirExists(this->dir)) {
-        utils::mkdir((this->dir).c_str());
-    }
-    std::string filepath = (this->dir) + "/" + (this->fileName) + ".sst";
-    std::ifstream istrm(filepath, std::ios::binary);
+    std::string val(getValueSize(i), '\0');
+    if(!val.empty()) readValue(i, &val[0]);
+    return val;
+}
 
-    // 从 startKey 开始读
-    // 索引区和数据区开头位置计算
-    uint64_t posIndex = INIT_BYTES_SIZE + startKeyIndex * (OFFSET_BYTES_SIZE + KEY_BYTES_SIZE);
-    uint32_t posDataStart = posIndex;  // 数据起始位置与文件开头 ios::beg 的距离
-    uint32_t posDataEnd = posIndex;  // 数据终止位置与文件开头 ios::beg 的距离
+bool SSTables::isDeletedValue(uint64_t i)
+{
+    static const std::string deleted = "~DELETED~";
+    if(getValueSize(i) != deleted.size()) return false;
+    return getValue(i) == deleted;
+}
 
-    uint64_t tmpKey = startKey;
+void SSTables::findRange(uint64_t key1, uint64_t key2, uint64_t &start, uint64_t &end)
+{
+    start = end = 0;
+    // 检查范围是否与上下界有交集
+    if(header.pairsNum == 0 || key1 > key2 || key1 > header.maxKey || key2 < header.minKey) return;
+    // 利用内存中的 index（v2 及以后格式为块索引与区间两端所在的块）二分查找
+    start = seekOrdinal(key1, false);
+    end = seekOrdinal(key2, true);
+    if(end < start) end = start;
+}
 
-    // 读出索引区和数据区
-    // 注意判定是否是最后一个
-    bool readAll = false;
-    while(tmpKey < key2 && !readAll){
+void SSTables::approximateStats(uint64_t key1, uint64_t key2, uint64_t &keyCount, uint64_t &byteSize)
+{
+    if(formatVersion >= 2){
+        // 只用块索引，按整块计算：从可能包含 key1 的块到可能包含 key2 的块
+        if(header.pairsNum == 0 || key1 > key2 || key1 > header.maxKey || key2 < header.minKey) return;
+        uint64_t first = seekBlock(key1);
+        uint64_t last = std::min<uint64_t>(seekBlock(key2), blocks.size() - 1);
+        if(first > last) return;
+        keyCount += blocks[last].firstOrdinal + blocks[last].entryNum - blocks[first].firstOrdinal;
+        byteSize += getBlockEnd(last) - blocks[first].offset;
+        return;
+    }
+    uint64_t start, end;
+    findRange(key1, key2, start, end);
+    if(start >= end) return;
+    uint64_t posDataEnd = (end == index.size()) ? dataEnd : index[end].offset;
+    keyCount += end - start;
+    byteSize += (end - start) * (KEY_BYTES_SIZE + OFFSET_BYTES_SIZE) + (posDataEnd - index[start].offset);
+}
 
-        istrm.seekg(posIndex, std::ios::beg);
+SSTableReaders::SSTableReaders(SSTables* table, uint64_t key1, uint64_t key2, RateLimiters* rateLimiter, bool dropCache): table(table), rateLimiter(rateLimiter), istrm(table->getFilePath(), std::ios::binary), key1(key1), key2(key2)
+{
+    if(!istrm) throw("ERROR  SSTableReaders: open file failed");
+#ifdef SSTABLES_USE_FADVISE
+    if(dropCache) cacheFd = open(table->getFilePath().c_str(), O_RDONLY);
+#endif
+    blockBased = (table->getFormatVersion() >= 2);
+    if(!blockBased){
+        table->findRange(key1, key2, pos, end);
+        return;
+    }
+    // 从可能包含 key1 的块开始，跳过块中小于 key1 的项
+    if(table->getPairsNum() == 0 || key1 > key2 || key1 > table->getMaxKey() || key2 < table->getMinKey()) return;
+    nextBlock = table->seekBlock(key1);
+    readBlock();
+    while(pos < end && entries[pos].key < key1) ++pos;
+}
 
-        // TODO 可以利用 index 而不必每次都从文件读出 key 和 offset
+SSTableReaders::~SSTableReaders()
+{
+    dropReadCache(true);
+#ifdef SSTABLES_USE_FADVISE
+    if(cacheFd >= 0) close(cacheFd);
+#endif
+}
 
-        // 读出 Key
-        istrm.read(reinterpret_cast<char*>(&tmpKey), KEY_BYTES_SIZE);
-        // 读到比上界大的
-        if(tmpKey > key2) break;
+void SSTableReaders::readRange(uint64_t offset, uint64_t length)
+{
+    if(buffer.size() < length) buffer.resize(length);
+    if(rateLimiter != nullptr) rateLimiter->request(length, false);
+    istrm.seekg(offset, std::ios::beg);
+    istrm.read(buffer.data(), length);
+    if(cacheFd < 0) return;
+    // 与之前读过的区间不相连时先丢弃之前的部分
+    if(offset < cacheStart || offset > cacheEnd){
+        dropReadCache(true);
+        cacheStart = cacheEnd = offset;
+    }
+    cacheEnd = std::max(cacheEnd, offset + length);
+    dropReadCache(false);
+}
 
-        // 读出 Offset
-        istrm.read(reinterpret_cast<char*>(&(posDataStart)), OFFSET_BYTES_SIZE);
-        posIndex += OFFSET_BYTES_SIZE + KEY_BYTES_SIZE;
-
-        // 注意判定是否是最后一个
-        if(tmpKey != this->header.maxKey){
-            istrm.seekg((posIndex + KEY_BYTES_SIZE), std::ios::beg);
-            istrm.read(reinterpret_cast<char*>(&(posDataEnd)), OFFSET_BYTES_SIZE);
-        } else {  // last one
-            istrm.seekg(0, std::ios::end);
-            posDataEnd = istrm.tellg();
-            readAll = true;
-        }
+void SSTableReaders::dropReadCache(bool force)
+{
+#ifdef SSTABLES_USE_FADVISE
+    if(cacheFd < 0 || cacheEnd <= cacheStart) return;
+    if(!force && cacheEnd - cacheStart < COMPACTION_DROP_CACHE_BYTES) return;
+    posix_fadvise(cacheFd, cacheStart, cacheEnd - cacheStart, POSIX_FADV_DONTNEED);
+    cacheStart = cacheEnd;
+#endif
+}
 
-        istrm.seekg(posDataStart, std::ios::beg);
-        // 读出 Value
-        char* tmpVal = new char [posDataEnd - posDataStart + 1];
-        istrm.read((char*)tmpVal, posDataEnd - posDataStart);
-        tmpVal[posDataEnd - posDataStart] = '\0';
-        std::string val = tmpVal;
-        delete [] tmpVal;
+// 读入并解析 nextBlock，只保留 key 不大于 key2 的项；没有更多的块或已超过 key2 时 pos == end
+void SSTableReaders::readBlock()
+{
+    pos = end = 0;
+    const std::vector<BlockHandle> &blocks = table->getBlocks();
+    if(nextBlock >= blocks.size()) return;
+    uint64_t offset = blocks[nextBlock].offset;
+    uint64_t length = table->getBlockEnd(nextBlock) - offset;
+    readRange(offset, length);
+    if(!istrm) throw("ERROR  SSTableReaders: read block failed");
+    if(table->hasChecksums() && table->getChecksumVerification() != CHECKSUM_VERIFY_NEVER) SSTables::verifyBlock(buffer.data(), length, blocks[nextBlock]);
+    uint64_t blockLength;
+    SSTables::decodeBlock(buffer.data(), length, table->getCodec(), table->getRawDataBytes(), decoded, blockData, blockLength);
+    SSTables::parseBlock(blockData, blockLength, 0, table->getFormatVersion(), entries);
+    ++nextBlock;
+    end = entries.size();
+    while(end > 0 && entries[end - 1].key > key2) --end;
+    // 本块中已有超过 key2 的项时，之后的块都不需要
+    if(end < entries.size()) nextBlock = blocks.size();
+}
 
-        all.emplace_back(tmpKey, val);
+void SSTableReaders::next()
+{
+    ++pos;
+    if(blockBased && pos >= end) readBlock();
+}
 
+const char* SSTableReaders::value()
+{
+    if(blockBased) return blockData + entries[pos].offset;
+    uint64_t offset = table->getValueOffset(pos);
+    uint64_t size = table->getValueSize(pos);
+    if(offset < bufferOffset || offset + size > bufferOffset + bufferLength){
+        // 从当前 value 开始读入一块，数据区是连续的，之后的 value 大多也在这一块中
+        uint64_t dataEnd = table->getValueOffset(end - 1) + table->getValueSize(end - 1);
+        uint64_t length = std::min<uint64_t>(std::max<uint64_t>(size, COMPACTION_READ_BUFFER_SIZE), dataEnd - offset);
+        readRange(offset, length);
+        if(!istrm) throw("ERROR  SSTableReaders: read data failed");
+        bufferOffset = offset;
+        bufferLength = length;
     }
-    istrm.close();
+    return buffer.data() + (offset - bufferOffset);
 }
-
@@ -10,7 +10,15 @@
 #include <cstdint>
 #include "constant.h"
 #include <fstream>
+#include <cstring>
+#include <algorithm>
 #include "BloomFilters.h"
+#include "RangeTombstones.h"
+#include "RangeFilters.h"
+#include "RateLimiters.h"
+#include "LZCompressors.h"
+#include "Checksums.h"
+#include "Options.h"
 
 struct Header {
     uint64_t timeStamp;
@@ -19,28 +27,146 @@ struct Header {
     uint64_t maxKey;
 };
 
+class SSTableBuilders;
+
 struct Index {
     uint64_t key;
     uint32_t offset;
 };
 
+// v2 及以后格式块索引中的一项，firstOrdinal 为块中第一个 key 在整个文件中的序号，读入时计算，不写入文件
+// checksum 为块在文件中所存字节（压缩后，含末尾的编码字节）的 CRC32C，保存在校验和段中
+struct BlockHandle {
+    uint64_t lastKey;
+    uint64_t offset;
+    uint64_t firstOrdinal;
+    uint32_t entryNum;
+    uint32_t checksum;
+};
+
+// 解析后的块中的一项，offset 为 value 的位置（相对于解析时给定的起点）
+struct BlockEntry {
+    uint64_t key;
+    uint64_t offset;
+    uint32_t size;
+};
+
 class SSTables {
 public:
-    SSTables(const std::string dir, const std::string fileName);
-    SSTables(const std::string dir, std::list<std::pair<uint64_t, std::string> > &list, uint64_t &minKey, uint64_t &maxKey, uint64_t &numKey, const uint64_t &timeStamp, const std::string fileName);
-    ~SSTables(){ if(bloomFilter) delete bloomFilter; index.clear(); };
-    void writeSSTable(std::list<std::pair<uint64_t, std::string> > &list);
+    // verification 为之后读取时检查校验和的时机，打开已有文件时 header、bloom filter 与 meta 段的校验和不符则抛出错误
+    SSTables(const std::string dir, const std::string fileName, ChecksumVerification verification = CHECKSUM_VERIFY_NEVER);
+    // 由 SSTableBuilders 完成其临时文件并改名为本文件，syncWrite 为 true 时写出后 fdatasync，dropCache 为 true 时落盘后从页缓存中丢弃
+    // 写出经 builder 的 rateLimiter 限速
+    SSTables(const std::string dir, SSTableBuilders &builder, uint64_t minKey, uint64_t maxKey, const uint64_t &timeStamp, const std::string fileName, const RangeTombstones &rangeTombstones = RangeTombstones(), bool withRangeFilter = false, ChecksumVerification verification = CHECKSUM_VERIFY_NEVER, bool syncWrite = false, bool dropCache = false);
+    ~SSTables(){ if(bloomFilter) delete bloomFilter; if(rangeFilter) delete rangeFilter; unmapFile(); index.clear(); };
+    void writeSSTable(SSTableBuilders &builder, bool sync = false, bool dropCache = false);
     void readSSTable();
 
-    std::string get(uint64_t key, const std::string &filePath);
-    void readAllIndexAndData(std::list<std::pair<uint64_t, std::string> > &all);
-    void readAllIndexAndDataWithTimeStamp(std::list<std::pair<std::pair<uint64_t, std::string>, uint64_t> > &all);
+    std::string get(uint64_t key);
+    // 以下的下标 i 均为 key 在整个文件中的序号（0 ~ pairsNum - 1），v1 格式即 index 中的下标，
+    // v2 及以后格式先由块索引找到所在的块并解析（每个文件只缓存最近一次解析的块，只在持有 KVStore 的 mutex 时使用）
+    // 查找 key 的序号，不存在返回 -1
+    int64_t find(uint64_t key);
+    uint64_t getKey(uint64_t i);
+    // value 带有长度（v1 格式按相邻 offset 定界）而不是以 '\0' 结尾，因此可以包含任意二进制数据
+    uint64_t getValueSize(uint64_t i);
+    // value 在文件中的位置，块经过压缩的文件为在解压后的块中的位置
+    uint64_t getValueOffset(uint64_t i);
+    // 第 i 个 value 在文件映射中的地址，不支持 mmap、映射失败或块经过压缩时返回 nullptr
+    const char* getValueData(uint64_t i);
+    // 将第 i 个 value 读入 buf（至少 getValueSize(i) 字节），有映射时直接从映射拷贝
+    void readValue(uint64_t i, char* buf);
+    std::string getValue(uint64_t i);
+    bool isDeletedValue(uint64_t i);
 
-    void readIndexAndDataForScan(std::list<std::pair<uint64_t, std::string> > &all, const uint64_t & key1, const uint64_t & key2);
+    // index 中 key 落在 [key1, key2] 内的下标区间 [start, end)，没有时 start == end
+    void findRange(uint64_t key1, uint64_t key2, uint64_t &start, uint64_t &end);
+    // 由内存中的 index 得到 [key1, key2] 内的 key 个数与索引区加数据区的字节数（累加到 keyCount / byteSize），不读文件
+    // v2 及以后格式只有块索引，按区间两端所在的整块计算
+    void approximateStats(uint64_t key1, uint64_t key2, uint64_t &keyCount, uint64_t &byteSize);
 
     uint64_t getTimeStamp(){return header.timeStamp;};
     uint64_t getMinKey(){return header.minKey;};
     uint64_t getMaxKey(){return header.maxKey;};
+    uint64_t getPairsNum(){return header.pairsNum;};
+    uint64_t getFileSize(){return fileSize;};
+    uint64_t getFormatVersion(){return formatVersion;};
+    uint64_t getDataEnd(){return dataEnd;};
+    // 值为 "~DELETED~" 的 key 个数，没有表属性段的旧文件为 0
+    uint64_t getDeletedNum(){return deletedNum;};
+    uint32_t getCodec(){return codec;};
+    // 文件是否带有校验和段，以及读取时检查的时机
+    bool hasChecksums(){return checksummed;};
+    ChecksumVerification getChecksumVerification(){return verification;};
+    // bloom filter 是否已在内存中（打开的已有文件在第一次 find 前没有载入）
+    bool isBloomFilterLoaded(){return bloomFilter != nullptr;};
+    // 块在文件中所存字节与块索引中记录的校验和不符时抛出错误
+    static void verifyBlock(const char* stored, uint64_t storedLength, const BlockHandle &block){
+        if(Checksums::crc32c(stored, storedLength) != block.checksum) throw("ERROR  SSTables: block checksum mismatch");
+    };
+    // 数据区压缩前与实际的大小
+    uint64_t getRawDataBytes(){return rawDataBytes;};
+    uint64_t getDataBytes(){return dataEnd - INIT_BYTES_SIZE;};
+    // 删除标记占比：删除标记个数 / key 个数，只有范围删除标记的文件视为 1
+    double getTombstoneRatio(){
+        if(header.pairsNum == 0) return rangeTombstones.empty() ? 0 : 1;
+        return (double)deletedNum / header.pairsNum;
+    };
+
+    // v2 及以后格式的块索引，构造后不再改变，compaction 线程可以不加锁读取
+    const std::vector<BlockHandle> &getBlocks(){return blocks;};
+    // 第一个 lastKey 不小于 key 的块的下标，没有时返回块数
+    uint64_t seekBlock(uint64_t key);
+    // 第 b 块在文件中的结束位置
+    uint64_t getBlockEnd(uint64_t b){return (b + 1 < blocks.size()) ? blocks[b + 1].offset : dataEnd;};
+    // 由文件中保存的一块得到块的原始内容：没有压缩时 data 直接指向 stored，否则解压到 out 中
+    // maxRawLength 为解压后长度的上限（文件的 getRawDataBytes()），超过时视为数据损坏
+    static void decodeBlock(const char* stored, uint64_t storedLength, uint32_t codec, uint64_t maxRawLength, std::vector<char> &out, const char* &data, uint64_t &length);
+    // 按 formatVersion 解析 data 中的一块（长度 length），各项 value 的 offset 为 baseOffset 加上其在 data 中的位置
+    static void parseBlock(const char* data, uint64_t length, uint64_t baseOffset, uint64_t formatVersion, std::vector<BlockEntry> &entries);
+    // v4 块是否为定长块，是时由块尾得到 value 的长度与项数，块尾不完整或长度不符时抛出错误
+    static bool parseFixedTrailer(const char* data, uint64_t length, uint32_t &valueWidth, uint32_t &entryNum);
+    // 在升序紧密排列的 n 个 key 中查找 key，返回下标，没有时返回 -1
+    static int64_t searchKeys(const char* keys, uint32_t n, uint64_t key);
+
+    // varint 编码：每字节低 7 位为数据，最高位表示之后还有字节
+    static void putVarint(std::string &dst, uint64_t value){
+        while(value >= 0x80){
+            dst.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        dst.push_back(static_cast<char>(value));
+    };
+    // 从 p 开始解码一个 varint，返回之后的位置，超出 limit 或编码错误时返回 nullptr
+    static const char* getVarint(const char* p, const char* limit, uint64_t &value){
+        value = 0;
+        for(unsigned int shift = 0; shift < 64 && p < limit; shift += 7){
+            uint64_t byte = static_cast<unsigned char>(*p++);
+            value |= (byte & 0x7f) << shift;
+            if(!(byte & 0x80)) return p;
+        }
+        return nullptr;
+    };
+
+    // 范围删除标记只遮蔽比本文件更旧的数据，本文件中的 key-value 对总是比本文件的范围删除标记更新
+    bool isRangeDeleted(uint64_t key){return rangeTombstones.covers(key);};
+    const RangeTombstones &getRangeTombstones(){return rangeTombstones;};
+
+    // [key1, key2] 中是否可能有本文件的 key-value 对，没有 RangeFilter 的文件只按上下界判断
+    bool mayContainRange(uint64_t key1, uint64_t key2){
+        if(key1 > header.maxKey || key2 < header.minKey || header.pairsNum == 0) return false;
+        return rangeFilter == nullptr || rangeFilter->mayContain(key1, key2);
+    };
+
+    std::string getFilePath(){return dir + "/" + fileName + ".sst";};
+    // 将文件移动到 newDir 下并改名为 newFileName（用于被淘汰但仍被快照引用的文件）
+    void relocate(const std::string &newDir, const std::string &newFileName);
+
+    // 引用计数：所在层的 cache 持有一份（构造时为 1），每个引用它的 Snapshot 再各持有一份
+    void ref(){ ++refs; };
+    // 返回剩余引用数，降为 0 时由调用者负责删除文件与对象
+    uint64_t unref(){ return --refs; };
+    uint64_t getRefs(){ return refs; };
 
     // 在构造函数中确定文件名并赋值到此处，不包含.sst
     // 文件命名格式 timeStamp minKey-maxKey pairsNum
@@ -49,19 +175,310 @@ public:
 private:
     std::string dir;
     Header header;
+    // 新写出的文件在构造时生成，打开的已有文件在第一次 find 时由 loadBloomFilter 载入
     BloomFilters* bloomFilter = nullptr;
+    RangeFilters* rangeFilter = nullptr;  // 可选，旧文件或未开启时为 nullptr
+    // v1 格式：每个 key 一项的稠密索引
     std::vector<Index> index;
+    // v2 及以后格式：每块一项的稀疏索引，以及最近一次解析的块
+    uint64_t formatVersion = 3;
+    std::vector<BlockHandle> blocks;
+    int64_t loadedBlock = -1;
+    std::vector<BlockEntry> loadedEntries;
+    std::vector<char> blockBuffer;
+    // 块压缩的 codec、数据区压缩前的大小，以及最近一次解压的块
+    uint32_t codec = BLOCK_CODEC_NONE;
+    uint64_t rawDataBytes = 0;
+    int64_t decodedBlockIndex = -1;
+    std::vector<char> decodedBlock;
+    const char* decodedData = nullptr;
+    uint64_t decodedLength = 0;
+    // v3 格式点查时经重启点找到的一项（不解析整块），序号为 foundOrdinal
+    bool hasFoundEntry = false;
+    uint64_t foundOrdinal = 0;
+    BlockEntry foundEntry;
+    RangeTombstones rangeTombstones;
+    // 数据区结束位置（即 meta 段开始位置），旧格式文件为文件末尾
+    uint64_t dataEnd = INIT_BYTES_SIZE;
+    uint64_t fileSize = 0;
+    uint64_t deletedNum = 0;
+    uint64_t refs = 1;
+    // 校验和段中的 header 与 bloom filter 区的校验和，各块的校验和在 blocks 中
+    bool checksummed = false;
+    uint32_t headerChecksum = 0;
+    // 分开的 header 与 bloom filter 的校验和，旧文件没有
+    bool hasFilterChecksum = false;
+    uint32_t headerOnlyChecksum = 0;
+    uint32_t filterChecksum = 0;
+    ChecksumVerification verification = CHECKSUM_VERIFY_NEVER;
+    // 只读映射整个文件，第一次读取 value 时建立；文件被改名或删除后映射仍然有效，析构时解除
+    const char* mappedData = nullptr;
+    uint64_t mappedSize = 0;
+    bool mapFailed = false;
+    void mapFile();
+    void unmapFile();
+    // 第 b 块的原始内容（长度写入 length），有映射且没有压缩时直接指向映射，否则读入 blockBuffer 或解压到 decodedBlock
+    const char* readBlockData(uint64_t b, uint64_t &length);
+    // 序号 i 所在的块的下标
+    uint64_t blockIndexOf(uint64_t i);
+    // 解析第 b 块到 loadedEntries（offset 为文件中的位置）
+    void loadBlock(uint64_t b);
+    // v3 格式：在第 b 块中经重启点二分查找 key，找到时写入 foundEntry / foundOrdinal
+    bool seekInBlock(uint64_t b, uint64_t key);
+    // 序号 i 所在的块中的一项
+    const BlockEntry &blockEntry(uint64_t i);
+    // 第一个不小于 key（upper 为 true 时为大于 key）的 key 的序号，没有时返回 pairsNum
+    uint64_t seekOrdinal(uint64_t key, bool upper);
 
-    void writeHeader(std::ofstream &ostrm);
-    void writeBloomFilter(std::ofstream &ostrm);
-    void writeIndexAndData(std::ofstream &ostrm, std::list<std::pair<uint64_t, std::string> > &list);
+    // 以下写入内存：header 与 bloom filter 写到 dst 并后移 dst，meta 段与 footer 追加到 out
+    void writeHeader(char* &dst);
+    void writeBloomFilter(char* &dst);
+    void writeMetaAndFooter(std::string &out);
 
     void readHeader(std::ifstream &istrm);
-    void readBloomFilter(std::ifstream &istrm);
+    // 第一次 find 时载入 bloom filter，有分开的校验和时在此检查（只在持有 KVStore 的 mutex 时调用）
+    void loadBloomFilter();
     void readAllIndex(std::ifstream &istrm);
+    void readMetaAndFooter(std::ifstream &istrm);
+    // 检查 header 的校验和；没有分开的校验和的文件读出并检查整个 header 与 bloom filter 区
+    void verifyHeader(std::ifstream &istrm);
+
+
+};
 
-    std::string getData(const uint32_t &posDataStart, uint32_t posDataEnd, const std::string &filePath);
+// compaction 中按 key 顺序流式读出一个 SSTable 中 key 落在 [key1, key2] 内的 key-value 对
+// v1 格式的数据区按 COMPACTION_READ_BUFFER_SIZE 分段读入，内存中只保留当前一段（value 比一段大时为该 value 的大小）；
+// v2 及以后格式按块读入并自行解析，不使用 SSTables 中缓存的块，因此可以在不持有 mutex 时与前台读并行
+// rateLimiter 不为 nullptr 时每次读入前经其限速；dropCache 为 true 时读过的部分每 COMPACTION_DROP_CACHE_BYTES 从页缓存中丢弃一次
+class SSTableReaders {
+public:
+    explicit SSTableReaders(SSTables* table, uint64_t key1 = 0, uint64_t key2 = UINT64_MAX, RateLimiters* rateLimiter = nullptr, bool dropCache = false);
+    ~SSTableReaders();
+
+    bool valid(){return pos < end;};
+    uint64_t key(){return blockBased ? entries[pos].key : table->getKey(pos);};
+    // 当前 value 的地址，在 next() 之前有效
+    const char* value();
+    uint64_t valueSize(){return blockBased ? entries[pos].size : table->getValueSize(pos);};
+    void next();
+
+private:
+    SSTables* table;
+    RateLimiters* rateLimiter;
+    std::ifstream istrm;
+    bool blockBased;
+    uint64_t key1;
+    uint64_t key2;
+    // v1 格式为 index 中尚未读出的下标区间 [pos, end)，v2 及以后格式为当前块 entries 中的下标区间
+    uint64_t pos = 0;
+    uint64_t end = 0;
+    std::vector<char> buffer;
+    // v1 格式：buffer 中数据在文件中的起始位置与长度
+    uint64_t bufferOffset = 0;
+    uint64_t bufferLength = 0;
+    // v2 及以后格式：下一个要读入的块、当前块的原始内容（指向 buffer 或 decoded）与解析出的各项（offset 为在块中的位置）
+    uint64_t nextBlock = 0;
+    std::vector<char> decoded;
+    const char* blockData = nullptr;
+    std::vector<BlockEntry> entries;
+    void readBlock();
+    // 丢弃页缓存：只用于 posix_fadvise 的文件描述符（-1 为不丢弃），以及读过但尚未丢弃的区间 [cacheStart, cacheEnd)
+    int cacheFd = -1;
+    uint64_t cacheStart = 0;
+    uint64_t cacheEnd = 0;
+    // 从文件 offset 处读入 length 字节到 buffer（经限速），并记录读过的区间
+    void readRange(uint64_t offset, uint64_t length);
+    // 读过的区间累计达到 COMPACTION_DROP_CACHE_BYTES（force 时不论多少）时丢弃其页缓存
+    void dropReadCache(bool force);
+};
+
+// 顺序写出一个文件：append 把若干段追加到文件末尾，writeAt 改写已经写出的部分，finish 按需落盘后关闭
+// 支持 POSIX 时用 writev / pwrite 与 fdatasync，否则经 ofstream 写出
+// rateLimiter 不为 nullptr 时每次至多写出 RATE_LIMITER_WRITE_CHUNK_BYTES 字节，写出前经其申请额度，highPriority 含义同 RateLimiters::request
+// 没有 finish 就析构（出错）时关闭并删除文件
+class SSTableWriters {
+public:
+    explicit SSTableWriters(const std::string &path, RateLimiters* rateLimiter = nullptr, bool highPriority = false);
+    ~SSTableWriters();
+    void append(const std::vector<std::pair<const char*, uint64_t> > &parts);
+    void writeAt(uint64_t offset, const char* data, uint64_t size);
+    // sync 为 true 时落盘后返回；dropCache 为 true 时总是先落盘，再丢弃其页缓存
+    void finish(bool sync, bool dropCache);
+    const std::string &getPath(){return path;};
+
+private:
+    std::string path;
+    RateLimiters* rateLimiter;
+    bool highPriority;
+    bool finished = false;
+    int fd = -1;  // 支持 POSIX 时使用
+    std::ofstream ostrm;  // 否则使用
+};
+
+// 流式构建一个 SSTable：key-value 对按 key 顺序逐个追加，按 v3 格式直接编码成数据块，codec 不为 NONE 时每块结束时压缩
+// fixedWidth 为 true 时 value 长度都相同的块在结束时改写为定长块（文件为 v4 格式）
+// 数据边构建边写入临时文件 path：header 与 bloom filter 区先留空，结束的块累积到 SSTABLE_BUILDER_FLUSH_BYTES 时一并写出，
+// 由 SSTables 的构造函数写出其余部分、补上 header 与 bloom filter 后改名；
+// 内存中只保留尚未写出的块、块索引、bloom filter 与差分编码的 key 序列（用于生成 RangeFilter）
+class SSTableBuilders {
+    friend class SSTables;
+public:
+    explicit SSTableBuilders(const std::string &path, uint32_t codec = BLOCK_CODEC_NONE, uint64_t expectedSize = MAX_BYTES_SIZE, bool fixedWidth = false, RateLimiters* rateLimiter = nullptr, bool highPriority = false):
+            codec(codec), fixedWidth(fixedWidth), writer(path, rateLimiter, highPriority), bloomFilter(new BloomFilters(0)) {
+        data.reserve(INIT_BYTES_SIZE + std::min<uint64_t>(expectedSize, SSTABLE_BUILDER_FLUSH_BYTES + SSTABLE_BLOCK_SIZE));
+        data.append(INIT_BYTES_SIZE, '\0');
+        blockOffset = data.size();
+    };
+    ~SSTableBuilders(){ delete bloomFilter; };
+    void add(uint64_t key, const char* value, uint64_t size){
+        // 每 SSTABLE_BLOCK_RESTART_INTERVAL 项为一个重启点，保存 key 本身，其余保存与上一个 key 的差
+        if(blockEntryNum % SSTABLE_BLOCK_RESTART_INTERVAL == 0){
+            restarts.push_back(data.size() - blockOffset);
+            SSTables::putVarint(data, key);
+        } else {
+            SSTables::putVarint(data, key - lastKey);
+        }
+        SSTables::putVarint(keyDeltas, pairsNum == 0 ? key : key - lastKey);
+        if(pairsNum == 0) minKey = key;
+        lastKey = key;
+        ++pairsNum;
+        bloomFilter->set(key);
+        SSTables::putVarint(data, size);
+        if(fixedWidth){
+            if(blockEntryNum == 0){
+                blockUniform = true;
+                blockValueWidth = size;
+            } else if(size != blockValueWidth){
+                blockUniform = false;
+                blockValues.clear();
+            }
+            if(blockUniform) blockValues.push_back(data.size());
+            blockKeys.push_back(key);
+        }
+        data.append(value, size);
+        ++blockEntryNum;
+        if(blockSize() >= SSTABLE_BLOCK_SIZE){
+            finishBlock();
+            if(data.size() >= SSTABLE_BUILDER_FLUSH_BYTES) flush();
+        }
+        static const std::string deleted = "~DELETED~";
+        if(size == deleted.size() && memcmp(value, deleted.data(), size) == 0) ++deletedNum;
+    };
+    uint64_t getPairsNum(){return pairsNum;};
+    // 写出后的文件大小（不含 meta 段中块索引以外的部分与 footer）
+    uint64_t getSize(){return flushedBytes + blockOffset + blockSize() + (blocks.size() + 1) * BLOCK_INDEX_ENTRY_BYTES_SIZE;};
+    uint64_t getMinKey(){return minKey;};
+    uint64_t getMaxKey(){return lastKey;};
+    // 按 key 从小到大对每个 key 调用 f
+    template<typename F>
+    void forEachKey(F f){
+        uint64_t key = 0, delta;
+        const char* p = keyDeltas.data();
+        const char* limit = p + keyDeltas.size();
+        while(p != nullptr && p < limit){
+            p = SSTables::getVarint(p, limit, delta);
+            key += delta;
+            f(key);
+        }
+    };
+
+private:
+    uint64_t pairsNum = 0;
+    uint64_t minKey = 0;
+    uint64_t lastKey = 0;
+    // 各 key 与前一个 key 的差（第一个为 key 本身），varint 编码
+    std::string keyDeltas;
+    // 尚未写出的部分（从文件中 flushedBytes 处开始），以及已经结束的块（offset 为在文件中的位置）
+    std::string data;
+    uint64_t flushedBytes = 0;
+    std::vector<BlockHandle> blocks;
+    // 当前块在 data 中的起始位置、项数与各重启点在块内的位置
+    uint64_t blockOffset = 0;
+    uint32_t blockEntryNum = 0;
+    std::vector<uint32_t> restarts;
+    uint64_t deletedNum = 0;
+    uint32_t codec;
+    uint64_t rawDataBytes = 0;
+    // 定长块：当前块的 value 长度是否都相同、该长度以及各 key 与各 value 在 data 中的位置；写出过定长块时文件使用 v4 格式
+    bool fixedWidth;
+    bool hasFixedBlocks = false;
+    bool blockUniform = false;
+    uint64_t blockValueWidth = 0;
+    std::vector<uint64_t> blockKeys;
+    std::vector<uint64_t> blockValues;
+    SSTableWriters writer;
+    // 压缩各块时复用的哈希表与输出缓冲区
+    LZCompressors compressor;
+    std::string compressed;
+    // 随 key 的加入生成，由 SSTables 的构造函数取走
+    BloomFilters* bloomFilter;
 
+    // 当前块结束时（压缩前）的大小，按 finishBlock 实际写出的布局计算：定长块为 key * n | value * n | 块尾，否则为 v3 块
+    uint64_t blockSize(){
+        if(fixedWidth && blockUniform && blockEntryNum != 0) return blockEntryNum * (KEY_BYTES_SIZE + blockValueWidth) + FIXED_BLOCK_TRAILER_BYTES_SIZE;
+        return data.size() - blockOffset + restarts.size() * RESTART_OFFSET_BYTES_SIZE + BLOCK_TRAILER_BYTES_SIZE;
+    };
+    // 写出已经结束的块（只在块的边界调用，data 中没有未结束的块）
+    void flush(){
+        std::vector<std::pair<const char*, uint64_t> > parts;
+        parts.push_back(std::make_pair(data.data(), data.size()));
+        writer.append(parts);
+        flushedBytes += data.size();
+        data.clear();
+        blockOffset = 0;
+    };
+    // 写出块尾：重启点偏移 * n | 重启间隔 | n；定长块改写为 key * n | value * n | valueWidth | 0 | n
+    void finishBlock(){
+        if(blockEntryNum == 0) return;
+        if(fixedWidth && blockUniform){
+            std::string block;
+            block.reserve(blockEntryNum * (KEY_BYTES_SIZE + blockValueWidth) + FIXED_BLOCK_TRAILER_BYTES_SIZE);
+            block.append(reinterpret_cast<const char*>(blockKeys.data()), blockEntryNum * KEY_BYTES_SIZE);
+            for(auto it = blockValues.begin(); it != blockValues.end(); ++it){
+                block.append(data, *it, blockValueWidth);
+            }
+            uint32_t valueWidth = blockValueWidth;
+            uint32_t interval = 0;
+            block.append(reinterpret_cast<const char*>(&valueWidth), sizeof(valueWidth));
+            block.append(reinterpret_cast<const char*>(&interval), sizeof(interval));
+            block.append(reinterpret_cast<const char*>(&blockEntryNum), sizeof(blockEntryNum));
+            data.resize(blockOffset);
+            data.append(block);
+            hasFixedBlocks = true;
+        } else {
+            uint32_t interval = SSTABLE_BLOCK_RESTART_INTERVAL;
+            uint32_t restartNum = restarts.size();
+            data.append(reinterpret_cast<const char*>(restarts.data()), restartNum * RESTART_OFFSET_BYTES_SIZE);
+            data.append(reinterpret_cast<const char*>(&interval), sizeof(interval));
+            data.append(reinterpret_cast<const char*>(&restartNum), sizeof(restartNum));
+        }
+        restarts.clear();
+        blockKeys.clear();
+        blockValues.clear();
+        uint64_t rawLength = data.size() - blockOffset;
+        rawDataBytes += rawLength;
+        if(codec == BLOCK_CODEC_LZ){
+            compressed.clear();
+            SSTables::putVarint(compressed, rawLength);
+            compressor.compress(data.data() + blockOffset, rawLength, compressed);
+            if(compressed.size() < rawLength * BLOCK_COMPRESSION_MIN_RATIO){
+                data.resize(blockOffset);
+                data.append(compressed);
+                data.push_back(static_cast<char>(BLOCK_CODEC_LZ));
+            } else {
+                data.push_back(static_cast<char>(BLOCK_CODEC_NONE));
+            }
+        }
+        BlockHandle block;
+        block.lastKey = lastKey;
+        block.offset = flushedBytes + blockOffset;
+        block.firstOrdinal = pairsNum - blockEntryNum;
+        block.entryNum = blockEntryNum;
+        block.checksum = Checksums::crc32c(data.data() + blockOffset, data.size() - blockOffset);
+        blocks.push_back(block);
+        blockOffset = data.size();
+        blockEntryNum = 0;
+    };
 };
 
 
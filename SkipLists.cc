@@ -27,23 +27,41 @@ void SkipLists::scan(uint64_t key_start, uint64_t key_end, std::list<std::pair<u
     SKNode* x = head;
     // -- loop invariant: head→key < searchKey
     for (int i = MAX_LEVEL - 1; i >= 0 ; --i){
-        while(x->forwards[i]->key < key_start){
+        while(x->forwards[i]->type != SKNodeType::NIL && x->forwards[i]->key < key_start){
             x = x->forwards[i];
         }
     }
     // -- x→key < searchKey ≤ x→forward[1]→key
+    // 删除标记 ~DELETED~ 也一并返回，由上层用它遮蔽 SSTable 中更旧的值
     x = x->forwards[0];
-    if (x->key == key_start) { // find
-        if(x->val != "~DELETED~"){
-            std::pair<uint64_t, std::string> new_pair(x->key, x->val);
-            list.push_back(new_pair);
-        }
-    }
-    while(x->forwards[0]->key <= key_end){
+    while(x->type != SKNodeType::NIL && x->key <= key_end){
+        list.emplace_back(x->key, x->val);
         x = x->forwards[0];
-        if(x->val != "~DELETED~"){
-            std::pair<uint64_t, std::string> new_pair(x->key, x->val);
-            list.push_back(new_pair);
+    }
+}
+
+// 第 i 层的节点可以看作最底层节点的随机采样（每个节点出现在第 i 层的概率为 1/2^i），
+// 从最高层开始数区间内的节点，个数足够多时按 2^i 放大作为估计，否则下降一层重新数
+void SkipLists::approximateStats(uint64_t key_start, uint64_t key_end, uint64_t &keyCount, uint64_t &byteSize)
+{
+    if(key_start > key_end) return;
+    SKNode* x = head;
+    for (int i = MAX_LEVEL - 1; i >= 0 ; --i){
+        while(x->forwards[i]->type != SKNodeType::NIL && x->forwards[i]->key < key_start){
+            x = x->forwards[i];
+        }
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+        SKNode* y = x->forwards[i];
+        while(y->type != SKNodeType::NIL && y->key <= key_end){
+            ++count;
+            bytes += y->val.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE;
+            y = y->forwards[i];
+        }
+        if(count >= SKIPLIST_ESTIMATE_MIN_NODES || i == 0){
+            keyCount += count << i;
+            byteSize += bytes << i;
+            return;
         }
     }
 }
@@ -59,7 +77,7 @@ void SkipLists::put(uint64_t key, const std::string &value)
     }
 
     for (int i = MAX_LEVEL - 1; i >= 0; --i) {
-        while (x->forwards[i]->key < key) {
+        while (x->forwards[i]->type != SKNodeType::NIL && x->forwards[i]->key < key) {
             x = x->forwards[i];
         }
         update[i] = x;
@@ -67,7 +85,7 @@ void SkipLists::put(uint64_t key, const std::string &value)
 
     // -- x→key < searchKey ≤ x→forward[i]→key
     x = x->forwards[0];
-    if (x->key == key) {
+    if (x->type != SKNodeType::NIL && x->key == key) {
         // size 的增加由预测时做
         this->setSize(this->getSize() - (x->val).length() - KEY_BYTES_SIZE - OFFSET_BYTES_SIZE);
         x->val = value;
@@ -87,13 +105,13 @@ std::string SkipLists::get(uint64_t key)
     SKNode* x = head;
     // -- loop invariant: head→key < searchKey
     for (int i = MAX_LEVEL - 1; i >= 0 ; --i){
-        while(x->forwards[i]->key < key){
+        while(x->forwards[i]->type != SKNodeType::NIL && x->forwards[i]->key < key){
             x = x->forwards[i];
         }
     }
     // -- x→key < searchKey ≤ x→forward[1]→key
     x = x->forwards[0];
-    if (x->key == key) { // found, return x->value
+    if (x->type != SKNodeType::NIL && x->key == key) { // found, return x->value
         return x->val;
     }
     else { // not found, return failure
@@ -102,6 +120,12 @@ std::string SkipLists::get(uint64_t key)
 }
 
 bool SkipLists::del(uint64_t key)
+{
+    if(get(key) == "~DELETED~") return false;
+    return erase(key);
+}
+
+bool SkipLists::erase(uint64_t key)
 {
     std::vector<SKNode *> update;
     for (int i = 0; i < MAX_LEVEL; ++i)
@@ -110,14 +134,13 @@ bool SkipLists::del(uint64_t key)
     }
     SKNode* x = head;
     for (int i = MAX_LEVEL - 1; i >= 0; --i){
-        while(x->forwards[i]->key < key){
+        while(x->forwards[i]->type != SKNodeType::NIL && x->forwards[i]->key < key){
             x = x->forwards[i];
         }
         update[i] = x;
     }
     x = x->forwards[0];
-    if(x->key == key){
-        if(x->val == "~DELETED~") return false;
+    if(x->type != SKNodeType::NIL && x->key == key){
         for(int i = 0; i < MAX_LEVEL; ++i){
             if(update[i]->forwards[i] != x) break;
             update[i]->forwards[i] = x->forwards[i];
@@ -14,6 +14,8 @@
 #include "constant.h"
 
 #define MAX_LEVEL 8
+// approximateStats 中某一层区间内的节点数不少于该值时即以该层为准
+#define SKIPLIST_ESTIMATE_MIN_NODES 16
 
 enum SKNodeType
 {
@@ -62,10 +64,23 @@ public:
     void put(uint64_t key, const std::string &value);
     std::string get(uint64_t key);
     bool del(uint64_t key);
+    // 直接移除节点（包括删除标记），返回是否存在
+    bool erase(uint64_t key);
     void scan(uint64_t key_start, uint64_t key_end, std::list<std::pair<uint64_t, std::string> > &list);
+    // 估计 [key_start, key_end] 内的节点个数与占用大小（累加到 keyCount / byteSize），不遍历最底层
+    void approximateStats(uint64_t key_start, uint64_t key_end, uint64_t &keyCount, uint64_t &byteSize);
     void reset();
     void display();
     void getAll(std::list<std::pair<uint64_t, std::string> > &all, uint64_t &minKey, uint64_t &maxKey, uint64_t &numKey);
+    // 按 key 从小到大对每个节点（包括删除标记）调用 visit(key, val)，不复制 value
+    template<typename Visitor>
+    void forEach(Visitor visit)
+    {
+        for (SKNode *n = head->forwards[0]; n->type != SKNodeType::NIL; n = n->forwards[0])
+        {
+            visit(n->key, n->val);
+        }
+    }
     ~SkipLists()
     {
         SKNode *n1 = head;
@@ -0,0 +1,66 @@
+//
+// Created by ENVY on 2022/6/5.
+//
+
+#ifndef LSM_KV_THREADPOOLS_H
+#define LSM_KV_THREADPOOLS_H
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// 固定线程数的线程池，用于 subcompaction：线程在 KVStore 的生命周期内常驻，不必每次 compaction 重新创建
+// 任务按提交顺序执行，不能抛出异常（由任务自己捕获并转交给提交者）；析构时执行完已提交的任务再结束各线程
+class ThreadPools {
+public:
+    explicit ThreadPools(uint64_t threadNum){
+        for(uint64_t i = 0; i < threadNum; ++i) threads.emplace_back(&ThreadPools::run, this);
+    }
+    ~ThreadPools(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for(auto it = threads.begin(); it != threads.end(); ++it) (*it).join();
+    }
+    ThreadPools(const ThreadPools &) = delete;
+    ThreadPools &operator=(const ThreadPools &) = delete;
+
+    void schedule(std::function<void()> task){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+    uint64_t getThreadNum() const {return threads.size();};
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()> > tasks;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    void run(){
+        while(true){
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]{ return stopping || !tasks.empty(); });
+                if(tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+
+#endif //LSM_KV_THREADPOOLS_H
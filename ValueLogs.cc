@@ -0,0 +1,285 @@
+//
+// Created by ENVY on 2022/6/4.
+//
+
+#include "ValueLogs.h"
+
+#include <algorithm>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define VALUELOGS_USE_FDATASYNC
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+ValueLogs::ValueLogs(const std::string &_dir, uint64_t _fileSizeLimit): dir(_dir), fileSizeLimit(_fileSizeLimit)
+{
+    if(!utils::dirExists(dir)) return;
+    std::vector<std::string> fileNames;
+    utils::scanDir(dir, fileNames);
+    for(auto it = fileNames.begin(); it != fileNames.end(); ++it){
+        auto idx = (*it).find(".vlog");
+        if(idx == std::string::npos) throw("ERROR  in ValueLogs: file name not including .vlog");
+        uint64_t fileNum = std::stoull((*it).substr(0, idx));
+        struct stat st;
+        if(stat(getFilePath(fileNum).c_str(), &st) != 0) throw("ERROR  in ValueLogs: stat value log failed");
+        // 先记为全部失效，由 addLive 扣除仍被引用的记录
+        files[fileNum].bytes = st.st_size;
+        files[fileNum].garbageBytes = st.st_size;
+        if(fileNum >= nextFileNum) nextFileNum = fileNum + 1;
+    }
+}
+
+ValueLogs::~ValueLogs()
+{
+    for(auto it = readers.begin(); it != readers.end(); ++it){
+        delete it->second;
+    }
+}
+
+std::string ValueLogs::append(uint64_t key, const char* value, uint64_t size)
+{
+    if(activeFileNum == 0){
+        if(!utils::dirExists(dir)) utils::mkdir(dir.c_str());
+        activeFileNum = nextFileNum++;
+        writer.open(getFilePath(activeFileNum), std::ios::binary | std::ios::trunc);
+        if(!writer) throw("ERROR  in ValueLogs: create value log failed");
+        files[activeFileNum];
+    }
+    LogFile &file = files[activeFileNum];
+    uint32_t valueSize = size;
+    writer.write(reinterpret_cast<const char*>(&key), KEY_BYTES_SIZE);
+    writer.write(reinterpret_cast<const char*>(&valueSize), VALUE_SIZE_BYTES_SIZE);
+    writer.write(value, size);
+    if(!writer) throw("ERROR  in ValueLogs: write value log failed");
+    if(unsyncedFiles.empty() || unsyncedFiles.back() != activeFileNum) unsyncedFiles.push_back(activeFileNum);
+
+    std::string pointer(VALUE_POINTER_MAGIC);
+    uint64_t offset = file.bytes + VLOG_RECORD_HEADER_BYTES_SIZE;
+    pointer.append(reinterpret_cast<const char*>(&activeFileNum), sizeof(activeFileNum));
+    pointer.append(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    pointer.append(reinterpret_cast<const char*>(&valueSize), sizeof(valueSize));
+    file.bytes = offset + size;
+
+    // 写满后关闭，下一次追加时换新文件
+    if(file.bytes >= fileSizeLimit){
+        writer.close();
+        activeFileNum = 0;
+    }
+    return pointer;
+}
+
+void ValueLogs::read(const char* pointer, char* buf)
+{
+    uint64_t fileNum, offset;
+    uint32_t size;
+    decodePointer(pointer, fileNum, offset, size);
+    auto found = files.find(fileNum);
+    if(found == files.end()) throw("ERROR  in ValueLogs: value log not exist");
+    LogFile &file = found->second;
+    if(offset + size > file.bytes) throw("ERROR  in ValueLogs: value pointer out of range");
+    // 正在追加的文件先把缓冲区中的数据写出
+    if(fileNum == activeFileNum) writer.flush();
+    std::ifstream* reader = getReader(fileNum);
+    reader->clear();
+    reader->seekg(offset, std::ios::beg);
+    reader->read(buf, size);
+    if(!*reader) throw("ERROR  in ValueLogs: read value log failed");
+}
+
+std::string ValueLogs::read(const std::string &pointer)
+{
+    std::string value(pointerValueSize(pointer.data()), '\0');
+    if(!value.empty()) read(pointer.data(), &value[0]);
+    return value;
+}
+
+void ValueLogs::sync(bool durable)
+{
+    if(activeFileNum != 0){
+        writer.flush();
+        if(!writer) throw("ERROR  in ValueLogs: flush value log failed");
+    }
+    if(!durable) return;
+#ifdef VALUELOGS_USE_FDATASYNC
+    // 写满后换下的文件已由 close 写出，但同样需要落盘
+    for(auto it = unsyncedFiles.begin(); it != unsyncedFiles.end(); ++it){
+        if(files.find(*it) == files.end()) continue;
+        int fd = open(getFilePath(*it).c_str(), O_WRONLY);
+        if(fd < 0) throw("ERROR  in ValueLogs: open value log for sync failed");
+#ifdef __APPLE__
+        int synced = fsync(fd);
+#else
+        int synced = fdatasync(fd);
+#endif
+        if(close(fd) != 0 || synced != 0) throw("ERROR  in ValueLogs: sync value log failed");
+    }
+#endif
+    unsyncedFiles.clear();
+}
+
+void ValueLogs::addGarbage(const char* pointer)
+{
+    uint64_t fileNum, offset;
+    uint32_t size;
+    decodePointer(pointer, fileNum, offset, size);
+    // 已经回收的文件中的旧指针
+    auto found = files.find(fileNum);
+    if(found == files.end()) return;
+    found->second.garbageBytes += size + VLOG_RECORD_HEADER_BYTES_SIZE;
+    if(found->second.garbageBytes > found->second.bytes) found->second.garbageBytes = found->second.bytes;
+}
+
+void ValueLogs::addLive(const char* pointer)
+{
+    uint64_t fileNum, offset;
+    uint32_t size;
+    decodePointer(pointer, fileNum, offset, size);
+    auto found = files.find(fileNum);
+    if(found == files.end()) return;
+    uint64_t bytes = size + VLOG_RECORD_HEADER_BYTES_SIZE;
+    found->second.garbageBytes -= std::min(bytes, found->second.garbageBytes);
+}
+
+bool ValueLogs::pickGarbageFile(double ratio, uint64_t &fileNum)
+{
+    bool picked = false;
+    double bestRatio = ratio;
+    for(auto it = files.begin(); it != files.end(); ++it){
+        if(it->first == activeFileNum || it->second.bytes == 0) continue;
+        double fileRatio = (double)it->second.garbageBytes / (double)it->second.bytes;
+        if(fileRatio > bestRatio || (!picked && fileRatio >= bestRatio)){
+            picked = true;
+            bestRatio = fileRatio;
+            fileNum = it->first;
+        }
+    }
+    return picked;
+}
+
+uint64_t ValueLogs::readRecords(uint64_t fileNum, uint64_t offset, std::vector<char> &data, std::vector<ValueLogRecord> &records) const
+{
+    std::ifstream istrm(getFilePath(fileNum), std::ios::binary | std::ios::ate);
+    if(!istrm) throw("ERROR  in ValueLogs: open value log failed");
+    uint64_t fileLength = istrm.tellg();
+    if(offset >= fileLength) return offset;
+    auto readData = [&](uint64_t length){
+        uint64_t start = data.size();
+        data.resize(length);
+        istrm.seekg(offset + start, std::ios::beg);
+        istrm.read(&data[start], length - start);
+        if(!istrm) throw("ERROR  in ValueLogs: read value log failed");
+    };
+    readData(std::min<uint64_t>(VLOG_GC_READ_BYTES, fileLength - offset));
+    // 第一条记录比读入的部分长时补读其余部分
+    if(data.size() >= VLOG_RECORD_HEADER_BYTES_SIZE){
+        uint32_t size;
+        memcpy(&size, &data[KEY_BYTES_SIZE], VALUE_SIZE_BYTES_SIZE);
+        uint64_t length = VLOG_RECORD_HEADER_BYTES_SIZE + size;
+        if(length > data.size() && offset + length <= fileLength) readData(length);
+    }
+
+    uint64_t pos = 0;
+    while(pos + VLOG_RECORD_HEADER_BYTES_SIZE <= data.size()){
+        ValueLogRecord record;
+        memcpy(&record.key, &data[pos], KEY_BYTES_SIZE);
+        memcpy(&record.size, &data[pos + KEY_BYTES_SIZE], VALUE_SIZE_BYTES_SIZE);
+        if(pos + VLOG_RECORD_HEADER_BYTES_SIZE + record.size > data.size()) break;
+        record.offset = offset + pos + VLOG_RECORD_HEADER_BYTES_SIZE;
+        records.push_back(record);
+        pos += VLOG_RECORD_HEADER_BYTES_SIZE + record.size;
+    }
+    return offset + pos;
+}
+
+void ValueLogs::markObsolete(uint64_t fileNum)
+{
+    auto found = files.find(fileNum);
+    if(found == files.end()) return;
+    found->second.garbageBytes = found->second.bytes;
+    found->second.obsolete = true;
+}
+
+void ValueLogs::removeFile(uint64_t fileNum)
+{
+    auto found = files.find(fileNum);
+    if(found == files.end()) return;
+    closeReader(fileNum);
+    files.erase(found);
+    unsyncedFiles.erase(std::remove(unsyncedFiles.begin(), unsyncedFiles.end(), fileNum), unsyncedFiles.end());
+    if(utils::rmfile(getFilePath(fileNum).c_str())) throw("ERROR  in ValueLogs: remove value log failed");
+}
+
+void ValueLogs::removeObsoleteFiles()
+{
+    for(auto it = files.begin(); it != files.end();){
+        uint64_t fileNum = it->first;
+        bool obsolete = it->second.obsolete;
+        ++it;
+        if(obsolete) removeFile(fileNum);
+    }
+}
+
+void ValueLogs::clear()
+{
+    if(activeFileNum != 0){
+        writer.close();
+        activeFileNum = 0;
+    }
+    unsyncedFiles.clear();
+    while(!files.empty()){
+        removeFile(files.begin()->first);
+    }
+    if(utils::dirExists(dir)) utils::rmdir(dir.c_str());
+    nextFileNum = 1;
+}
+
+void ValueLogs::retireAll()
+{
+    if(activeFileNum != 0){
+        writer.close();
+        activeFileNum = 0;
+    }
+    for(auto it = files.begin(); it != files.end(); ++it){
+        markObsolete(it->first);
+    }
+}
+
+uint64_t ValueLogs::getTotalBytes()
+{
+    uint64_t bytes = 0;
+    for(auto it = files.begin(); it != files.end(); ++it){
+        bytes += it->second.bytes;
+    }
+    return bytes;
+}
+
+std::ifstream* ValueLogs::getReader(uint64_t fileNum)
+{
+    for(auto it = readers.begin(); it != readers.end(); ++it){
+        if(it->first != fileNum) continue;
+        readers.splice(readers.begin(), readers, it);
+        return it->second;
+    }
+    std::ifstream* reader = new std::ifstream(getFilePath(fileNum), std::ios::binary);
+    if(!*reader){
+        delete reader;
+        throw("ERROR  in ValueLogs: open value log failed");
+    }
+    readers.emplace_front(fileNum, reader);
+    if(readers.size() > VLOG_MAX_OPEN_READERS){
+        delete readers.back().second;
+        readers.pop_back();
+    }
+    return reader;
+}
+
+void ValueLogs::closeReader(uint64_t fileNum)
+{
+    for(auto it = readers.begin(); it != readers.end(); ++it){
+        if(it->first != fileNum) continue;
+        delete it->second;
+        readers.erase(it);
+        return;
+    }
+}
@@ -0,0 +1,107 @@
+//
+// Created by ENVY on 2022/6/4.
+//
+
+#ifndef LSM_KV_VALUELOGS_H
+#define LSM_KV_VALUELOGS_H
+
+#include "utils.h"
+#include "constant.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <fstream>
+
+// 值日志中的一条记录，offset 为 value 在文件中的位置
+struct ValueLogRecord {
+    uint64_t key;
+    uint64_t offset;
+    uint32_t size;
+};
+
+// key-value 分离的值日志：较大的 value 追加写入 dir 下的日志文件 <fileNum>.vlog，SSTable 中只保存指向它的指针
+// 每条记录为 key (8B) | valueSize (4B) | value，文件写满 fileSizeLimit 后换新文件，重启后也从新文件开始写
+// 指针的格式见 constant.h 中的 VALUE_POINTER_MAGIC；文件中已失效的字节数只在内存中：打开时所有文件记为全部失效，
+// KVStore 启动时对各层 SSTable 中的每个指针调用 addLive 扣除其指向的记录，之后由 compaction 丢弃指针时累计
+// 除 readRecords 外只在持有 KVStore 的 mutex 时使用
+class ValueLogs {
+public:
+    ValueLogs(const std::string &dir, uint64_t fileSizeLimit);
+    ~ValueLogs();
+
+    // 追加一条记录，返回指向其 value 的指针
+    std::string append(uint64_t key, const char* value, uint64_t size);
+    // 将指针指向的 value 读入 buf（至少 pointerValueSize(pointer) 字节）
+    void read(const char* pointer, char* buf);
+    std::string read(const std::string &pointer);
+
+    // value 是否具有指针的格式
+    static bool isPointer(const char* value, uint64_t size){
+        return size == VALUE_POINTER_BYTES_SIZE && memcmp(value, VALUE_POINTER_MAGIC, VALUE_POINTER_MAGIC_SIZE) == 0;
+    };
+    static void decodePointer(const char* pointer, uint64_t &fileNum, uint64_t &offset, uint32_t &size){
+        pointer += VALUE_POINTER_MAGIC_SIZE;
+        memcpy(&fileNum, pointer, sizeof(fileNum));
+        memcpy(&offset, pointer + sizeof(fileNum), sizeof(offset));
+        memcpy(&size, pointer + sizeof(fileNum) + sizeof(offset), sizeof(size));
+    };
+    static uint32_t pointerValueSize(const char* pointer){
+        uint64_t fileNum, offset;
+        uint32_t size;
+        decodePointer(pointer, fileNum, offset, size);
+        return size;
+    };
+
+    // 指针被 compaction 丢弃，其指向的记录不再有效
+    void addGarbage(const char* pointer);
+    // 启动时 SSTable 中仍有指向该记录的指针，记录仍有效
+    void addLive(const char* pointer);
+    // 已写满的文件中失效字节占比最高且不低于 ratio 的一个，没有时返回 false
+    bool pickGarbageFile(double ratio, uint64_t &fileNum);
+    // 从第 fileNum 个文件的 offset 处读出约 VLOG_GC_READ_BYTES（至少一条）完整的记录，data 从 offset 处开始；
+    // 返回之后下一条记录的位置，到文件末尾时 records 为空，末尾不完整的记录忽略（不访问内部状态，可以不加锁调用）
+    uint64_t readRecords(uint64_t fileNum, uint64_t offset, std::vector<char> &data, std::vector<ValueLogRecord> &records) const;
+    // 把缓冲区中的记录写出到文件；durable 为 true 时再对上次 sync 以来写过的文件 fdatasync
+    // 引用这些记录的 SSTable 写出之前调用，避免崩溃后 SSTable 中的指针指向不存在的记录
+    void sync(bool durable);
+    // 文件中的记录全部失效（有效的 value 已重新写入）
+    void markObsolete(uint64_t fileNum);
+    void removeFile(uint64_t fileNum);
+    // 删除所有已标记为全部失效的文件（没有快照可能读到其中的记录时调用）
+    void removeObsoleteFiles();
+    // 删除所有文件与目录
+    void clear();
+    // 所有文件标记为全部失效但暂不删除，仍可读出，之后的追加写入新文件（reset 时仍有快照引用这些文件）
+    void retireAll();
+
+    uint64_t getTotalBytes();
+    bool empty() const {return files.empty();};
+    std::string getFilePath(uint64_t fileNum) const {return dir + "/" + std::to_string(fileNum) + ".vlog";};
+
+private:
+    struct LogFile {
+        uint64_t bytes = 0;
+        uint64_t garbageBytes = 0;
+        bool obsolete = false;
+    };
+    std::string dir;
+    uint64_t fileSizeLimit;
+    std::map<uint64_t, LogFile> files;
+    // 正在追加的文件，0 表示还没有打开
+    uint64_t activeFileNum = 0;
+    uint64_t nextFileNum = 1;
+    std::ofstream writer;
+    // 上次 durable sync 之后追加过记录的文件
+    std::vector<uint64_t> unsyncedFiles;
+    // 读 value 时打开的文件，最近使用的在前，至多 VLOG_MAX_OPEN_READERS 个
+    std::list<std::pair<uint64_t, std::ifstream*> > readers;
+
+    std::ifstream* getReader(uint64_t fileNum);
+    void closeReader(uint64_t fileNum);
+};
+
+
+#endif //LSM_KV_VALUELOGS_H
@@ -9,9 +9,93 @@
 #define BF_BYTES_SIZE 10240
 #define MAX_BYTES_SIZE (2*1024*1024)
 #define INIT_BYTES_SIZE (32+BF_BYTES_SIZE)
+// Options::writeBufferSize 的下限，小于该值时按该值处理，保证 memTable 除 header 与 bloom filter 外还能放下数据
+#define MIN_WRITE_BUFFER_SIZE (INIT_BYTES_SIZE+64*1024)
 #define KEY_BYTES_SIZE 8
 #define OFFSET_BYTES_SIZE 4
 
+// SSTable 文件末尾的 footer：metaOffset (8B) | magic (8B)
+// 数据区之后、footer 之前为若干 meta 段，每段为 type (4B) | length (8B) | payload
+// 没有 footer 的旧文件数据区一直延伸到文件末尾
+#define FOOTER_BYTES_SIZE 16
+#define SSTABLE_MAGIC 0xdb4775248b80fb57ULL
+#define META_RANGE_TOMBSTONES 1
+#define META_HEADER_BYTES_SIZE 12
+// 一个范围删除标记在 memTable / SSTable 中占用的大小（begin + end）
+#define RANGE_TOMBSTONE_BYTES_SIZE 16
+#define META_RANGE_FILTER 2
+// 表属性段：删除标记（"~DELETED~"）个数 (8B) | 数据区压缩前的大小 (8B) | 块压缩的 codec (4B)，旧文件可能只有前面的部分
+#define META_TABLE_PROPERTIES 3
+
+// v2 格式：bloom filter 之后的数据区分成约 SSTABLE_BLOCK_SIZE 字节的块，块内每项为 key (8B) | valueSize (4B) | value，
+// 不再有每个 key 一项的索引区；块索引作为 meta 段保存，footer 中的 magic 为 SSTABLE_MAGIC_V2
+#define SSTABLE_MAGIC_V2 0x5a3c9e1f7b2d4086ULL
+#define SSTABLE_BLOCK_SIZE 4096
+#define VALUE_SIZE_BYTES_SIZE 4
+// v3 格式：块内每项为 varint(key 与上一项 key 之差，重启点处为 key 本身) | varint(valueSize) | value，value 的位置由解码时累加得到；
+// 每 SSTABLE_BLOCK_RESTART_INTERVAL 项一个重启点，块尾为 重启点在块内的偏移 (4B) * n | 重启间隔 (4B) | n (4B)，点查时在重启点上二分查找
+#define SSTABLE_MAGIC_V3 0x8e61d3a72c4f1b95ULL
+#define SSTABLE_BLOCK_RESTART_INTERVAL 16
+#define RESTART_OFFSET_BYTES_SIZE 4
+#define BLOCK_TRAILER_BYTES_SIZE 8
+// 块压缩：表属性段中记录整个文件使用的 codec，不为 NONE 时每块末尾多 1 字节表示该块的实际编码，
+// LZ 块为 varint(压缩前长度) | LZCompressors 压缩后的数据；压缩后没有小于原长度的 BLOCK_COMPRESSION_MIN_RATIO 时保存原始数据
+#define BLOCK_CODEC_NONE 0
+#define BLOCK_CODEC_LZ 1
+#define BLOCK_COMPRESSION_MIN_RATIO 0.875
+// 定长块（Options::fixedWidthValues 开启且块内 value 长度都相同时使用）：key (8B) * n | value * n | valueWidth (4B) | 0 (4B) | n (4B)，
+// 第 i 项的 key 与 value 都由下标直接算出位置；块尾最后 8 字节与 v3 块的 重启间隔 | n 对应，以重启间隔为 0 区分
+#define FIXED_BLOCK_TRAILER_BYTES_SIZE 12
+// v4 格式：与 v3 相同，但可以有定长块；只有含定长块的文件使用，只认识 v3 的版本不会把定长块当作损坏的 v3 块读取
+#define SSTABLE_MAGIC_V4 0x3f9b52c6e1a7d048ULL
+// 定长块中查找 key 时二分查找缩小到不超过该个数后顺序比较（SSE2 每次比较两个）
+#define FIXED_BLOCK_SCAN_KEYS 8
+// 块索引段：count (8B) | (lastKey (8B), offset (8B), entryNum (4B)) * count
+#define META_BLOCK_INDEX 4
+#define BLOCK_INDEX_ENTRY_BYTES_SIZE 20
+// 校验和段（总是最后一段）：header 与 bloom filter 区 [0, INIT_BYTES_SIZE) 的 CRC32C (4B) | 之前各 meta 段的 CRC32C (4B) |
+// count (8B) | 各数据块在文件中所存字节的 CRC32C (4B) * count | 本段之前各字节（含段头）的 CRC32C (4B)
+// 旧版本不认识该段，直接跳过，因此不改变格式版本
+#define META_CHECKSUMS 5
+#define CHECKSUM_BYTES_SIZE 4
+// header 与 bloom filter 分开的校验和段：header [0, 32) 的 CRC32C (4B) | bloom filter 区 [32, INIT_BYTES_SIZE) 的 CRC32C (4B)
+// 打开文件时只检查 header，bloom filter 在第一次载入时再检查；没有该段的文件打开时按校验和段中合并的校验和检查整个区域
+#define META_FILTER_CHECKSUMS 6
+
+// RangeFilters 的 key 前缀层次：key 分别右移 0, 4, 8, ..., 32 位
+#define RANGE_FILTER_MIN_SHIFT 0
+#define RANGE_FILTER_MAX_SHIFT 32
+#define RANGE_FILTER_SHIFT_STEP 4
+// 查询时一层中最多检查的前缀个数，超过则换更粗的一层
+#define RANGE_FILTER_MAX_PROBES 16
+// 每个不同前缀占用的位数
+#define RANGE_FILTER_BITS_PER_PREFIX 10
+
+// compaction 流式读取 SSTable 时每次读入的数据区大小
+#define COMPACTION_READ_BUFFER_SIZE (64*1024)
+// compaction 读入的数据每累计该字节数从页缓存中丢弃一次（Options::dropCompactionPageCache）
+#define COMPACTION_DROP_CACHE_BYTES (1024*1024)
+// 写出 SSTable 时经限速器限速的，每次 write 至多写出该字节数，写出前先申请额度，避免整个文件一次突发写出
+#define RATE_LIMITER_WRITE_CHUNK_BYTES (64*1024)
+// 限速等待时每次至多睡眠的时长（微秒），醒来后把已等待的时长计入统计并重新检查额度
+#define RATE_LIMITER_WAIT_SLICE_MICROS 100000
+// SSTableBuilders 中结束的块累积到该字节数时一并写出，构建中的文件只在内存中保留这么多数据
+#define SSTABLE_BUILDER_FLUSH_BYTES (1024*1024)
+
+// key-value 分离：较大的 value 写入值日志，memTable / SSTable 中的 value 换成指针 "~VLOG~" | fileNum (8B) | offset (8B) | valueSize (4B)
+// 与 "~DELETED~" 一样按内容识别；用户写入的 value 恰好具有指针的格式时总是放入值日志，因此存储中这种格式的 value 一定是指针
+#define VALUE_POINTER_MAGIC "~VLOG~"
+#define VALUE_POINTER_MAGIC_SIZE 6
+#define VALUE_POINTER_BYTES_SIZE 26
+// 值日志中每条记录的 key (8B) | valueSize (4B)
+#define VLOG_RECORD_HEADER_BYTES_SIZE 12
+// 值日志垃圾回收时每持有一次 mutex 检查并重写的记录数
+#define VLOG_GC_BATCH_SIZE 256
+// 值日志垃圾回收时每次读入的字节数，超过它的单条记录整条读入
+#define VLOG_GC_READ_BYTES (1024*1024)
+// 读 value 时同时保持打开的值日志文件数
+#define VLOG_MAX_OPEN_READERS 16
+
 
 
 // PACK bool TO 4_BIT abcd
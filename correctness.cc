@@ -1,6 +1,16 @@
 #include <iostream>
 #include <cstdint>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <list>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #include "test.h"
 
@@ -10,6 +20,1118 @@ private:
     const uint64_t LARGE_TEST_MAX = 1024 * 64;
     // const uint64_t LARGE_TEST_MAX = 1024 * 32;
 
+	// dir 中第 level 层的 SSTable 文件名（"<时间戳> <最小 key>-<最大 key> <key 个数>.sst"），按名字排序
+	std::vector<std::string> table_names(const std::string &dir, uint64_t level)
+	{
+		std::vector<std::string> names;
+		std::string path = dir + "/level-" + std::to_string(level);
+		if (utils::dirExists(path))
+			utils::scanDir(path, names);
+		std::sort(names.begin(), names.end());
+		return names;
+	}
+
+	// dir 中第 level 层各个 SSTable 文件的大小（字节），顺序同 table_names
+	std::vector<uint64_t> table_sizes(const std::string &dir, uint64_t level)
+	{
+		std::vector<uint64_t> sizes;
+		for (const std::string &name : table_names(dir, level)) {
+			std::ifstream file(dir + "/level-" + std::to_string(level) + "/" + name, std::ios::binary | std::ios::ate);
+			sizes.push_back(file.tellg());
+		}
+		return sizes;
+	}
+
+	// 快照：之后的 put、del 与 compaction 都不影响通过快照读到的数据，
+	// 快照引用的文件在 compaction 中被淘汰时暂存于 .pinned，快照释放后删除
+	void snapshot_test(void)
+	{
+		uint64_t i;
+		int round;
+		KVStore kv("./data-snapshot");
+		kv.reset();
+
+		// 约 4MB 的数据，大部分已写出为 SSTable
+		for (i = 0; i < 1024; ++i)
+			kv.put(i, std::string(4096, 'a'));
+		const Snapshot *snapshot = kv.getSnapshot();
+
+		kv.put(0, "b");
+		EXPECT(true, kv.del(1));
+		kv.put(1024, "c");
+		EXPECT(std::string(4096, 'a'), kv.get(0, snapshot));
+		EXPECT(std::string(4096, 'a'), kv.get(1, snapshot));
+		EXPECT(not_found, kv.get(1024, snapshot));
+		EXPECT("b", kv.get(0));
+		EXPECT(not_found, kv.get(1));
+		EXPECT("c", kv.get(1024));
+		phase();
+
+		// 覆盖写三轮，创建快照时的文件都经过 compaction
+		for (round = 0; round < 3; ++round) {
+			for (i = 2; i < 1024; ++i)
+				kv.put(i, std::string(4096, 'd' + round));
+		}
+		std::list<std::pair<uint64_t, std::string> > list_stu;
+		kv.scan(0, 2048, list_stu, snapshot);
+		EXPECT(1024, list_stu.size());
+		for (auto sp = list_stu.begin(); sp != list_stu.end(); ++sp)
+			EXPECT(std::string(4096, 'a'), (*sp).second);
+		EXPECT(std::string(4096, 'f'), kv.get(2));
+		phase();
+
+		kv.releaseSnapshot(snapshot);
+		std::vector<std::string> pinned;
+		if (utils::dirExists("./data-snapshot/.pinned"))
+			utils::scanDir("./data-snapshot/.pinned", pinned);
+		EXPECT(0, pinned.size());
+		EXPECT(std::string(4096, 'f'), kv.get(1023));
+		phase();
+
+		report();
+	}
+
+	// 范围删除：一个删除标记遮蔽 memTable 与 SSTable 中范围内较旧的数据，之后写入的数据不受影响，重新打开后仍然有效
+	void delete_range_test(void)
+	{
+		uint64_t i;
+		std::list<std::pair<uint64_t, std::string> > list_stu;
+		{
+			KVStore kv("./data-range");
+			kv.reset();
+			// key 0-1023 大部分已写出为 SSTable，1024-1099 在 memTable 中
+			for (i = 0; i < 1024; ++i)
+				kv.put(i, std::string(4096, 'r'));
+			for (i = 1024; i < 1100; ++i)
+				kv.put(i, "m");
+			kv.deleteRange(500, 1049);
+			kv.put(600, "after");
+
+			EXPECT(std::string(4096, 'r'), kv.get(499));
+			EXPECT(not_found, kv.get(500));
+			EXPECT("after", kv.get(600));
+			EXPECT(not_found, kv.get(1049));
+			EXPECT("m", kv.get(1050));
+			EXPECT(false, kv.del(700));
+			// 490-499、600 与 1050-1059
+			kv.scan(490, 1059, list_stu);
+			EXPECT(21, list_stu.size());
+			phase();
+		}
+		{
+			KVStore kv("./data-range");
+			EXPECT(std::string(4096, 'r'), kv.get(499));
+			EXPECT(not_found, kv.get(500));
+			EXPECT("after", kv.get(600));
+			EXPECT(not_found, kv.get(1049));
+			EXPECT("m", kv.get(1050));
+			list_stu.clear();
+			kv.scan(490, 1059, list_stu);
+			EXPECT(21, list_stu.size());
+
+			kv.deleteRange(0, UINT64_MAX);
+			EXPECT(not_found, kv.get(0));
+			EXPECT(not_found, kv.get(600));
+			EXPECT(not_found, kv.get(1099));
+			phase();
+		}
+		{
+			KVStore kv("./data-range");
+			list_stu.clear();
+			kv.scan(0, UINT64_MAX, list_stu);
+			EXPECT(0, list_stu.size());
+			kv.put(5, "v");
+			EXPECT("v", kv.get(5));
+			phase();
+		}
+		// 被范围删除的项不再计入 memTable 的大小：反复写入并删除同一批 key（期间快照使当前 memTable 并入冻结的 memTable），不写出 SSTable
+		Options options;
+		options.writeBufferSize = 256 * 1024;
+		{
+			KVStore kv("./data-range", options);
+			kv.reset();
+			for (uint64_t round = 0; round < 8; ++round) {
+				for (i = 0; i < 100; ++i)
+					kv.put(i, std::string(1024, 'a' + round));
+				kv.releaseSnapshot(kv.getSnapshot());
+				kv.deleteRange(0, 99);
+				kv.releaseSnapshot(kv.getSnapshot());
+			}
+			EXPECT(not_found, kv.get(0));
+			for (uint64_t level = 0; level < 4; ++level)
+				EXPECT(0, table_names("./data-range", level).size());
+			phase();
+		}
+
+		report();
+	}
+
+	// RangeFilter：scan 不读键区间与范围相交、但范围内没有 key 的 SSTable，计入 scanFilteredTables
+	void range_filter_test(void)
+	{
+		uint64_t i, r;
+		std::list<std::pair<uint64_t, std::string> > list_stu;
+		Options options;
+		options.level0CompactionTrigger = 8;
+		{
+			KVStore kv("./data-rangefilter", options);
+			kv.reset();
+		}
+		// 每次关闭写出 level 0 的一个文件，4 个文件的键区间相互重叠，key 间隔 2^20
+		for (r = 0; r < 4; ++r) {
+			KVStore kv("./data-rangefilter", options);
+			for (i = 0; i < 32; ++i)
+				kv.put((i * 4 + r) << 20, std::string(1024, 'a' + r));
+		}
+		{
+			KVStore kv("./data-rangefilter", options);
+			EXPECT(0, kv.getStats().scanFilteredTables);
+			// 两个相邻 key 之间，4 个文件都不读
+			kv.scan((5 << 20) + 1, (5 << 20) + 2, list_stu);
+			EXPECT(0, list_stu.size());
+			EXPECT(4, kv.getStats().scanFilteredTables);
+			// 5 << 20 在第 2 个文件中，其余 3 个不读
+			kv.scan(5 << 20, (5 << 20) + 2, list_stu);
+			EXPECT(1, list_stu.size());
+			EXPECT(std::string(1024, 'b'), list_stu.front().second);
+			EXPECT(7, kv.getStats().scanFilteredTables);
+			phase();
+		}
+		// 关闭 RangeFilter 时新写出的文件只按上下界判断
+		options.rangeFilter = false;
+		{
+			KVStore kv("./data-rangefilter", options);
+			kv.reset();
+			for (i = 0; i < 32; ++i)
+				kv.put(i << 20, std::string(1024, 'n'));
+		}
+		{
+			KVStore kv("./data-rangefilter", options);
+			list_stu.clear();
+			kv.scan((5 << 20) + 1, (5 << 20) + 2, list_stu);
+			EXPECT(0, list_stu.size());
+			EXPECT(0, kv.getStats().scanFilteredTables);
+			phase();
+		}
+
+		report();
+	}
+
+	// 区间估计：只用内存中的索引，与区间内实际的 key 个数和字节数相差不超过 20%
+	void approximate_stats_test(void)
+	{
+		uint64_t i;
+		KVStore kv("./data-stats");
+		kv.reset();
+		EXPECT(0, kv.approximateStats(0, UINT64_MAX).keyCount);
+
+		// 约 4MB，一部分在 SSTable 中，一部分在 memTable 中
+		for (i = 0; i < 16384; ++i)
+			kv.put(i * 2, std::string(256, 's'));
+		ApproximateStats all = kv.approximateStats(0, UINT64_MAX);
+		EXPECT(true, all.keyCount >= 16384 * 8 / 10 && all.keyCount <= 16384 * 12 / 10);
+		EXPECT(true, all.byteSize >= 16384 * 256 * 8 / 10 && all.byteSize <= 16384 * 300 * 12 / 10);
+		ApproximateStats half = kv.approximateStats(0, 16383);
+		EXPECT(true, half.keyCount >= 8192 * 8 / 10 && half.keyCount <= 8192 * 12 / 10);
+		EXPECT(0, kv.approximateStats(16384 * 2, UINT64_MAX).keyCount);
+		EXPECT(0, kv.approximateStats(16384 * 2, UINT64_MAX).byteSize);
+		EXPECT(0, kv.approximateStats(5, 4).keyCount);
+		phase();
+
+		report();
+	}
+
+	// 零拷贝读：value 可以含有 '\0'；SSTable 中的 value 直接指向文件映射，memTable 中的拷贝到调用者的缓冲区
+	void pinnable_value_test(void)
+	{
+		uint64_t i;
+		KVStore kv("./data-pinnable");
+		kv.reset();
+		std::string value("a\0b\0\0c", 6);
+		value += std::string(100, '\0');
+
+		kv.put(1, value);
+		char buffer[256];
+		PinnableValue buffered(buffer, sizeof(buffer));
+		EXPECT(true, kv.get(1, buffered));
+		EXPECT(value, buffered.toString());
+		EXPECT(false, buffered.isPinned());
+		EXPECT(true, buffered.data() == buffer);
+		EXPECT(false, kv.get(2, buffered));
+		EXPECT(0, buffered.size());
+		phase();
+
+		// 写入约 4MB，把 key 1 写出到 SSTable
+		for (i = 2; i < 1024; ++i)
+			kv.put(i, std::string(4096, '\0'));
+		PinnableValue pinnable;
+		EXPECT(true, kv.get(1, pinnable));
+		EXPECT(value, pinnable.toString());
+		EXPECT(true, pinnable.isPinned());
+
+		std::list<std::pair<uint64_t, PinnableValue> > list_stu;
+		kv.scan(0, 10, list_stu);
+		EXPECT(10, list_stu.size());
+		EXPECT(value, list_stu.front().second.toString());
+		EXPECT(std::string(4096, '\0'), list_stu.back().second.toString());
+		list_stu.clear();
+		pinnable.reset();
+		phase();
+
+		report();
+	}
+
+	// 顺序写入：level 0 的文件与下一层没有交集，compaction 直接移动文件而不重写数据
+	void trivial_move_test(void)
+	{
+		uint64_t i, level;
+		int wait;
+		std::vector<std::string> names, reopened;
+		std::vector<uint64_t> timeStamps;
+		{
+			KVStore kv("./data-trivial");
+			kv.reset();
+			// 约 16MB
+			for (i = 0; i < 8192; ++i)
+				kv.put(i, std::string(2048, 't'));
+			for (wait = 0; wait < 500 && kv.getStats().trivialMoves == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(true, kv.getStats().trivialMoves > 0);
+			EXPECT(0, kv.getStats().compactions);
+			phase();
+		}
+		// 移动的文件保留原来的时间戳：各层文件的时间戳恰好是 1 到文件个数
+		for (level = 0; level < 8; ++level) {
+			for (const std::string &name : table_names("./data-trivial", level)) {
+				names.push_back(std::to_string(level) + "/" + name);
+				timeStamps.push_back(std::stoull(name));
+			}
+		}
+		std::sort(timeStamps.begin(), timeStamps.end());
+		EXPECT(true, timeStamps.size() > 1);
+		i = 0;
+		for (uint64_t timeStamp : timeStamps)
+			EXPECT(++i, timeStamp);
+		{
+			KVStore kv("./data-trivial");
+			for (i = 0; i < 8192; i += 7)
+				EXPECT(std::string(2048, 't'), kv.get(i));
+			EXPECT(not_found, kv.get(8192));
+		}
+		for (level = 0; level < 8; ++level) {
+			for (const std::string &name : table_names("./data-trivial", level))
+				reopened.push_back(std::to_string(level) + "/" + name);
+		}
+		EXPECT(true, names == reopened);
+		phase();
+
+		report();
+	}
+
+	// universal compaction：sorted run 的个数不超过 universalMaxSortedRuns，空间放大受 universalMaxSizeAmplificationPercent 限制
+	void universal_test(void)
+	{
+		uint64_t i, level, runs, bytes = 0;
+		int round, wait;
+		Options options;
+		options.compactionStyle = COMPACTION_STYLE_UNIVERSAL;
+		options.universalMaxSortedRuns = 4;
+		{
+			KVStore kv("./data-universal", options);
+			kv.reset();
+			// 覆盖写 6 轮，每轮约 4MB
+			for (round = 0; round < 6; ++round) {
+				for (i = 0; i < 4096; ++i)
+					kv.put(i, std::string(1024, 'a' + round));
+			}
+			for (wait = 0; wait < 500 && kv.getStats().compactions == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(true, kv.getStats().compactions > 0);
+			EXPECT(true, kv.del(0));
+			for (i = 1; i < 4096; ++i)
+				EXPECT(std::string(1024, 'f'), kv.get(i));
+			phase();
+		}
+		// 关闭时 compaction 已经完成：level 0 的每个文件与 level >= 1 的每个非空层各是一个 sorted run
+		runs = table_names("./data-universal", 0).size();
+		for (level = 0; level < 8; ++level) {
+			if (level > 0 && !table_names("./data-universal", level).empty())
+				++runs;
+			for (uint64_t size : table_sizes("./data-universal", level))
+				bytes += size;
+		}
+		EXPECT(true, runs <= 4);
+		// 存活的数据约 4MB
+		EXPECT(true, bytes <= 4096 * 1024 * 4);
+		{
+			KVStore kv("./data-universal", options);
+			EXPECT(not_found, kv.get(0));
+			for (i = 1; i < 4096; ++i)
+				EXPECT(std::string(1024, 'f'), kv.get(i));
+		}
+		phase();
+
+		report();
+	}
+
+	// 删除标记：更深的层中没有数据的 key 的删除标记在非最底层的 compaction 中即被丢弃；
+	// 删除标记占比超过 tombstoneCompactionRatio 的文件在没有其他 compaction 时被归并到下一层
+	void tombstone_compaction_test(void)
+	{
+		uint64_t i;
+		int wait;
+		Options options;
+		options.level0CompactionTrigger = 1;
+		options.dynamicLevelBytes = false;
+		options.maxBytesForLevelBase = 1536 * 1024;
+		// 每次打开写入的数据在关闭时写出为一个文件，并在关闭前完成 compaction
+		auto write = [&](uint64_t first, uint64_t last) {
+			KVStore kv("./data-tombstone", options);
+			for (i = first; i <= last; ++i)
+				kv.put(i, std::string(2048, 'b'));
+		};
+		{
+			KVStore kv("./data-tombstone", options);
+			kv.reset();
+		}
+		// level 1 超出 1.5MB，较旧的 [0, 511] 移到 level 2，level 1 只剩 [1000, 1511]
+		write(0, 511);
+		write(1000, 1511);
+		EXPECT(1, table_names("./data-tombstone", 1).size());
+		EXPECT(1, table_names("./data-tombstone", 2).size());
+		{
+			KVStore kv("./data-tombstone", options);
+			for (i = 1000; i < 1256; ++i)
+				EXPECT(true, kv.del(i));
+		}
+		// level 0 -> level 1 的 compaction 中，level 2 在 [1000, 1255] 中没有数据，删除标记和被删除的数据一起丢弃
+		std::vector<std::string> names = table_names("./data-tombstone", 1);
+		EXPECT(1, names.size());
+		EXPECT(true, names.size() == 1 && names[0].find(" 1256-1511 256.sst") != std::string::npos);
+		phase();
+
+		// 删除 level 2 中的 [0, 399]：只有删除标记的文件直接移到 level 1，
+		// 下次打开时（tombstoneCompactionRatio 恢复为 0.5）后台因删除标记占比过高把它归并到 level 2
+		options.tombstoneCompactionRatio = 2;
+		{
+			KVStore kv("./data-tombstone", options);
+			for (i = 0; i < 400; ++i)
+				EXPECT(true, kv.del(i));
+		}
+		names = table_names("./data-tombstone", 1);
+		EXPECT(2, names.size());
+		options.tombstoneCompactionRatio = 0.5;
+		{
+			KVStore kv("./data-tombstone", options);
+			for (wait = 0; wait < 500 && kv.getStats().tombstoneCompactions == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(true, kv.getStats().tombstoneCompactions > 0);
+			EXPECT(not_found, kv.get(0));
+			EXPECT(std::string(2048, 'b'), kv.get(400));
+			EXPECT(not_found, kv.get(1000));
+			EXPECT(std::string(2048, 'b'), kv.get(1256));
+		}
+		names = table_names("./data-tombstone", 2);
+		EXPECT(1, names.size());
+		EXPECT(true, names.size() == 1 && names[0].find(" 400-511 112.sst") != std::string::npos);
+		EXPECT(1, table_names("./data-tombstone", 1).size());
+		phase();
+
+		report();
+	}
+
+	// 因删除标记选出的文件即使与下一层不相交也重写而不直接移动，更深的层中没有数据的 key 的删除标记在写入时丢弃
+	void tombstone_rewrite_test(void)
+	{
+		uint64_t i;
+		int wait;
+		Options options, seed;
+		options.level0CompactionTrigger = 1;
+		options.dynamicLevelBytes = false;
+		options.maxBytesForLevelBase = 1536 * 1024;
+		seed = options;
+		seed.maxBytesForLevelBase = 512 * 1024;
+		// level 2：[0, 511]
+		{
+			KVStore kv("./data-tombstone", seed);
+			kv.reset();
+			for (i = 0; i < 512; ++i)
+				kv.put(i, std::string(2048, 'r'));
+		}
+		// level 1：只有 [5000, 5399] 删除标记的文件，这些 key 在更深的层中都没有数据
+		options.tombstoneCompactionRatio = 2;
+		{
+			KVStore kv("./data-tombstone", options);
+			for (i = 5000; i < 5400; ++i)
+				kv.put(i, "r");
+			for (i = 5000; i < 5400; ++i)
+				EXPECT(true, kv.del(i));
+		}
+		EXPECT(1, table_names("./data-tombstone", 1).size());
+		options.tombstoneCompactionRatio = 0.5;
+		{
+			KVStore kv("./data-tombstone", options);
+			for (wait = 0; wait < 500 && !table_names("./data-tombstone", 1).empty(); ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			KVStoreStats stats = kv.getStats();
+			EXPECT(1, stats.tombstoneCompactions);
+			EXPECT(1, stats.compactions);
+			EXPECT(0, stats.trivialMoves);
+			EXPECT(not_found, kv.get(5000));
+			EXPECT(std::string(2048, 'r'), kv.get(511));
+		}
+		// 删除标记全部丢弃，没有留下文件
+		EXPECT(0, table_names("./data-tombstone", 1).size());
+		EXPECT(1, table_names("./data-tombstone", 2).size());
+		phase();
+
+		report();
+	}
+
+	// level >= 1 选取输入：COMPACTION_PRI_MIN_OVERLAP 选与下一层相交最少的文件，相同时从上次的位置往后轮转；
+	// COMPACTION_PRI_OLDEST_FIRST 选最旧的文件
+	void compaction_pri_test(void)
+	{
+		uint64_t i;
+		int wait;
+		Options options, large, small;
+		options.level0CompactionTrigger = 1;
+		options.dynamicLevelBytes = false;
+		options.maxBytesForLevelBase = 1536 * 1024;
+		// large 下 level 1 不会超出，small 下一个文件（约 1MB）就会超出
+		large = small = options;
+		large.maxBytesForLevelBase = 64 * 1024 * 1024;
+		small.maxBytesForLevelBase = 512 * 1024;
+		// 每次打开写入的数据在关闭时写出为一个文件，并在关闭前完成 compaction
+		auto write = [&](const std::string &dir, const Options &writeOptions, uint64_t first, bool clear) {
+			KVStore kv(dir, writeOptions);
+			if (clear)
+				kv.reset();
+			for (i = first; i < first + 512; ++i)
+				kv.put(i, std::string(2048, 'p'));
+		};
+		// level 2：[1000, 1511]；level 1：较旧的 [1200, 1711] 与 [5000, 5511]
+		auto prepare = [&](const std::string &dir) {
+			write(dir, small, 1000, true);
+			write(dir, large, 1200, false);
+			write(dir, large, 5000, false);
+		};
+
+		prepare("./data-pri");
+		{
+			KVStore kv("./data-pri", options);
+			for (wait = 0; wait < 500 && kv.getStats().minOverlapPicks == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(true, kv.getStats().minOverlapPicks > 0);
+			EXPECT(0, kv.getStats().oldestFirstPicks);
+		}
+		// 与 level 2 不相交的 [5000, 5511] 被移走
+		std::vector<std::string> names = table_names("./data-pri", 1);
+		EXPECT(1, names.size());
+		EXPECT(true, names.size() == 1 && names[0].find(" 1200-1711 ") != std::string::npos);
+		phase();
+
+		prepare("./data-pri");
+		options.compactionPri = COMPACTION_PRI_OLDEST_FIRST;
+		{
+			KVStore kv("./data-pri", options);
+			for (wait = 0; wait < 500 && kv.getStats().oldestFirstPicks == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(true, kv.getStats().oldestFirstPicks > 0);
+			EXPECT(0, kv.getStats().minOverlapPicks);
+		}
+		names = table_names("./data-pri", 1);
+		EXPECT(1, names.size());
+		EXPECT(true, names.size() == 1 && names[0].find(" 5000-5511 ") != std::string::npos);
+		phase();
+
+		// level 1：[1000, 1511] 与 [2000, 2511]，都不与下一层相交，先选前者；
+		// 之后写入的 [0, 511] 同样不相交，但本次从 [1000, 1511] 之后开始选，选中 [2000, 2511]
+		options.compactionPri = COMPACTION_PRI_MIN_OVERLAP;
+		write("./data-pri", large, 1000, true);
+		write("./data-pri", large, 2000, false);
+		{
+			KVStore kv("./data-pri", options);
+			for (wait = 0; wait < 500 && kv.getStats().minOverlapPicks == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			names = table_names("./data-pri", 1);
+			EXPECT(1, names.size());
+			EXPECT(true, names.size() == 1 && names[0].find(" 2000-2511 ") != std::string::npos);
+			for (i = 0; i < 512; ++i)
+				kv.put(i, std::string(2048, 'p'));
+		}
+		names = table_names("./data-pri", 1);
+		EXPECT(1, names.size());
+		EXPECT(true, names.size() == 1 && names[0].find(" 0-511 ") != std::string::npos);
+		EXPECT(2, table_names("./data-pri", 2).size());
+		phase();
+
+		report();
+	}
+
+	// LZ 压缩：可压缩的数据块压缩后写出，不可压缩的原样写出；读取按块中记录的方式解码，与打开时的 options.compression 无关
+	void compression_test(void)
+	{
+		uint64_t i, raw = 0, seed = 1;
+		Options options;
+		options.compression = COMPRESSION_LZ;
+		auto compressible = [](uint64_t key) {
+			std::string value;
+			while (value.size() < 200)
+				value += "value-" + std::to_string(key) + ";";
+			return value;
+		};
+		std::vector<std::string> random;
+		for (i = 0; i < 256; ++i) {
+			std::string value(1024, '\0');
+			for (char &c : value) {
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				c = seed >> 56;
+			}
+			random.push_back(value);
+		}
+		{
+			KVStore kv("./data-lz", options);
+			kv.reset();
+			for (i = 0; i < 8192; ++i) {
+				kv.put(i, compressible(i));
+				raw += compressible(i).size();
+			}
+			for (i = 0; i < 256; ++i)
+				kv.put(8192 + i, random[i]);
+			kv.put(9000, std::string(300, '\0'));
+		}
+		{
+			KVStore kv("./data-lz");
+			std::vector<double> ratios = kv.getStats().levelCompressionRatios;
+			EXPECT(true, !ratios.empty() && *std::max_element(ratios.begin(), ratios.end()) > 2);
+			EXPECT(true, table_sizes("./data-lz", 0).size() == 1 && table_sizes("./data-lz", 0)[0] < raw / 2);
+			for (i = 0; i < 8192; ++i)
+				EXPECT(compressible(i), kv.get(i));
+			for (i = 0; i < 256; ++i)
+				EXPECT(random[i], kv.get(8192 + i));
+			EXPECT(std::string(300, '\0'), kv.get(9000));
+			phase();
+		}
+		// 压缩结果遵守 LZ4 的块尾规则：最后一个匹配在块尾 12 字节之前开始，最后 5 字节总是字面量；同一个 LZCompressors 可以连续压缩多块
+		{
+			LZCompressors compressor;
+			// 逐个 sequence 解析，得到最后一个匹配在原数据中的起止位置，没有匹配时返回 false
+			auto lastMatch = [](const std::string &c, uint64_t &start, uint64_t &end) {
+				uint64_t ip = 0, op = 0;
+				bool matched = false;
+				auto length = [&](uint64_t len) {
+					unsigned char byte = 255;
+					while (len >= 15 && byte == 255) {
+						byte = c[ip++];
+						len += byte;
+					}
+					return len;
+				};
+				while (ip < c.size()) {
+					unsigned char token = c[ip++];
+					uint64_t literals = length(token >> 4);
+					ip += literals;
+					op += literals;
+					if (ip >= c.size())
+						break;
+					ip += 2;
+					start = op;
+					op += length(token & 0xf) + 4;
+					end = op;
+					matched = true;
+				}
+				return matched;
+			};
+			std::vector<std::string> blocks;
+			for (i = 1; i <= 64; ++i)
+				blocks.push_back(std::string(i, 'a'));
+			// 开头 6 字节在块尾 11 字节处重复出现
+			std::string tail = random[0].substr(0, 48);
+			blocks.push_back(tail + tail.substr(0, 6) + random[1].substr(0, 5));
+			for (const std::string &block : blocks) {
+				std::string compressed;
+				compressor.compress(block.data(), block.size(), compressed);
+				uint64_t start = 0, end = 0;
+				bool ok = !lastMatch(compressed, start, end) || (start + 12 <= block.size() && end + 5 <= block.size());
+				EXPECT(true, ok);
+				std::string decompressed(block.size(), '\0');
+				EXPECT(true, LZCompressors::decompress(compressed.data(), compressed.size(), &decompressed[0], block.size()));
+				EXPECT(block, decompressed);
+			}
+			phase();
+		}
+
+		report();
+	}
+
+	// 键值分离：不小于 valueLogThreshold 的 value 写入值日志，SSTable 中只保存指针；
+	// 覆盖写与删除使值日志中的记录失效，失效比例超过 valueLogGCRatio 的文件由后台回收
+	void value_log_test(void)
+	{
+		uint64_t i, bytes = 0;
+		int round, wait;
+		Options options;
+		options.valueLogThreshold = 1024;
+		options.valueLogFileSize = 1024 * 1024;
+		auto value = [](uint64_t key, int round) {
+			return std::string(4096 + key % 64, 'a' + (key + round) % 26);
+		};
+		{
+			KVStore kv("./data-vlog", options);
+			kv.reset();
+			// 覆盖写 4 轮，每轮约 2MB
+			for (round = 0; round < 4; ++round) {
+				for (i = 0; i < 512; ++i)
+					kv.put(i, value(i, round));
+			}
+			kv.put(1000, "small");
+			for (wait = 0; wait < 1000 && kv.getStats().valueLogGCs == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			KVStoreStats stats = kv.getStats();
+			EXPECT(true, stats.valueLogGCs > 0);
+			EXPECT(true, stats.valueLogBytes > 0 && stats.valueLogBytes < 4 * 512 * 4096);
+			for (i = 0; i < 512; ++i)
+				EXPECT(value(i, 3), kv.get(i));
+			PinnableValue pinnable;
+			EXPECT(true, kv.get(7, pinnable));
+			EXPECT(value(7, 3), pinnable.toString());
+			pinnable.reset();
+			EXPECT("small", kv.get(1000));
+			phase();
+		}
+		// SSTable 中只有指针与小的 value
+		for (uint64_t level = 0; level < 8; ++level) {
+			for (uint64_t size : table_sizes("./data-vlog", level))
+				bytes += size;
+		}
+		EXPECT(true, bytes < 512 * 4096 / 4);
+		{
+			KVStore kv("./data-vlog", options);
+			for (i = 0; i < 512; ++i)
+				EXPECT(value(i, 3), kv.get(i));
+			EXPECT("small", kv.get(1000));
+			std::list<std::pair<uint64_t, std::string> > list_stu;
+			kv.scan(0, 511, list_stu);
+			EXPECT(512, list_stu.size());
+			EXPECT(value(511, 3), list_stu.back().second);
+		}
+		phase();
+
+		report();
+	}
+
+	// 校验和：数据块损坏时按 CHECKSUM_VERIFY_ALWAYS 读取会报错，而不是返回错误的数据
+	void checksum_test(void)
+	{
+		uint64_t i;
+		{
+			KVStore kv("./data-checksum");
+			kv.reset();
+			for (i = 0; i < 1024; ++i)
+				kv.put(i, std::string(1024, 'c'));
+		}
+		std::vector<std::string> names = table_names("./data-checksum", 0);
+		EXPECT(1, names.size());
+		if (names.size() != 1) {
+			phase();
+			report();
+			return;
+		}
+		// 改写第一个文件数据区中的一个字节
+		{
+			std::fstream file("./data-checksum/level-0/" + names[0], std::ios::binary | std::ios::in | std::ios::out);
+			file.seekp(INIT_BYTES_SIZE + 5000);
+			file.put('x');
+		}
+		Options options;
+		options.checksumVerification = CHECKSUM_VERIFY_ALWAYS;
+		{
+			KVStore kv("./data-checksum", options);
+			bool detected = false;
+			for (i = 0; i < 1024 && !detected; ++i) {
+				try {
+					EXPECT(std::string(1024, 'c'), kv.get(i));
+				} catch (const char *) {
+					detected = true;
+				}
+			}
+			EXPECT(true, detected);
+		}
+		phase();
+
+		report();
+	}
+
+	// bloom filter 按需载入：打开已有文件时不读，第一次点查该文件时才载入
+	void bloom_filter_test(void)
+	{
+		uint64_t i, r;
+		Options options;
+		options.level0CompactionTrigger = 8;
+		{
+			KVStore kv("./data-bloom", options);
+			kv.reset();
+		}
+		// 每次关闭写出 level 0 的一个文件，4 个文件的键区间相互重叠，key 都是偶数
+		for (r = 0; r < 4; ++r) {
+			KVStore kv("./data-bloom", options);
+			for (i = 0; i < 64; ++i)
+				kv.put((i * 4 + r) * 2, std::string(1024, 'a' + r));
+		}
+		{
+			KVStore kv("./data-bloom", options);
+			EXPECT(0, kv.getStats().loadedBloomFilters);
+			// 最新的文件中找到，只载入它的 bloom filter
+			EXPECT(std::string(1024, 'd'), kv.get(6));
+			EXPECT(1, kv.getStats().loadedBloomFilters);
+			// 不存在的 key 要查过每个文件
+			EXPECT(not_found, kv.get(11));
+			EXPECT(4, kv.getStats().loadedBloomFilters);
+			EXPECT(std::string(1024, 'a'), kv.get(0));
+			EXPECT(4, kv.getStats().loadedBloomFilters);
+			phase();
+		}
+
+		report();
+	}
+
+	// compaction 输出的文件大小：写出 level n 的文件在超过 targetFileSizeBase * targetFileSizeMultiplier ^ (n - 1) 后切分
+	void target_file_size_test(void)
+	{
+		uint64_t i, level, target, largest = 0;
+		Options options;
+		options.writeBufferSize = 256 * 1024;
+		options.targetFileSizeBase = 256 * 1024;
+		options.targetFileSizeMultiplier = 2;
+		options.maxBytesForLevelBase = 1024 * 1024;
+		options.dynamicLevelBytes = false;
+		{
+			KVStore kv("./data-target", options);
+			kv.reset();
+			// 约 8MB，在 4096 个 key 上交错覆盖写
+			for (i = 0; i < 16384; ++i)
+				kv.put(i * 7919 % 4096, std::string(512, 'a' + i / 4096));
+			for (i = 0; i < 4096; ++i)
+				EXPECT(std::string(512, 'd'), kv.get(i));
+		}
+		// 文件在超过目标大小后的第一个数据块边界切分
+		for (level = 1, target = 256 * 1024; level < 8; ++level, target *= 2) {
+			for (uint64_t size : table_sizes("./data-target", level)) {
+				EXPECT(true, size <= target + 64 * 1024);
+				if (level >= 2)
+					largest = std::max(largest, size);
+			}
+		}
+		// level 2 的文件可以大于 level 1 的目标大小
+		EXPECT(true, largest > 256 * 1024 + 64 * 1024);
+		phase();
+
+		// writeBufferSize 小于 header 与 bloom filter 的大小时按下限处理，写入不会失败
+		options.writeBufferSize = 1;
+		{
+			KVStore kv("./data-target", options);
+			kv.reset();
+			for (i = 0; i < 1024; ++i)
+				kv.put(i, std::string(512, 't'));
+			for (i = 0; i < 1024; ++i)
+				EXPECT(std::string(512, 't'), kv.get(i));
+		}
+		{
+			KVStore kv("./data-target", options);
+			for (i = 0; i < 1024; ++i)
+				EXPECT(std::string(512, 't'), kv.get(i));
+			phase();
+		}
+
+		report();
+	}
+
+	// 定长布局：value 等长的数据块按定长布局写出，关闭该选项后仍能读取；value 不等长的块照常写出
+	void fixed_width_test(void)
+	{
+		uint64_t i;
+		Options options;
+		options.fixedWidthValues = true;
+		auto write = [&](const std::string &dir, const Options &writeOptions) {
+			KVStore kv(dir, writeOptions);
+			kv.reset();
+			// 间隔的 key，value 都是 16 字节
+			for (i = 0; i < 16384; ++i)
+				kv.put(i * 3, std::string(16, 'a' + i % 26));
+			// value 长度不一
+			for (i = 0; i < 256; ++i)
+				kv.put(100000 + i, std::string(i, 'v'));
+		};
+		write("./data-fixed", options);
+		write("./data-variable", Options());
+		{
+			KVStore kv("./data-fixed");
+			for (i = 0; i < 16384; ++i) {
+				EXPECT(std::string(16, 'a' + i % 26), kv.get(i * 3));
+				EXPECT(not_found, kv.get(i * 3 + 1));
+			}
+			for (i = 0; i < 256; ++i)
+				EXPECT(std::string(i, 'v'), kv.get(100000 + i));
+			std::list<std::pair<uint64_t, std::string> > list_stu;
+			kv.scan(1, 300, list_stu);
+			EXPECT(100, list_stu.size());
+			EXPECT(std::string(16, 'b'), list_stu.front().second);
+		}
+		// 两种布局读到的数据相同
+		{
+			KVStore fixed("./data-fixed"), variable("./data-variable");
+			std::list<std::pair<uint64_t, std::string> > list_fixed, list_variable;
+			fixed.scan(0, UINT64_MAX, list_fixed);
+			variable.scan(0, UINT64_MAX, list_variable);
+			EXPECT(16640, list_fixed.size());
+			EXPECT(true, list_fixed == list_variable);
+		}
+		// 含定长块的文件使用 v4 的 magic，只认识 v3 的版本不会把定长块当作损坏的 v3 块读取
+		auto footer_magic = [&](const std::string &dir) {
+			std::vector<std::string> names = table_names(dir, 0);
+			uint64_t magic = 0;
+			if (names.size() == 1) {
+				std::ifstream file(dir + "/level-0/" + names[0], std::ios::binary);
+				file.seekg(-(int64_t)sizeof(magic), std::ios::end);
+				file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+			}
+			return magic;
+		};
+		EXPECT(SSTABLE_MAGIC_V4, footer_magic("./data-fixed"));
+		EXPECT(SSTABLE_MAGIC_V3, footer_magic("./data-variable"));
+		phase();
+
+		report();
+	}
+
+	// dropCompactionPageCache：compaction 读写的文件在完成后丢弃页缓存，数据不受影响
+	void drop_page_cache_test(void)
+	{
+		uint64_t i;
+		int wait;
+		Options options;
+		options.dropCompactionPageCache = true;
+		options.writeBufferSize = 256 * 1024;
+		{
+			KVStore kv("./data-fadvise", options);
+			kv.reset();
+			// 约 8MB，覆盖写 2048 个 key
+			for (i = 0; i < 8192; ++i)
+				kv.put(i % 2048, std::string(1024, 'a' + i / 2048));
+			for (wait = 0; wait < 500 && kv.getStats().compactions == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(true, kv.getStats().compactions > 0);
+			for (i = 0; i < 2048; ++i)
+				EXPECT(std::string(1024, 'd'), kv.get(i));
+		}
+		{
+			KVStore kv("./data-fadvise", options);
+			std::list<std::pair<uint64_t, std::string> > list_stu;
+			kv.scan(0, 4095, list_stu);
+			EXPECT(2048, list_stu.size());
+			EXPECT(std::string(1024, 'd'), list_stu.back().second);
+		}
+		phase();
+
+		report();
+	}
+
+	// 进程在写入途中退出：重新打开后每个 key 读到退出前写入的某个版本，不会读到残缺的 value
+	void value_log_recovery_test(void)
+	{
+#ifndef _WIN32
+		uint64_t i;
+		int round, status;
+		Options options;
+		options.valueLogThreshold = 1024;
+		options.valueLogFileSize = 1024 * 1024;
+		auto value = [](uint64_t key, int round) {
+			return std::string(4096 + key % 64, 'a' + (key + round) % 26);
+		};
+		{
+			KVStore kv("./data-vlog", options);
+			kv.reset();
+			for (i = 0; i < 512; ++i)
+				kv.put(i, value(i, 0));
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			KVStore kv("./data-vlog", options);
+			for (round = 1; round < 4; ++round) {
+				for (i = 0; i < 512; ++i)
+					kv.put(i, value(i, round));
+			}
+			_exit(0);
+		}
+		waitpid(pid, &status, 0);
+		EXPECT(true, WIFEXITED(status));
+		{
+			KVStore kv("./data-vlog", options);
+			for (i = 0; i < 512; ++i) {
+				std::string got = kv.get(i);
+				EXPECT(true, got == value(i, 0) || got == value(i, 1) || got == value(i, 2) || got == value(i, 3));
+			}
+			kv.put(0, value(0, 4));
+			EXPECT(value(0, 4), kv.get(0));
+		}
+		phase();
+
+		report();
+#endif
+	}
+
+	// reset 之后快照仍能读到之前的 value，值日志文件在最后一个快照释放后才删除
+	void value_log_reset_test(void)
+	{
+		uint64_t i;
+		Options options;
+		options.valueLogThreshold = 1024;
+		KVStore kv("./data-vlog", options);
+		kv.reset();
+		for (i = 0; i < 1024; ++i)
+			kv.put(i, std::string(4096, 'v'));
+		const Snapshot *snapshot = kv.getSnapshot();
+		kv.reset();
+		EXPECT(not_found, kv.get(0));
+		EXPECT(std::string(4096, 'v'), kv.get(0, snapshot));
+		EXPECT(std::string(4096, 'v'), kv.get(1023, snapshot));
+		kv.releaseSnapshot(snapshot);
+		EXPECT(0, kv.getStats().valueLogBytes);
+		kv.put(0, std::string(4096, 'w'));
+		EXPECT(std::string(4096, 'w'), kv.get(0));
+		phase();
+
+		report();
+	}
+
+	// 值日志的失效字节：启动时按 SSTable 中的指针重新统计，compaction 中整个被范围删除标记覆盖而不必归并的文件中的指针同样计入
+	void value_log_garbage_test(void)
+	{
+		uint64_t i;
+		int wait;
+		Options options;
+		options.valueLogThreshold = 1024;
+		options.valueLogFileSize = 256 * 1024;
+		options.writeBufferSize = 64 * 1024;
+		options.level0CompactionTrigger = 1;
+		// 第一次打开时不回收，覆盖写丢弃指针的计数在关闭后丢失
+		options.valueLogGCRatio = 0;
+		{
+			KVStore kv("./data-garbage", options);
+			kv.reset();
+			for (i = 0; i < 512; ++i)
+				kv.put(i, std::string(4096, 'g'));
+			for (i = 0; i < 512; ++i)
+				kv.put(i, "small");
+		}
+		options.valueLogGCRatio = 0.5;
+		{
+			KVStore kv("./data-garbage", options);
+			for (wait = 0; wait < 500 && kv.getStats().valueLogBytes > 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(0, kv.getStats().valueLogBytes);
+			EXPECT("small", kv.get(0));
+			phase();
+
+			// 约 2MB 写入值日志，之后整个被范围删除标记覆盖，除正在追加的文件外都可以回收
+			for (i = 0; i < 512; ++i)
+				kv.put(i, std::string(4096, 'h'));
+			kv.deleteRange(0, 511);
+			for (i = 1000; i < 1200; ++i)
+				kv.put(i, std::string(512, 's'));
+			for (wait = 0; wait < 500 && kv.getStats().valueLogBytes >= 2 * options.valueLogFileSize; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(true, kv.getStats().valueLogBytes < 2 * options.valueLogFileSize);
+			EXPECT(not_found, kv.get(0));
+			EXPECT(std::string(512, 's'), kv.get(1000));
+			phase();
+		}
+
+		report();
+	}
+
+	// 写入限流：level 0 的文件数达到 level0SlowdownTrigger 时写被延迟，达到 level0StopTrigger 时写出 memTable 的写等待 compaction；
+	// compaction 被限速时写仍能完成，不会在 level0StopTrigger 处一直阻塞
+	void write_stall_test(void)
+	{
+		uint64_t i;
+		Options options;
+		options.writeBufferSize = 64 * 1024;
+		options.level0CompactionTrigger = 2;
+		options.level0SlowdownTrigger = 3;
+		options.level0StopTrigger = 3;
+		options.compactionBytesPerSecond = 2 * 1024 * 1024;
+		{
+			KVStore kv("./data-stall", options);
+			kv.reset();
+			// 约 2MB，覆盖写 256 个 key
+			for (i = 0; i < 4096; ++i)
+				kv.put(i % 256, std::string(512, 'a' + i / 256));
+			KVStoreStats stats = kv.getStats();
+			EXPECT(true, stats.slowdownWrites > 0);
+			EXPECT(true, stats.stoppedWrites > 0);
+			EXPECT(true, stats.stallMicros > 0);
+			for (i = 0; i < 256; ++i)
+				EXPECT(std::string(512, 'p'), kv.get(i));
+			phase();
+		}
+		// 触发值不一致（level0StopTrigger 小于 level0CompactionTrigger）时构造函数会调整，写不会一直阻塞
+		options.level0CompactionTrigger = 4;
+		options.level0SlowdownTrigger = 8;
+		options.level0StopTrigger = 1;
+		{
+			KVStore kv("./data-stall", options);
+			for (i = 0; i < 2048; ++i)
+				kv.put(i % 256, std::string(512, 'A' + i / 256));
+			for (i = 0; i < 256; ++i)
+				EXPECT(std::string(512, 'H'), kv.get(i));
+			phase();
+		}
+
+		report();
+	}
+
+	// compaction 限速：写出 memTable 不受限速等待，compaction 被限速时 rateLimitedMicros 增长；
+	// 运行时取消限速会唤醒等待中的 compaction，关闭时不必按原来的速度等完剩下的 compaction
+	void rate_limit_test(void)
+	{
+		uint64_t i;
+		int wait;
+		std::chrono::steady_clock::time_point closing;
+		Options options;
+		options.writeBufferSize = 256 * 1024;
+		options.level0SlowdownTrigger = 64;
+		options.level0StopTrigger = 64;
+		options.compactionBytesPerSecond = 64 * 1024;
+		{
+			KVStore kv("./data-ratelimit", options);
+			kv.reset();
+			// 约 4MB，按 64KB/s 的速度 compaction 需要一分钟以上；key 打乱使 level 0 的文件相互重叠，不能直接移动
+			auto start = std::chrono::steady_clock::now();
+			for (i = 0; i < 4096; ++i)
+				kv.put(i * 7 % 4096, std::string(1024, 'a' + i * 7 % 4096 % 26));
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			EXPECT(true, elapsed < std::chrono::seconds(3));
+			for (wait = 0; wait < 500 && kv.getStats().rateLimitedMicros == 0; ++wait)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			EXPECT(true, kv.getStats().rateLimitedMicros > 0);
+			kv.setCompactionRateLimit(0);
+			closing = std::chrono::steady_clock::now();
+		}
+		// 关闭时剩下的 compaction 不再限速
+		EXPECT(true, std::chrono::steady_clock::now() - closing < std::chrono::seconds(5));
+		phase();
+		{
+			KVStore kv("./data-ratelimit", options);
+			for (i = 0; i < 4096; ++i)
+				EXPECT(std::string(1024, 'a' + i % 26), kv.get(i));
+			phase();
+		}
+
+		report();
+	}
+
 	void regular_test(uint64_t max)
 	{
 		uint64_t i;
@@ -102,6 +1224,72 @@ public:
 
 		std::cout << "[Large Test]" << std::endl;
 		regular_test(LARGE_TEST_MAX);
+
+		std::cout << "[Snapshot Test]" << std::endl;
+		snapshot_test();
+
+		std::cout << "[Delete Range Test]" << std::endl;
+		delete_range_test();
+
+		std::cout << "[Range Filter Test]" << std::endl;
+		range_filter_test();
+
+		std::cout << "[Approximate Stats Test]" << std::endl;
+		approximate_stats_test();
+
+		std::cout << "[Pinnable Value Test]" << std::endl;
+		pinnable_value_test();
+
+		std::cout << "[Trivial Move Test]" << std::endl;
+		trivial_move_test();
+
+		std::cout << "[Universal Compaction Test]" << std::endl;
+		universal_test();
+
+		std::cout << "[Tombstone Compaction Test]" << std::endl;
+		tombstone_compaction_test();
+
+		std::cout << "[Tombstone Rewrite Test]" << std::endl;
+		tombstone_rewrite_test();
+
+		std::cout << "[Compaction Priority Test]" << std::endl;
+		compaction_pri_test();
+
+		std::cout << "[Compression Test]" << std::endl;
+		compression_test();
+
+		std::cout << "[Value Log Test]" << std::endl;
+		value_log_test();
+
+		std::cout << "[Checksum Test]" << std::endl;
+		checksum_test();
+
+		std::cout << "[Bloom Filter Test]" << std::endl;
+		bloom_filter_test();
+
+		std::cout << "[Target File Size Test]" << std::endl;
+		target_file_size_test();
+
+		std::cout << "[Fixed Width Test]" << std::endl;
+		fixed_width_test();
+
+		std::cout << "[Drop Page Cache Test]" << std::endl;
+		drop_page_cache_test();
+
+		std::cout << "[Value Log Recovery Test]" << std::endl;
+		value_log_recovery_test();
+
+		std::cout << "[Value Log Reset Test]" << std::endl;
+		value_log_reset_test();
+
+		std::cout << "[Value Log Garbage Test]" << std::endl;
+		value_log_garbage_test();
+
+		std::cout << "[Write Stall Test]" << std::endl;
+		write_stall_test();
+
+		std::cout << "[Rate Limit Test]" << std::endl;
+		rate_limit_test();
 	}
 };
 
@@ -121,11 +1309,14 @@ int main(int argc, char *argv[])
         test.start_test();
     } catch (const char * e){
         std::cout << e << std::endl;
+        return 1;
     } catch (std::exception &exception){
         std::cout << exception.what() << std::endl;
+        return 1;
     } catch (...){
         std::cout << "unknown error!" << std::endl;
+        return 1;
     }
 
-	return 0;
+	return test.passed() ? 0 : 1;
 }
@@ -1,10 +1,21 @@
 #include "kvstore.h"
 
-KVStore::KVStore(const std::string &_dir): KVStoreAPI(_dir)
+KVStore::KVStore(const std::string &_dir, const Options &_options): KVStoreAPI(_dir), options(_options), rateLimiter(_options.compactionBytesPerSecond)
 {
     if(!utils::dirExists(_dir)) utils::mkdir(_dir.c_str());
     dir = _dir;
+    // level 0 的触发值须满足 slowdown <= stop 且 compaction < stop，否则写入可能在 compaction 开始之前就被一直阻塞，不满足时调整
+    options.level0CompactionTrigger = std::max<uint64_t>(options.level0CompactionTrigger, 1);
+    if(options.level0StopTrigger <= options.level0CompactionTrigger) options.level0StopTrigger = options.level0CompactionTrigger + 1;
+    if(options.level0SlowdownTrigger > options.level0StopTrigger) options.level0SlowdownTrigger = options.level0StopTrigger;
+    // memTable 的大小从 header 与 bloom filter 开始计，上限过小时任何写入都放不下
+    options.writeBufferSize = std::max<uint64_t>(options.writeBufferSize, MIN_WRITE_BUFFER_SIZE);
     memTable = new MemTables(dir);
+    valueLog = new ValueLogs(dir + "/vlog", options.valueLogFileSize);
+
+    // 上次运行中被快照引用而暂存的文件在重启后已没有快照需要，未完成的 compaction 写出的文件也不再有用，直接清理
+    clearTempDir(dir + "/.pinned");
+    clearTempDir(dir + "/.compacting");
 
     // 在启动时，需检查现有的数据目录中各层 SSTable 文件，并在内存中构建相应的缓存
     // 如果有找到文件并重建成功返回 true，如果现有数据目录为空返回 false
@@ -13,13 +24,31 @@ KVStore::KVStore(const std::string &_dir): KVStoreAPI(_dir)
         std::vector<SSTables*> level0;
         cache.push_back(level0);
     }
+    if(!valueLog->empty()) rebuildValueLogGarbage();
+
+    if(options.maxSubcompactions > 1) subcompactionPool = new ThreadPools(options.maxSubcompactions - 1);
+    compactionThread = std::thread(&KVStore::backgroundCompaction, this);
 }
 
 KVStore::~KVStore()
 {
-    // 系统在正常关闭时（可以实现在析构函数里面），应将 MemTable 中的所有数据以 SSTable 形式写回（类似于 MemTable 满了时的操作）
-    if(memTable->getSize() > INIT_BYTES_SIZE) convertMemToSS();
-    memTable->reset();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        // 系统在正常关闭时（可以实现在析构函数里面），应将 MemTable 中的所有数据以 SSTable 形式写回（类似于 MemTable 满了时的操作）
+        if(memTableBytes() > INIT_BYTES_SIZE) convertMemToSS();
+        memTable->reset();
+        // 等待后台完成各层需要的 compaction 再退出，重启后不必再追赶
+        waitForCompaction(lock, true);
+        stopping = true;
+        compactionCv.notify_all();
+    }
+    compactionThread.join();
+    delete subcompactionPool;
+
+    // 释放尚未释放的快照，其引用的已淘汰文件随之删除
+    while(!snapshots.empty()){
+        releaseSnapshot(snapshots.front());
+    }
 
     for(auto it = cache.begin(); it != cache.end(); ++it){
         for (auto _it = (*it).begin(); _it != (*it).end(); ++_it) {
@@ -28,7 +57,9 @@ KVStore::~KVStore()
         (*it).clear();
     }
     cache.clear();
+    releaseImmMemTables();
     delete memTable;
+    delete valueLog;
 }
 
 /**
@@ -37,20 +68,30 @@ KVStore::~KVStore()
  */
 void KVStore::put(uint64_t key, const std::string &s)
 {
-    // val string too large
-    if(INIT_BYTES_SIZE + s.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE > MAX_BYTES_SIZE) assert(0);
-    memTable->setSize(memTable->getSize() + s.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-    if(memTable->getSize() <= MAX_BYTES_SIZE){
-        memTable->put(key, s);
-    } else {
+    std::unique_lock<std::mutex> lock(mutex);
+    // 与值日志指针格式相同的 value 直接放入值日志，避免被误认为指针
+    if(ValueLogs::isPointer(s.data(), s.size())) writeToMemTable(lock, key, valueLog->append(key, s.data(), s.size()));
+    else writeToMemTable(lock, key, s);
+}
+
+void KVStore::writeToMemTable(std::unique_lock<std::mutex> &lock, uint64_t key, const std::string &s)
+{
+    // val string too large，块内 value 的长度为 32 位
+    if(INIT_BYTES_SIZE + s.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE > options.writeBufferSize || s.length() > UINT32_MAX) assert(0);
+    makeRoomForWrite(lock, s.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
+    insertIntoMemTable(key, s);
+}
 
+void KVStore::insertIntoMemTable(uint64_t key, const std::string &s)
+{
+    uint64_t writeBytes = s.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE;
+    if(memTableBytes() + writeBytes > options.writeBufferSize){
         // 将 MemTable 中的所有数据以 SSTable 形式写回
         convertMemToSS();
-
         memTable->reset();
-        memTable->setSize(memTable->getSize() + s.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-        memTable->put(key, s);
     }
+    memTable->setSize(memTable->getSize() + writeBytes);
+    memTable->put(key, s);
 }
 
 /**
@@ -59,47 +100,139 @@ void KVStore::put(uint64_t key, const std::string &s)
  */
 std::string KVStore::get(uint64_t key)
 {
-	std::string memTableResult = memTable->get(key);
-    if(memTableResult == "~DELETED~") return "";
-    if(memTableResult != "") return memTableResult;
+    return get(key, nullptr);
+}
+
+/**
+ * Returns the (string) value of the given key as of the snapshot.
+ * A null snapshot reads the current state.
+ */
+std::string KVStore::get(uint64_t key, const Snapshot* snapshot)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string memValue;
+    SSTables* table;
+    uint64_t pos;
+    if(!lookup(key, snapshot, memValue, table, pos)) return "";
+    return loadValue(memValue, table, pos);
+}
+
+/**
+ * Zero-copy variant of get. Returns false iff the key is not found.
+ */
+bool KVStore::get(uint64_t key, PinnableValue &value, const Snapshot* snapshot)
+{
+    // reset 可能需要释放 SSTable 的引用，须在加锁前进行
+    value.reset();
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string memValue;
+    SSTables* table;
+    uint64_t pos;
+    if(!lookup(key, snapshot, memValue, table, pos)) return false;
+    loadValue(memValue, table, pos, value);
+    return true;
+}
+
+std::string KVStore::loadValue(std::string &memValue, SSTables* table, uint64_t pos)
+{
+    std::string value = (table == nullptr) ? std::move(memValue) : table->getValue(pos);
+    if(ValueLogs::isPointer(value.data(), value.size())) return valueLog->read(value);
+    return value;
+}
+
+void KVStore::loadValue(std::string &memValue, SSTables* table, uint64_t pos, PinnableValue &value)
+{
+    // 长度与指针相同的 value 先读出判断，是指针时按 memTable 中的处理
+    if(table != nullptr && table->getValueSize(pos) == VALUE_POINTER_BYTES_SIZE){
+        std::string stored = table->getValue(pos);
+        if(ValueLogs::isPointer(stored.data(), stored.size())){
+            memValue = std::move(stored);
+            table = nullptr;
+        }
+    }
+    if(table == nullptr){
+        if(ValueLogs::isPointer(memValue.data(), memValue.size()))
+            valueLog->read(memValue.data(), value.assign(nullptr, ValueLogs::pointerValueSize(memValue.data())));
+        else value.assign(memValue.data(), memValue.size());
+        return;
+    }
+    const char* data = table->getValueData(pos);
+    if(data != nullptr) value.pin(this, table, data, table->getValueSize(pos));
+    else table->readValue(pos, value.assign(nullptr, table->getValueSize(pos)));
+}
+
+bool KVStore::lookup(uint64_t key, const Snapshot* snapshot, std::string &memValue, SSTables* &table, uint64_t &pos)
+{
+    const std::vector<MemTables*> &mems = snapshot ? snapshot->memTables : immMemTables;
+    const std::vector<std::vector<SSTables*>> &levels = snapshot ? snapshot->cache : cache;
+
+    table = nullptr;
+    // 先查当前的 memTable（快照读不查），再从新到旧查冻结的 memTable
+    for(uint64_t i = snapshot ? 1 : 0; i <= mems.size(); ++i){
+        MemTables* mem = (i == 0) ? memTable : mems[i - 1];
+        memValue = mem->get(key);
+        if(memValue == "~DELETED~") return false;
+        if(memValue != "") return true;
+        if(mem->isRangeDeleted(key)) return false;
+    }
 
-    std::string ssTableResult;
     // Search by level
-    std::string fileName;
-    std::string filePathName;
     uint64_t level = 0;
-    while(level <= this->maxLevel){
-        std::string level_str = "/level-" + std::to_string(level);
+    while(level < levels.size()){
         /*int fileNum = utils::scanDir(dir + level_str, fileNames);*/
         // 注意 level 0 要从最新的 SSTable 开始检查
-        uint64_t tableNum = cache[level].size();
+        uint64_t tableNum = levels[level].size();
         // level0 之中下标越大，越新，应当先检查
         // TODO: 其余level中按照下标大小排序的，按照此修改检查顺序
         while(tableNum > 0){
-            fileName = cache[level][tableNum - 1]->fileName +".sst";
-            filePathName = dir + level_str + "/" + fileName;
-            ssTableResult = (cache[level][tableNum - 1])->get(key, filePathName);
-            if(ssTableResult == "~DELETED~") return "";
-            if(ssTableResult != "") return ssTableResult;
+            SSTables* current = levels[level][tableNum - 1];
+            int64_t found = current->find(key);
+            if(found >= 0){
+                if(current->isDeletedValue(found)) return false;
+                table = current;
+                pos = found;
+                return true;
+            }
+            // 本文件中没有该 key，但被本文件的范围删除标记覆盖，则更旧的数据均已被删除
+            if(current->isRangeDeleted(key)) return false;
             --tableNum;
         }
         ++level;
     }
-    return "";
+    return false;
 }
+
 /**
  * Delete the given key-value pair if it exists.
  * Returns false iff the key is not found.
  */
 bool KVStore::del(uint64_t key)
 {
-    if(memTable->del(key)) return true;
-    std::string res = get(key);
-    if(res == "" || res == "~DELETED~") return false;
-    else{
-        put(key,"~DELETED~");
-        return true;
+    // 不能直接从 memTable 中移除，否则 SSTable 中更旧的值会重新可见，统一写入删除标记
+    std::unique_lock<std::mutex> lock(mutex);
+    std::string memValue;
+    SSTables* table;
+    uint64_t pos;
+    if(!lookup(key, nullptr, memValue, table, pos)) return false;
+    writeToMemTable(lock, key, "~DELETED~");
+    return true;
+}
+
+/**
+ * Delete all key-value pairs in [begin, end] (both inclusive) with a
+ * single range tombstone instead of one tombstone per key.
+ */
+void KVStore::deleteRange(uint64_t begin, uint64_t end)
+{
+    if(begin > end) return;
+    std::unique_lock<std::mutex> lock(mutex);
+    makeRoomForWrite(lock, RANGE_TOMBSTONE_BYTES_SIZE);
+    if(memTableBytes() + RANGE_TOMBSTONE_BYTES_SIZE > options.writeBufferSize){
+        // 将 MemTable 中的所有数据以 SSTable 形式写回
+        convertMemToSS();
+        memTable->reset();
     }
+    memTable->deleteRange(begin, end);
 }
 
 /**
@@ -108,11 +241,145 @@ bool KVStore::del(uint64_t key)
  */
 void KVStore::reset()
 {
+    std::unique_lock<std::mutex> lock(mutex);
+    // 后台正在归并的文件不能删除，等待其结束
+    waitForCompaction(lock, false);
     memTable->reset();
+    releaseImmMemTables();
     clearAllCacheAndFiles();
+    // 快照中的指针仍指向现有的值日志文件，有快照时只标记失效，最后一个快照释放时再删除
+    if(snapshots.empty()) valueLog->clear();
+    else valueLog->retireAll();
+    compactCursors.clear();
     this->nextTimeStamp = 1;
 }
 
+/**
+ * Pin the current memtable content and the SSTables of every level.
+ * Reads through the snapshot are not affected by later writes or compactions.
+ */
+const Snapshot* KVStore::getSnapshot()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    // 冻结当前的 memTable 与快照共享，之后的写入进入新的 memTable；
+    // 最新的冻结 memTable 已不被任何快照引用时，把当前 memTable 并入其中，避免连续的快照产生大量小 memTable
+    if(!memTable->empty()){
+        if(!immMemTables.empty() && immMemTables.front()->getRefs() == 1){
+            immMemTables.front()->absorb(*memTable);
+            memTable->reset();
+        } else {
+            immMemTables.insert(immMemTables.begin(), memTable);
+            memTable = new MemTables(dir);
+        }
+    }
+    Snapshot* snapshot = new Snapshot();
+    snapshot->memTables = immMemTables;
+    for(auto it = snapshot->memTables.begin(); it != snapshot->memTables.end(); ++it){
+        (*it)->ref();
+    }
+    snapshot->cache = cache;
+    for(auto it = snapshot->cache.begin(); it != snapshot->cache.end(); ++it){
+        for(auto _it = (*it).begin(); _it != (*it).end(); ++_it){
+            (*_it)->ref();
+        }
+    }
+    snapshots.push_back(snapshot);
+    return snapshot;
+}
+
+void KVStore::releaseSnapshot(const Snapshot* snapshot)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = std::find(snapshots.begin(), snapshots.end(), snapshot);
+    if(found == snapshots.end()) throw("ERROR  releaseSnapshot: unknown snapshot");
+    Snapshot* s = *found;
+    snapshots.erase(found);
+    for(auto it = s->cache.begin(); it != s->cache.end(); ++it){
+        for(auto _it = (*it).begin(); _it != (*it).end(); ++_it){
+            unrefTable(*_it);
+        }
+    }
+    for(auto it = s->memTables.begin(); it != s->memTables.end(); ++it){
+        unrefMemTable(*it);
+    }
+    delete s;
+    // 有快照时值日志不回收，最后一个快照释放后删除已失效的文件并唤醒后台线程检查
+    if(snapshots.empty()){
+        valueLog->removeObsoleteFiles();
+        compactionCv.notify_one();
+    }
+}
+
+void KVStore::unrefMemTable(MemTables* mem)
+{
+    if(mem->unref() == 0) delete mem;
+}
+
+void KVStore::releaseImmMemTables()
+{
+    for(auto it = immMemTables.begin(); it != immMemTables.end(); ++it){
+        unrefMemTable(*it);
+    }
+    immMemTables.clear();
+}
+
+uint64_t KVStore::memTableBytes()
+{
+    uint64_t bytes = memTable->getSize();
+    for(auto it = immMemTables.begin(); it != immMemTables.end(); ++it){
+        bytes += (*it)->getSize() - INIT_BYTES_SIZE;
+    }
+    return bytes;
+}
+
+void KVStore::unrefTable(SSTables* table)
+{
+    if(table->unref() == 0){
+        // delete that file
+        if(utils::rmfile(table->getFilePath().c_str())){
+            throw("remove file error when releasing table!");
+        }
+        // delete that cache
+        delete table;
+    }
+}
+
+// 从 cache 中淘汰一个 SSTable（调用者负责将其从 cache 中移除）
+// 若仍被快照引用，则先将文件移入 dir/.pinned，使 rebuildCacheFromDir 不会再读到它，待最后一个快照释放时删除
+void KVStore::retireTable(SSTables* table)
+{
+    if(table->getRefs() > 1){
+        table->relocate(dir + "/.pinned", std::to_string(nextPinnedNum++) + " " + table->fileName);
+    }
+    unrefTable(table);
+}
+
+void KVStore::clearTempDir(const std::string &tempDir)
+{
+    if(!utils::dirExists(tempDir)) return;
+    std::vector<std::string> fileNames;
+    utils::scanDir(tempDir, fileNames);
+    for(auto it = fileNames.begin(); it != fileNames.end(); ++it){
+        utils::rmfile((tempDir + "/" + *it).c_str());
+    }
+    utils::rmdir(tempDir.c_str());
+}
+
+bool KVStore::findOverlapTables(const std::vector<SSTables*> &tables, uint64_t minKey, uint64_t maxKey, uint64_t &startIndex, uint64_t &endIndex)
+{
+    bool findStartIndex = false;
+    for(uint64_t now = 0; now < tables.size(); ++now){
+        if(tables[now]->getMaxKey() < minKey) continue;
+        if(tables[now]->getMinKey() > maxKey) break;
+        if(!findStartIndex){
+            findStartIndex = true;
+            startIndex = now;
+        }
+        endIndex = now;
+    }
+    return findStartIndex;
+}
+
 /**
  * Return a list including all the key-value pair between key1 and key2.
  * keys in the list should be in an ascending order.
@@ -120,693 +387,1023 @@ void KVStore::reset()
  */
 void KVStore::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &list)
 {
-    // 取出 memTable 中在 scan 范围内的
-    std::list<std::pair<uint64_t, std::string> > listMem;
-    memTable->scan(key1,key2,listMem);
-    uint64_t maxLevel = this->maxLevel;
-
-    // 按照自定义函数，heap 会首先按照 first.first 来进行排序，之后按照 first.second 排序
-    // 其中 first.first 越小越先输出（key小的在前输出）
-    // 当  first.first 一样时候， second越大越先输出（时间戳大的先输出）
-    // heap 出来的结果存入 list
-    // 之后遍历 list，遇到重复的 key 只保留第一个即可
-    std::priority_queue<std::pair<std::pair<uint64_t, std::string>,uint64_t>, std::vector<std::pair<std::pair<uint64_t, std::string>,uint64_t> >, cmpScanHeap> heap;
-    // second 对应数字表示来源（下面 vector 中访问对应 list 的下标），方便堆顶 pop 出元素之后知道再新增哪个
-
-    // 考虑到除了 level 0 每一个 level 内文件的 key 在 cache 中按下标都是顺序排列
-    // 遍历每一层
-    std::vector<std::list<std::pair<uint64_t, std::string> > > listsAllLevels;
-    //  注意！！考虑到优先级，下标为 0 位置（优先级最高）应当放置 listMem，原本第零层的紧随其后
-    //  （！！且因为索引区间有交叉，需要按照时间戳顺序，时间戳大在前），之后再是剩余的 level 由小到大
-    //  这样下标越小优先级越高
-
-    // 用于记录从 level1 开始，每一个 level 读到了哪个文件，应当读到哪个文件的下标，
-    // 这样等上一个文件读入排序完再进行下一个，防止内存中文件过多（可能相同的 key 很多导致内存炸掉）
-    // 其中 first 表示当前读到的 index （初始为 startIndex），second 表示
-    std::vector<std::pair<uint64_t, uint64_t> > nextAndEndFileIndexInLevels;
-    nextAndEndFileIndexInLevels.emplace_back(0,0);  // level 0 填充位置
-
-    // 进堆
-    if(!listMem.empty()){
-        heap.emplace(listMem.front(), 0);
-        listMem.pop_front();
-    }
-    // 下标为 0 位置（优先级最高）应当放置 listMem
-    listsAllLevels.push_back(std::move(listMem));
-
-    // 之后放置原本第零层的文件对应 list （！！且因为索引区间有交叉，需要按照时间戳顺序，时间戳大在前）
-    unsigned int fileNumLevel0 = 0;  // 记录第零层有交集的文件数
-    auto lvl0_size = cache[0].size();
-    for(auto j = 0; j < lvl0_size; ++j){
-        if(!((cache[0][lvl0_size-j-1]->getMinKey() > key2)||(cache[0][lvl0_size-j-1]->getMaxKey() < key1))){  // 判定不是没有交集
-
-            // 将该文件与 scan 范围有交集的部分读入相应 listLevel
-            std::list<std::pair<uint64_t, std::string> > listLevel;
-            cache[0][lvl0_size-j-1]->readIndexAndDataForScan(listLevel, key1, key2);
-
-            // 进堆
-            if(!listLevel.empty()){
-                heap.emplace(listLevel.front(), fileNumLevel0);
-                listLevel.pop_front();
-            }
+    scan(key1, key2, list, nullptr);
+}
 
-            // 将相应 list 放入索引
-            listsAllLevels.push_back(std::move(listLevel));
-
-            // 增加 level0 文件数
-            ++fileNumLevel0;
-        }
-    }
-
-    for(uint64_t level = 1; level <= maxLevel; ++level){
-
-        // 寻找该层所有与 scan 范围有交集的文件并将交集部分读入相应 listLevel
-        std::list<std::pair<uint64_t, std::string> > listLevel;
-
-        // 在 level 层中找到与 scan 区间有交集的所有 SSTable 文件下标（有序无重复，顺序查找）
-        uint64_t maxIndex = cache[level].size() - 1;
-        uint64_t now = 0;
-        uint64_t startIndex = -1, endIndex = -1;
-        uint64_t nowMinKey, nowMaxKey;
-        bool findTableInLevel = false;
-        bool findStartIndex = false;
-        bool findEndIndex = false;
-        if(!cache[level].empty()){
-            while(now <= maxIndex)
-            {
-                nowMinKey = cache[level][now]->getMinKey();
-                nowMaxKey = cache[level][now]->getMaxKey();
-                if(!findStartIndex && key1 <= nowMaxKey)
-                {
-                    if(now == 0 && key2 < nowMinKey){
-                        findTableInLevel = false;
-                        break;
-                    }
-                    findTableInLevel = true;
-                    findStartIndex = true;
-                    startIndex = now;
-                }
-                if(key2 < nowMinKey)
-                {
-                    findTableInLevel = true;
-                    findEndIndex = true;
-                    endIndex = now - 1;
-                    break;
-                }
-                ++now;
-            }
-            if(!findEndIndex){
-                endIndex = maxIndex;
-            }
-            if(findTableInLevel && endIndex < startIndex) findTableInLevel = false;
+void KVStore::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &list, const Snapshot* snapshot)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    scanSources(key1, key2, snapshot, [&](uint64_t key, std::string &memValue, SSTables* table, uint64_t pos){
+        list.emplace_back(key, loadValue(memValue, table, pos));
+    });
+}
+
+/**
+ * Zero-copy variant of scan. Values stored in SSTables point into the
+ * file mapping and keep the file alive until the PinnableValue is reset.
+ */
+void KVStore::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, PinnableValue> > &list, const Snapshot* snapshot)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    scanSources(key1, key2, snapshot, [&](uint64_t key, std::string &memValue, SSTables* table, uint64_t pos){
+        list.emplace_back(key, PinnableValue());
+        PinnableValue &value = list.back().second;
+        if(table == nullptr && !ValueLogs::isPointer(memValue.data(), memValue.size())){
+            value.buffer = std::move(memValue);
+            value.valueData = value.buffer.data();
+            value.valueSize = value.buffer.size();
+            return;
         }
+        loadValue(memValue, table, pos, value);
+    });
+}
 
-        if(findTableInLevel){
-            (cache[level][startIndex])->readIndexAndDataForScan(listLevel, key1, key2);
-            if(!listLevel.empty()){
-                heap.emplace(listLevel.front(), level + fileNumLevel0);
-                listLevel.pop_front();
-            }
+template<typename Emit>
+void KVStore::scanSources(uint64_t key1, uint64_t key2, const Snapshot* snapshot, Emit emit)
+{
+    const std::vector<MemTables*> &mems = snapshot ? snapshot->memTables : immMemTables;
+    const std::vector<std::vector<SSTables*>> &levels = snapshot ? snapshot->cache : cache;
+
+    // 每一路来源在 sources 中的下标即为其优先级，下标越小越新：
+    // 最前面是当前的 memTable（快照读没有）与各个冻结的 memTable（新的在前），之后是 level 0 中与 scan 范围有交集的文件（索引区间有交叉，时间戳大的在前），
+    // 最后是 level 1 及以后的每一层各一路（层内文件有序无交集）
+    // SSTable 中的数据不预先读出，只记录当前文件与 index 中的下标区间，value 在输出时才读取
+    struct ScanSource {
+        std::list<std::pair<uint64_t, std::string> > entries;  // 仅 memTable 使用
+        // 该来源的范围删除标记，遮蔽所有下标更大（更旧）的来源
+        RangeTombstones tombstones;
+        // 当前文件及其 index 中尚未输出的下标区间 [pos, end)
+        SSTables* table = nullptr;
+        uint64_t pos = 0;
+        uint64_t end = 0;
+        // 仅 level 1 及以后使用：该层中下一个待打开文件与最后一个文件的下标
+        const std::vector<SSTables*> *tables = nullptr;
+        uint64_t nextIndex = 0;
+        uint64_t endIndex = 0;
+    };
+    std::vector<ScanSource> sources;
+
+    // 取出各个 memTable 中在 scan 范围内的（包括删除标记）
+    for(uint64_t i = snapshot ? 1 : 0; i <= mems.size(); ++i){
+        MemTables* mem = (i == 0) ? memTable : mems[i - 1];
+        sources.emplace_back();
+        mem->scan(key1, key2, sources.back().entries);
+        sources.back().tombstones = mem->getRangeTombstones();
+    }
+
+    // 文件在 [key1, key2] 中是否可能有数据；键区间与之相交、但被 RangeFilter 排除的文件计入 stats.scanFilteredTables
+    auto tableMayContain = [&](SSTables* table){
+        if(table->mayContainRange(key1, key2)) return true;
+        if(key1 <= table->getMaxKey() && key2 >= table->getMinKey()) ++stats.scanFilteredTables;
+        return false;
+    };
+
+    auto lvl0_size = levels[0].size();
+    for(size_t j = 0; j < lvl0_size; ++j){
+        SSTables* table = levels[0][lvl0_size - j - 1];
+        // 先用 RangeFilter 判断区间内是否可能有数据，没有数据但有相交的范围删除标记时仍需作为一路
+        bool mayContain = tableMayContain(table);
+        if(!mayContain && !table->getRangeTombstones().intersects(key1, key2)) continue;
+        sources.emplace_back();
+        if(mayContain){
+            sources.back().table = table;
+            table->findRange(key1, key2, sources.back().pos, sources.back().end);
         }
+        sources.back().tombstones = table->getRangeTombstones();
+    }
 
-        // 无论有没有内容，将相应 list 放入索引
-        listsAllLevels.push_back(std::move(listLevel));
-        nextAndEndFileIndexInLevels.emplace_back(startIndex + 1, endIndex);
+    for(uint64_t level = 1; level < levels.size(); ++level){
+        uint64_t startIndex, endIndex;
+        if(!findOverlapTables(levels[level], key1, key2, startIndex, endIndex)) continue;
+        sources.emplace_back();
+        sources.back().tables = &levels[level];
+        sources.back().nextIndex = startIndex;
+        sources.back().endIndex = endIndex;
+        for(uint64_t j = startIndex; j <= endIndex; ++j){
+            sources.back().tombstones.add(levels[level][j]->getRangeTombstones());
+        }
     }
 
-    // 对所有 lists 做最堆排序
-    uint64_t lastKey = -1;  // TODO: FIRST Key can not be max uint64_t
+    // 取出某一路的下一个 key 放入堆，level 1 及以后在当前文件输出完时打开下一个文件
+    // 堆中为 (key, 来源下标)，key 相同时来源下标小（更新）的先输出
+    std::priority_queue<std::pair<uint64_t, uint64_t>, std::vector<std::pair<uint64_t, uint64_t> >, std::greater<std::pair<uint64_t, uint64_t> > > heap;
+    auto pushNext = [&](uint64_t index){
+        ScanSource &source = sources[index];
+        if(source.table == nullptr && !source.entries.empty()){
+            heap.emplace(source.entries.front().first, index);
+            return;
+        }
+        while(source.pos >= source.end && source.tables != nullptr && source.nextIndex <= source.endIndex){
+            SSTables* table = (*source.tables)[source.nextIndex];
+            ++source.nextIndex;
+            if(!tableMayContain(table)) continue;
+            source.table = table;
+            table->findRange(key1, key2, source.pos, source.end);
+        }
+        if(source.table != nullptr && source.pos < source.end)
+            heap.emplace(source.table->getKey(source.pos), index);
+    };
+    for(uint64_t i = 0; i < sources.size(); ++i) pushNext(i);
+
+    // key 是否被比来源 index 更新的来源中的范围删除标记覆盖
+    auto rangeDeleted = [&](uint64_t key, uint64_t index){
+        for(uint64_t i = 0; i < index; ++i){
+            if(sources[i].tombstones.covers(key)) return true;
+        }
+        return false;
+    };
+
+    // 对所有来源做多路归并，相同的 key 只保留最新的一个，删除标记不输出
+    bool hasLastKey = false;
+    uint64_t lastKey = 0;
+    std::string memValue;
     while(!heap.empty()){
         auto top = heap.top();
         heap.pop();
-        if(lastKey != top.first.first){
-            list.push_back(top.first);
-            lastKey = top.first.first;
-        }
-        auto lvlIndex = top.second;
-        if(!listsAllLevels[lvlIndex].empty()){
-            heap.emplace(listsAllLevels[lvlIndex].front(), lvlIndex);
-            listsAllLevels[lvlIndex].pop_front();
+        ScanSource &source = sources[top.second];
+        bool isNewest = !hasLastKey || lastKey != top.first;
+        hasLastKey = true;
+        lastKey = top.first;
+        if(source.table == nullptr){
+            memValue = std::move(source.entries.front().second);
+            source.entries.pop_front();
+            if(isNewest && memValue != "~DELETED~" && !rangeDeleted(top.first, top.second))
+                emit(top.first, memValue, nullptr, 0);
         } else {
-            if(lvlIndex <= fileNumLevel0) continue;
-            auto nextAndEndFileIndex = nextAndEndFileIndexInLevels[lvlIndex - fileNumLevel0];
-            if(nextAndEndFileIndex.first <= nextAndEndFileIndex.second){
-                // 读入下一个 table
-                std::list<std::pair<uint64_t, std::string> > listLevel;
-                (cache[lvlIndex - fileNumLevel0][nextAndEndFileIndex.first])->readIndexAndDataForScan(listLevel, key1, key2);
-                heap.emplace(listLevel.front(), lvlIndex);
-                listLevel.pop_front();
-                listsAllLevels[lvlIndex] = std::move(listLevel);
-                nextAndEndFileIndexInLevels[lvlIndex - fileNumLevel0].first = nextAndEndFileIndex.first + 1;
-            }
+            uint64_t pos = source.pos;
+            ++source.pos;
+            if(isNewest && !source.table->isDeletedValue(pos) && !rangeDeleted(top.first, top.second))
+                emit(top.first, memValue, source.table, pos);
         }
+        pushNext(top.second);
     }
+}
 
-    // 注意 scan 如果发现多个相同的 key 以层数最小的为准！
-    // 遍历 list 去除重复 key，遇到重复的 key 只保留第一个
-    // 注意判定相等时候只比较 key，需要自定义比较函数
-    // auto _it = unique(list.begin(), list.end(), cmpList);
-    // list.erase(_it, list.end());
+/**
+ * Estimates the number of keys and bytes in [key1, key2] without reading any file.
+ */
+ApproximateStats KVStore::approximateStats(uint64_t key1, uint64_t key2)
+{
+    ApproximateStats stats;
+    if(key1 > key2) return stats;
+    std::lock_guard<std::mutex> lock(mutex);
+    memTable->approximateStats(key1, key2, stats.keyCount, stats.byteSize);
+    for(auto it = immMemTables.begin(); it != immMemTables.end(); ++it){
+        (*it)->approximateStats(key1, key2, stats.keyCount, stats.byteSize);
+    }
+    for(auto it = cache[0].begin(); it != cache[0].end(); ++it){
+        (*it)->approximateStats(key1, key2, stats.keyCount, stats.byteSize);
+    }
+    for(uint64_t level = 1; level < cache.size(); ++level){
+        uint64_t startIndex, endIndex;
+        if(!findOverlapTables(cache[level], key1, key2, startIndex, endIndex)) continue;
+        for(uint64_t j = startIndex; j <= endIndex; ++j){
+            cache[level][j]->approximateStats(key1, key2, stats.keyCount, stats.byteSize);
+        }
+    }
+    return stats;
+}
 
-    // 此时list为最终结果
+uint64_t KVStore::levelBytes(uint64_t level)
+{
+    uint64_t bytes = 0;
+    for(auto it = cache[level].begin(); it != cache[level].end(); ++it){
+        bytes += (*it)->getFileSize();
+    }
+    return bytes;
 }
 
-// 参数level为当前文件数达到阈值的层号
-void KVStore::compaction(uint64_t level,  unsigned int moreNum)
+// level 1 及以后各层的目标大小
+// 最后一层使用固定的目标大小 maxBytesForLevelBase * levelSizeMultiplier ^ (level - 1)，超过时向新的一层 compaction；
+// 开启 dynamicLevelBytes 时中间各层由最后一层的实际大小逐层除以 levelSizeMultiplier 得到，但不小于 maxBytesForLevelBase
+uint64_t KVStore::levelTargetBytes(uint64_t level)
 {
-    // TODO: compaction 中可能出现问题
-    //  最后一层出现范围重复的情况
-    //  且尚未实现最后一层中 DELETED 键值删除
+    uint64_t multiplier = std::max<uint64_t>(options.levelSizeMultiplier, 2);
+    if(!options.dynamicLevelBytes || level == this->maxLevel){
+        uint64_t target = options.maxBytesForLevelBase;
+        for(uint64_t i = 1; i < level; ++i) target *= multiplier;
+        return target;
+    }
+    uint64_t target = levelBytes(this->maxLevel);
+    for(uint64_t i = level; i < this->maxLevel; ++i) target /= multiplier;
+    return std::max(target, options.maxBytesForLevelBase);
+}
 
-    // 当前最大层数文件数达到阈值
+// 各层的 compaction 得分：level 0 为文件数与 level0CompactionTrigger 之比，其余层为总大小与目标大小之比
+// 返回得分最高且不小于 1 的一层，都小于 1 时返回 -1
+int64_t KVStore::pickCompactionLevel()
+{
+    int64_t picked = -1;
+    double bestScore = 1;
+    for(uint64_t level = 0; level <= this->maxLevel && level < cache.size(); ++level){
+        double score;
+        if(level == 0) score = (double)cache[0].size() / (double)options.level0CompactionTrigger;
+        else score = (double)levelBytes(level) / (double)levelTargetBytes(level);
+        if(score >= bestScore){
+            bestScore = score;
+            picked = level;
+        }
+    }
+    return picked;
+}
+
+// 选出一次 compaction 的输入文件（持有 mutex 时调用），没有需要 compaction 的层时返回 nullptr
+// 输入文件各 ref() 一次，保证在后台归并期间即使被快照释放也不会被删除
+CompactionJob* KVStore::pickCompaction()
+{
+    CompactionJob* job = (options.compactionStyle == COMPACTION_STYLE_UNIVERSAL) ? pickUniversalCompaction() : pickLevelCompaction();
+    if(job == nullptr) return nullptr;
+
+    // 更深的层中没有文件的键区间包含某个 key 时，该 key 的删除标记（以及与这些区间都不相交的范围删除标记）直接丢弃
+    // 写入最后一层时该集合为空，删除标记全部丢弃
+    for(uint64_t level = job->outputLevel + 1; level <= this->maxLevel; ++level){
+        for(auto it = cache[level].begin(); it != cache[level].end(); ++it){
+            if((*it)->getPairsNum() != 0) job->deeperKeyRanges.add((*it)->getMinKey(), (*it)->getMaxKey());
+        }
+    }
+
+    // 目标层中没有相交的文件且输入文件之间也互不相交（level 0 的文件可能相交）时，直接把输入文件移到目标层，不必重写数据
+    // 原地重写（outputLevel 与 level 相同）的文件不移动；因删除标记选出的文件也总是重写，其中的删除标记在写入时即可按更深的层丢弃
+    if(!job->withNextLevel && job->outputLevel != job->level && !job->byTombstones){
+        std::vector<SSTables*> inputs;
+        for(auto it = job->sources.begin(); it != job->sources.end(); ++it){
+            inputs.insert(inputs.end(), (*it).begin(), (*it).end());
+        }
+        std::sort(inputs.begin(), inputs.end(), cmpSSTableMinKey);
+        job->trivialMove = true;
+        for(uint64_t i = 1; i < inputs.size(); ++i){
+            if(inputs[i - 1]->getMaxKey() >= inputs[i]->getMinKey()) job->trivialMove = false;
+        }
+    }
+
+    // 取输入中最大的时间戳作为新文件共同的 timeStamp
+    for(auto it = job->sources.begin(); it != job->sources.end(); ++it){
+        for(auto _it = (*it).begin(); _it != (*it).end(); ++_it){
+            (*_it)->ref();
+            job->timeStamp = getMax(job->timeStamp, (*_it)->getTimeStamp());
+        }
+    }
+    return job;
+}
+
+bool KVStore::needsCompaction()
+{
+    if(options.compactionStyle == COMPACTION_STYLE_UNIVERSAL) return pickUniversalRunNum() > 0;
+    return pickCompactionLevel() >= 0;
+}
+
+// leveled：将得分最高的一层中的部分文件与下一层中相交的文件合并，结果写入下一层
+CompactionJob* KVStore::pickLevelCompaction()
+{
+    int64_t picked = pickCompactionLevel();
+    if(picked < 0) return pickTombstoneCompaction();
+    uint64_t level = picked;
+
+    // 当前最大层的大小超过目标大小
     if(this->maxLevel == level){
         // 新建一层
         std::vector<SSTables*> newLevel;
         cache.push_back(newLevel);
         this->maxLevel = level + 1;
     }
+
+    CompactionJob* job = new CompactionJob();
+    job->level = level;
+    job->outputLevel = level + 1;
+
+    uint64_t minKeyLevel, maxKeyLevel;
     if(level == 0){
-        /*对于 Level 0 层的合并操作来说，需要将所有的
-        Level 0 层中的 SSTable 与 Level 1 层中的部分 SSTable 进行合并，随后将
-        产生的新 SSTable 文件写入到 Level 1 层中。*/
-
-        //统计 Level 0 层中所有 SSTable 所覆盖的键的区间（无序，逐个查找）
-        uint64_t minKeyLevel = cache[level][0]->getMinKey();
-        uint64_t maxKeyLevel = cache[level][0]->getMaxKey();
-        uint64_t curMinKey, curMaxKey;
-        for(auto it = cache[level].begin(); it != cache[level].end(); ++it){
-            curMinKey = (*it)->getMinKey();
-            curMaxKey = (*it)->getMaxKey();
-            if(curMinKey < minKeyLevel) minKeyLevel = curMinKey;
-            if(curMaxKey > maxKeyLevel) maxKeyLevel = curMaxKey;
-        }
-
-        //然后在 Level 1 层中找到与此区间有交集的所有 SSTable 文件（有序无重复，顺序查找）
-        uint64_t maxIndex = cache[level + 1].size() - 1;
-        uint64_t now = 0;
-        uint64_t startIndex = -1, endIndex = -1;
-        uint64_t nowMinKey, nowMaxKey;
-        bool findTableInNextLevel = false;
-        bool findStartIndex = false;
-        bool findEndIndex = false;
-        if(!cache[level + 1].empty()){
-            while(now <= maxIndex)
-            {
-                nowMinKey = cache[level + 1][now]->getMinKey();
-                nowMaxKey = cache[level + 1][now]->getMaxKey();
-                if(!findStartIndex && minKeyLevel <= nowMaxKey)
-                {
-                    if(now == 0 && maxKeyLevel < nowMinKey){
-                        findTableInNextLevel = false;
-                        break;
-                    }
-                    findTableInNextLevel = true;
-                    findStartIndex = true;
-                    startIndex = now;
-                }
-                if(maxKeyLevel < nowMinKey)
-                {
-                    findTableInNextLevel = true;
-                    findEndIndex = true;
-                    endIndex = now - 1;
-                    break;
-                }
-                ++now;
-            }
-            if(!findEndIndex){
-                endIndex = maxIndex;
-            }
-            if(findTableInNextLevel && endIndex < startIndex) findTableInNextLevel = false;
-        }
-
-        // 将涉及到的文件读到内存，进行归并排序，并生成SSTable文件写回下一层（Level 1）
-        // 其中 level0 中每个文件当做一路，level1整体当做一路
-        // level0 发生 compaction 只可能有且仅有有三个文件
-        std::list<std::pair<uint64_t, std::string> > level0_list0;
-        std::list<std::pair<uint64_t, std::string> > level0_list1;
-        std::list<std::pair<uint64_t, std::string> > level0_list2;
-        cache[level][0]->readAllIndexAndData(level0_list0);
-        cache[level][1]->readAllIndexAndData(level0_list1);
-        cache[level][2]->readAllIndexAndData(level0_list2);
-        // 读取原来各个 SSTable 的时间戳
-        uint64_t level0_timeStamp0 = cache[level][0]->getTimeStamp();
-        uint64_t level0_timeStamp1 = cache[level][1]->getTimeStamp();
-        uint64_t level0_timeStamp2 = cache[level][2]->getTimeStamp();
-
-
-        // 建立最小化堆，进行四路（level1 为空时三路）归并
-        // 按照自定义函数，heap 会首先按照 first.first 来进行排序，之后按照 first.second 排序
-        std::priority_queue<std::pair<std::pair<uint64_t, std::string>,uint64_t>, std::vector<std::pair<std::pair<uint64_t, std::string>,uint64_t> >, cmpHeap> heap;
-        // 前一个数字表示来源，方便堆顶pop出元素之后知道再新增哪个
-        std::pair<std::pair<uint64_t, std::string>, uint64_t> level0_0(level0_list0.front(), level0_timeStamp0);
-        std::pair<std::pair<uint64_t, std::string>, uint64_t> level0_1(level0_list1.front(), level0_timeStamp1);
-        std::pair<std::pair<uint64_t, std::string>, uint64_t> level0_2(level0_list2.front(), level0_timeStamp2);
-        level0_list0.pop_front();
-        level0_list1.pop_front();
-        level0_list2.pop_front();
-        heap.push(level0_0);
-        heap.push(level0_1);
-        heap.push(level0_2);
-        uint64_t maxTimeStamp = getMax(level0_timeStamp0, getMax(level0_timeStamp1, level0_timeStamp2));
-        std::list<std::pair<std::pair<uint64_t, std::string>, uint64_t> > level1_list;
-        if(findTableInNextLevel){
-            for(auto j = startIndex; j <= endIndex; ++j){
-                // 直接把 timeStamp 信息一起弄进去
-                (cache[level + 1][j])->readAllIndexAndDataWithTimeStamp(level1_list);
-                maxTimeStamp = getMax(maxTimeStamp, (cache[level + 1][j])->getTimeStamp());
-            }
-            heap.push(level1_list.front());
-            level1_list.pop_front();
-        }
-
-        std::list<std::pair<uint64_t, std::string> > result;
-        // 进行归并直到堆空
-        while(!heap.empty()){
-            // 在合并时，如果遇到相同键 K 的多条记录，通过比较时间戳来决定键 K 的最新值，时间戳大的记录被保留。
-            // heap 会首先按照 first.first 来进行排序，之后按照 first.second 排序
-            // 取出堆顶最小的
-            auto top = heap.top();
-            heap.pop();
-            result.push_back(top.first);
-            auto topTimeStamp = top.second;
-            if(topTimeStamp == level0_timeStamp0){
-                if(!level0_list0.empty()){
-                    heap.push(std::make_pair(level0_list0.front(), level0_timeStamp0));
-                    level0_list0.pop_front();
-                }
-                continue;
+        // 从最旧的文件开始，反复加入与已选区间相交的文件直到区间不再扩大；未选中的文件与结果区间都不相交，
+        // 因此不会出现较新的数据进入 level 1 而相同 key 较旧的数据仍留在 level 0 的情况
+        // level 0 的文件之间键区间有交叉，每个文件各作为一路，时间戳大的在前
+        std::vector<bool> selected(cache[0].size(), false);
+        selected[0] = true;
+        minKeyLevel = cache[0][0]->getMinKey();
+        maxKeyLevel = cache[0][0]->getMaxKey();
+        bool expanded = true;
+        while(expanded){
+            expanded = false;
+            for(uint64_t i = 1; i < cache[0].size(); ++i){
+                SSTables* table = cache[0][i];
+                if(selected[i] || table->getMaxKey() < minKeyLevel || table->getMinKey() > maxKeyLevel) continue;
+                selected[i] = true;
+                expanded = true;
+                if(table->getMinKey() < minKeyLevel) minKeyLevel = table->getMinKey();
+                if(table->getMaxKey() > maxKeyLevel) maxKeyLevel = table->getMaxKey();
             }
-            if(topTimeStamp == level0_timeStamp1){
-                if(!level0_list1.empty()){
-                    heap.push(std::make_pair(level0_list1.front(), level0_timeStamp1));
-                    level0_list1.pop_front();
-                }
-                continue;
-            }
-            if(topTimeStamp == level0_timeStamp2){
-                if(!level0_list2.empty()){
-                    heap.push(std::make_pair(level0_list2.front(), level0_timeStamp2));
-                    level0_list2.pop_front();
-                }
-                continue;
-            }
-            if(findTableInNextLevel){
-                if(!level1_list.empty()){
-                    heap.push(level1_list.front());
-                    level1_list.pop_front();
-                }
+        }
+        for(uint64_t i = cache[0].size(); i > 0; --i){
+            if(selected[i - 1]) job->sources.push_back(std::vector<SSTables*>(1, cache[0][i - 1]));
+        }
+    } else {
+        std::vector<SSTables*> selected;
+        job->byCompactionPri = true;
+        job->compactionPri = options.compactionPri;
+        if(options.compactionPri == COMPACTION_PRI_MIN_OVERLAP){
+            pickMinOverlapFiles(level, selected);
+        } else {
+            // 从 level 的 SSTable 中，优先选择时间戳最小的若干个文件（时间戳相等选择键最小的文件），至少一个，使得剩余大小不超过目标大小
+            selected = cache[level];
+            std::sort(selected.begin(), selected.end(), [](SSTables* a, SSTables* b){
+                if(a->getTimeStamp() != b->getTimeStamp()) return a->getTimeStamp() < b->getTimeStamp();
+                return a->getMinKey() < b->getMinKey();
+            });
+            uint64_t remainBytes = levelBytes(level);
+            uint64_t targetBytes = levelTargetBytes(level);
+            uint64_t selectedNum = 0;
+            while(selectedNum < selected.size() && (selectedNum == 0 || remainBytes > targetBytes)){
+                remainBytes -= selected[selectedNum]->getFileSize();
+                ++selectedNum;
             }
+            selected.resize(selectedNum);
         }
+        // 选出的文件按最小键排列后作为一路
+        std::sort(selected.begin(), selected.end(), cmpSSTableMinKey);
+        minKeyLevel = selected.front()->getMinKey();
+        maxKeyLevel = selected.back()->getMaxKey();
+        job->sources.push_back(std::move(selected));
+    }
 
-        // 遍历 result 去除重复 key
-        // 注意判定相等时候只比较 key，需要自定义比较函数
-        auto _it = unique(result.begin(), result.end(), cmpList);
-        result.erase(_it, result.end());
+    // 下一层中与此区间有交集的所有 SSTable 文件作为最旧的一路
+    uint64_t startIndex, endIndex;
+    if(findOverlapTables(cache[level + 1], minKeyLevel, maxKeyLevel, startIndex, endIndex)){
+        job->sources.push_back(std::vector<SSTables*>(cache[level + 1].begin() + startIndex, cache[level + 1].begin() + endIndex + 1));
+        job->withNextLevel = true;
+    }
 
-        std::vector<SSTables*> tempCache;
-        auto cacheSize = cache[level + 1].size();
-        std::string level_str = "/level-" + std::to_string(level+1);
-        if(findTableInNextLevel){
+    return job;
+}
 
-            // 依据已经判断好在下一层 level 中 startIndex, endIndex，将下一层 level 的 cache
-            // 分为两个部分，后半部分取出之后再拼凑上去，只留下前半部分
-            // 因为文件在 level 中要按照 key 顺序排（与原来已有的契合），而 fileName 和 cache 也与这个有关
+// COMPACTION_PRI_MIN_OVERLAP：在 level 层（按最小键有序）中选出一段连续的文件，至少一个，总大小不小于该层超出目标大小的部分，
+// 使下一层中与之相交的文件总大小与这段文件总大小之比最小；从该层的轮转游标处开始比较，比值相同时取先比较到的一段，
+// 选中后游标移到这段文件之后，避免总是选中同一段而使其余文件长期得不到 compaction
+void KVStore::pickMinOverlapFiles(uint64_t level, std::vector<SSTables*> &selected)
+{
+    const std::vector<SSTables*> &tables = cache[level];
+    uint64_t tableNum = tables.size();
+    uint64_t totalBytes = levelBytes(level);
+    uint64_t targetBytes = levelTargetBytes(level);
+    uint64_t excessBytes = (totalBytes > targetBytes) ? totalBytes - targetBytes : 0;
+    if(compactCursors.size() <= level) compactCursors.resize(level + 1, 0);
+
+    uint64_t first = 0;
+    while(first < tableNum && tables[first]->getMaxKey() < compactCursors[level]) ++first;
+    if(first == tableNum) first = 0;
+
+    bool found = false;
+    double bestRatio = 0;
+    uint64_t bestStart = 0, bestEnd = 0;
+    for(uint64_t k = 0; k < tableNum; ++k){
+        uint64_t start = (first + k) % tableNum;
+        uint64_t end = start;
+        uint64_t runBytes = tables[start]->getFileSize();
+        while(runBytes < excessBytes && end + 1 < tableNum){
+            ++end;
+            runBytes += tables[end]->getFileSize();
+        }
+        // 到该层末尾仍不够大的一段不考虑，从第一个文件开始的一段总是足够大
+        if(runBytes < excessBytes) continue;
 
-            for(auto j = endIndex + 1; j < cacheSize; ++j){
-                tempCache.push_back(cache[level + 1][j]);
-            }
-            for(auto j = endIndex + 1; j < cacheSize; ++j){
-                cache[level + 1].pop_back();
-            }
+        uint64_t overlapBytes = 0;
+        uint64_t startIndex, endIndex;
+        if(findOverlapTables(cache[level + 1], tables[start]->getMinKey(), tables[end]->getMaxKey(), startIndex, endIndex)){
+            for(uint64_t i = startIndex; i <= endIndex; ++i) overlapBytes += cache[level + 1][i]->getFileSize();
+        }
+        double ratio = (double)overlapBytes / (double)std::max<uint64_t>(runBytes, 1);
+        if(!found || ratio < bestRatio){
+            found = true;
+            bestRatio = ratio;
+            bestStart = start;
+            bestEnd = end;
+        }
+    }
 
-            // 删除原来的 SSTable 文件，cache中对应的也要 delete！！！（因为 new 出来）
-            for(auto j = startIndex; j <= endIndex; ++j){
-                std::string currentFileName = cache[level + 1][j]->fileName + ".sst";
-                // delete that file
-                if(utils::rmfile((dir+level_str+"/"+currentFileName).c_str())){
-                    throw("remove file error in compaction!");
-                }
-                // delete that cache
-                delete (cache[level + 1][j]);
-            }
+    selected.assign(tables.begin() + bestStart, tables.begin() + bestEnd + 1);
+    uint64_t maxKey = tables[bestEnd]->getMaxKey();
+    compactCursors[level] = (maxKey == UINT64_MAX) ? 0 : maxKey + 1;
+}
 
-            for(auto j = startIndex; j <= endIndex; ++j){
-                cache[level + 1].pop_back();
+// 没有层需要 compaction 时，选出 level 0 以外删除标记占比最高且不低于 options.tombstoneCompactionRatio 的一个文件单独 compaction：
+// 不在最后一层时与下一层中相交的文件合并写入下一层，使删除标记尽快到达可以丢弃的位置；在最后一层时原地重写，删除标记随之丢弃
+CompactionJob* KVStore::pickTombstoneCompaction()
+{
+    if(options.tombstoneCompactionRatio <= 0) return nullptr;
+    SSTables* picked = nullptr;
+    uint64_t level = 0;
+    double bestRatio = options.tombstoneCompactionRatio;
+    for(uint64_t i = 1; i <= this->maxLevel && i < cache.size(); ++i){
+        for(auto it = cache[i].begin(); it != cache[i].end(); ++it){
+            double ratio = (*it)->getTombstoneRatio();
+            if(ratio > bestRatio || (picked == nullptr && ratio >= bestRatio)){
+                bestRatio = ratio;
+                picked = *it;
+                level = i;
             }
         }
+    }
+    if(picked == nullptr) return nullptr;
+
+    CompactionJob* job = new CompactionJob();
+    job->level = level;
+    job->byTombstones = true;
+    job->sources.push_back(std::vector<SSTables*>(1, picked));
+    if(level == this->maxLevel){
+        job->outputLevel = level;
+        return job;
+    }
+    job->outputLevel = level + 1;
+    uint64_t startIndex, endIndex;
+    if(findOverlapTables(cache[level + 1], picked->getMinKey(), picked->getMaxKey(), startIndex, endIndex)){
+        job->sources.push_back(std::vector<SSTables*>(cache[level + 1].begin() + startIndex, cache[level + 1].begin() + endIndex + 1));
+        job->withNextLevel = true;
+    }
+    return job;
+}
+
+// universal 模式下的 sorted run：level 0 中每个文件各为一个（新的在前），之后每个非空的层各为一个
+// 返回各 sorted run 的字节数，levels 为对应的层号
+void KVStore::universalSortedRuns(std::vector<uint64_t> &bytes, std::vector<uint64_t> &levels)
+{
+    for(auto it = cache[0].rbegin(); it != cache[0].rend(); ++it){
+        bytes.push_back((*it)->getFileSize());
+        levels.push_back(0);
+    }
+    for(uint64_t level = 1; level <= this->maxLevel; ++level){
+        if(cache[level].empty()) continue;
+        bytes.push_back(levelBytes(level));
+        levels.push_back(level);
+    }
+}
+
+// universal：返回需要合并的最新的 sorted run 个数，不需要 compaction 时返回 0
+// 1. 除最旧的一个外其余 sorted run 的总大小超过最旧的 universalMaxSizeAmplificationPercent% 时全部合并
+// 2. 否则 level 0 文件数达到 level0CompactionTrigger 或 sorted run 个数超过 universalMaxSortedRuns 时，
+//    从最新的开始，下一个 sorted run 不超过已选总大小的 (100 + universalSizeRatio)% 就一并合并；
+//    level 0 的文件总是全部参与，sorted run 个数超过上限时至少合并到不超过上限
+uint64_t KVStore::pickUniversalRunNum()
+{
+    std::vector<uint64_t> bytes, levels;
+    universalSortedRuns(bytes, levels);
+    if(bytes.empty()) return 0;
+
+    if(bytes.size() >= 2 && levels.back() != 0){
+        uint64_t newerBytes = 0;
+        for(uint64_t i = 0; i + 1 < bytes.size(); ++i) newerBytes += bytes[i];
+        if(newerBytes * 100 > bytes.back() * options.universalMaxSizeAmplificationPercent) return bytes.size();
+    }
+
+    uint64_t level0Num = cache[0].size();
+    if(level0Num < options.level0CompactionTrigger && bytes.size() <= options.universalMaxSortedRuns) return 0;
+
+    uint64_t runNum = 1;
+    uint64_t accumulated = bytes[0];
+    while(runNum < bytes.size() && bytes[runNum] * 100 <= accumulated * (100 + options.universalSizeRatio)){
+        accumulated += bytes[runNum];
+        ++runNum;
+    }
+    runNum = std::max(runNum, level0Num);
+    if(bytes.size() > options.universalMaxSortedRuns) runNum = std::max<uint64_t>(runNum, bytes.size() - options.universalMaxSortedRuns + 1);
+    return runNum;
+}
 
-        // 删除 level0 层文件，清空对应 cache
-        level_str = "/level-" + std::to_string(level);
-        for(auto j = 0; j <= 2; ++j){
-            std::string currentFileName = cache[level][j]->fileName + ".sst";
-            // delete that file
-            if(utils::rmfile((dir+level_str+"/"+currentFileName).c_str())){
-                throw("remove file error in compaction!");
+// universal：合并最新的若干个 sorted run，结果写入其中最旧的一层；只合并 level 0 时写入最上面的非空层之上的空层，
+// level 1 非空时先把各层整体下移一层空出 level 1，使每一层仍然比它下面的层更新
+CompactionJob* KVStore::pickUniversalCompaction()
+{
+    uint64_t runNum = pickUniversalRunNum();
+    if(runNum == 0) return nullptr;
+    std::vector<uint64_t> bytes, levels;
+    universalSortedRuns(bytes, levels);
+
+    CompactionJob* job = new CompactionJob();
+    job->level = 0;
+    for(uint64_t i = 0; i < runNum; ++i){
+        if(levels[i] == 0){
+            job->sources.push_back(std::vector<SSTables*>(1, cache[0][cache[0].size() - i - 1]));
+        } else {
+            job->sources.push_back(cache[levels[i]]);
+            job->outputLevel = levels[i];
+            job->withNextLevel = true;
+        }
+    }
+    if(!job->withNextLevel){
+        uint64_t firstLevel = 1;
+        while(firstLevel <= this->maxLevel && cache[firstLevel].empty()) ++firstLevel;
+        if(firstLevel > this->maxLevel){
+            // 没有非空的层，直接写入最后一层
+            if(this->maxLevel == 0){
+                cache.push_back(std::vector<SSTables*>());
+                this->maxLevel = 1;
             }
-            // delete that cache
-            delete (cache[level][j]);
+            job->outputLevel = this->maxLevel;
+        } else {
+            if(firstLevel == 1){
+                shiftLevelsDown();
+                firstLevel = 2;
+            }
+            job->outputLevel = firstLevel - 1;
         }
-        cache[level].clear();
+    }
+    return job;
+}
 
-        // 将结果每 2 MB 分成一个新的 SSTable 文件（最后一个 SSTable 可以不足 2MB），写入到 Level 1 中
-        // 在其中操作时 cache 直接 push_back 即可
-        // 取最大 maxTimeStamp 作为共同 timeStamp
-        writeAllListToSSTables(result, maxTimeStamp, level + 1);
+// 把 level 1 及以后的各层整体下移一层，从最后一层开始移动文件，任何时刻层之间的新旧顺序都不变
+void KVStore::shiftLevelsDown()
+{
+    cache.push_back(std::vector<SSTables*>());
+    ++this->maxLevel;
+    for(uint64_t level = this->maxLevel; level > 1; --level){
+        std::string levelDir = dir + "/level-" + std::to_string(level);
+        for(auto it = cache[level - 1].begin(); it != cache[level - 1].end(); ++it){
+            (*it)->relocate(levelDir, (*it)->fileName);
+        }
+        cache[level] = std::move(cache[level - 1]);
+        cache[level - 1].clear();
+    }
+    if(!utils::dirExists(dir + "/level-1")) utils::mkdir((dir + "/level-1").c_str());
+}
 
-        // 将临时缓存与目前的缓存合并
-        if(findTableInNextLevel)
-        for(auto j = endIndex + 1; j < cacheSize; ++j){
-            cache[level + 1].push_back(tempCache[j-endIndex-1]);
+// 对 job 的各路输入做多路归并并写出新文件（不持有 mutex，不访问 cache）
+// 按下一层输入文件的边界把键区间切分成至多 options.maxSubcompactions 段，各段互不相交，由多个线程并行归并
+// 新文件先写在 dir/.compacting 中，由 installCompaction 移入目标层
+void KVStore::runCompaction(CompactionJob &job)
+{
+    // 每一路的数据会被所有更新的来源的范围删除标记遮蔽
+    std::vector<RangeTombstones> newerTombstones(job.sources.size());
+    RangeTombstones outputTombstones;
+    for(uint64_t i = 0; i < job.sources.size(); ++i){
+        newerTombstones[i] = outputTombstones;
+        for(auto it = job.sources[i].begin(); it != job.sources[i].end(); ++it){
+            outputTombstones.add((*it)->getRangeTombstones());
         }
-        tempCache.clear();
+    }
+    // 与更深层所有文件的键区间都不相交的范围删除标记已经没有可遮蔽的数据，直接丢弃（写入最后一层时全部丢弃）
+    RangeTombstones keptTombstones;
+    for(auto it = outputTombstones.getRanges().begin(); it != outputTombstones.getRanges().end(); ++it){
+        if(job.deeperKeyRanges.intersects(it->first, it->second)) keptTombstones.add(it->first, it->second);
+    }
+    outputTombstones = std::move(keptTombstones);
+
+    // 切分点取下一层输入文件的 minKey，第 i 段为 [bounds[i], bounds[i + 1] - 1]
+    std::vector<uint64_t> bounds(1, 0);
+    if(job.withNextLevel){
+        const std::vector<SSTables*> &nextLevel = job.sources.back();
+        uint64_t partNum = std::min<uint64_t>(std::max<uint64_t>(options.maxSubcompactions, 1), nextLevel.size());
+        for(uint64_t i = 1; i < partNum; ++i){
+            uint64_t bound = nextLevel[i * nextLevel.size() / partNum]->getMinKey();
+            if(bound > bounds.back()) bounds.push_back(bound);
+        }
+    }
+    uint64_t partNum = bounds.size();
 
-        // 对下一个 level 层的 cache 进行由小到大重新排序
-        std::sort(cache[level + 1].begin(), cache[level + 1].end(), cmpSSTableMinKey);
+    // 每一段分到与其相交的范围删除标记，输出文件的键区间互不相交
+    std::vector<RangeTombstones> partTombstones(partNum);
+    for(uint64_t i = 0; i < partNum; ++i){
+        if(i + 1 < partNum) outputTombstones.takeUpTo(bounds[i + 1] - 1, partTombstones[i]);
+        else partTombstones[i] = std::move(outputTombstones);
+    }
+    std::vector<std::vector<SSTables*> > partOutputs(partNum);
+    std::vector<std::vector<std::string> > partDroppedPointers(partNum);
+    std::vector<std::exception_ptr> partErrors(partNum);
+    auto runPart = [&](uint64_t i){
+        uint64_t key2 = (i + 1 < partNum) ? bounds[i + 1] - 1 : UINT64_MAX;
+        try {
+            runSubcompaction(job, newerTombstones, bounds[i], key2, partTombstones[i], partOutputs[i], partDroppedPointers[i]);
+        } catch(...){
+            partErrors[i] = std::current_exception();
+        }
+    };
+
+    // 后台线程自身处理一段，其余的由线程池中的线程按顺序领取；线程池中的任务引用本函数的局部变量，须等其全部结束再返回
+    std::atomic<uint64_t> nextPart(0);
+    auto worker = [&](){
+        for(uint64_t i = nextPart++; i < partNum; i = nextPart++) runPart(i);
+    };
+    std::mutex helperMutex;
+    std::condition_variable helperCv;
+    uint64_t helpers = (subcompactionPool == nullptr) ? 0 : std::min<uint64_t>(partNum - 1, subcompactionPool->getThreadNum());
+    uint64_t runningHelpers = helpers;
+    for(uint64_t i = 0; i < helpers; ++i){
+        subcompactionPool->schedule([&](){
+            worker();
+            std::lock_guard<std::mutex> lock(helperMutex);
+            if(--runningHelpers == 0) helperCv.notify_one();
+        });
+    }
+    worker();
+    {
+        std::unique_lock<std::mutex> lock(helperMutex);
+        helperCv.wait(lock, [&]{ return runningHelpers == 0; });
+    }
 
-        return;
+    // 按 key 顺序汇总各段的输出，出错时也要汇总，由 abortCompaction 删除
+    for(uint64_t i = 0; i < partNum; ++i){
+        job.outputs.insert(job.outputs.end(), partOutputs[i].begin(), partOutputs[i].end());
+        job.droppedValuePointers.insert(job.droppedValuePointers.end(), partDroppedPointers[i].begin(), partDroppedPointers[i].end());
+    }
+    for(uint64_t i = 0; i < partNum; ++i){
+        if(partErrors[i]) std::rethrow_exception(partErrors[i]);
+    }
+}
 
-    } else {  // 其余level
-        // 从 level 的 SSTable 中，优先选择时间戳最小的若干个文件（时间戳相等选择键最小的文件）使得文件数满足层数要求
-        // first.first 参数为时间戳，first.second 参数为最小键值，second 参数为对应 level 中的 cache 下标
-        std::priority_queue<std::pair<std::pair<uint64_t, uint64_t>, unsigned int>, std::vector<std::pair<std::pair<uint64_t, uint64_t>, unsigned int> >, std::greater< > > heapSelectFiles;
-        uint64_t tmpStamp;
-        uint64_t tmpMinKey;
-        for(unsigned int j = 0; j < cache[level].size(); ++j){
-            tmpStamp = cache[level][j]->getTimeStamp();
-            tmpMinKey = cache[level][j]->getMinKey();
-            heapSelectFiles.push(std::make_pair(std::make_pair(tmpStamp, tmpMinKey), j));
-        }
-        std::priority_queue<unsigned int, std::vector<unsigned int>, std::greater<> > selectedFilesIndex;
-        while (moreNum > 0){
-            auto top = heapSelectFiles.top();
-            selectedFilesIndex.push(top.second);
-            heapSelectFiles.pop();
-            --moreNum;
-        }
-        while(!heapSelectFiles.empty()) heapSelectFiles.pop();
-
-        // 按顺序输出 index
-        std::list<unsigned int> fileIndex;
-        while(!selectedFilesIndex.empty()){
-            auto index = selectedFilesIndex.top();
-            fileIndex.push_back(index);
-            selectedFilesIndex.pop();
-        }
-
-        //计算 Level 层中选出的 SSTable 所覆盖的键的区间（有序，直接找最小和最大）
-        uint64_t minKeyLevel = cache[level][(fileIndex.front())]->getMinKey();
-        uint64_t maxKeyLevel = cache[level][(fileIndex.back())]->getMaxKey();
-
-        //然后在 next Level 中找到与此区间有交集的所有 SSTable 文件（有序无重复）
-        uint64_t maxIndex = cache[level + 1].size() - 1;
-        uint64_t now = 0;
-        uint64_t startIndex = -1, endIndex = -1;
-        uint64_t nowMinKey, nowMaxKey;
-        bool findTableInNextLevel = false;
-        bool findStartIndex = false;
-        bool findEndIndex = false;
-        if(!cache[level + 1].empty()){
-            while(now <= maxIndex)
-            {
-                nowMinKey = cache[level + 1][now]->getMinKey();
-                nowMaxKey = cache[level + 1][now]->getMaxKey();
-                if(!findStartIndex && minKeyLevel <= nowMaxKey)
-                {
-                    if(now == 0 && maxKeyLevel < nowMinKey){
-                        findTableInNextLevel = false;
-                        break;
+// 归并 job 的各路输入中 key 落在 [key1, key2] 内的部分，写出的新文件放入 outputs
+// 每一路只打开一个 SSTableReaders，输出经 SSTableBuilders 每满 targetFileSize(outputLevel) 写出一个文件，内存占用与输入文件的大小无关
+// outputTombstones 为本段的范围删除标记，随输出文件一并写出；被丢弃的值日志指针放入 droppedPointers
+void KVStore::runSubcompaction(const CompactionJob &job, const std::vector<RangeTombstones> &newerTombstones, uint64_t key1, uint64_t key2, RangeTombstones &outputTombstones, std::vector<SSTables*> &outputs, std::vector<std::string> &droppedPointers)
+{
+    // 每一路的下标即为其优先级，下标越小越新；每一路内的文件按 key 有序无交集，读完一个再打开下一个
+    struct MergeSource {
+        const std::vector<SSTables*> *tables = nullptr;
+        uint64_t nextIndex = 0;
+        SSTableReaders* reader = nullptr;
+        const RangeTombstones *newerTombstones = nullptr;
+    };
+    std::vector<MergeSource> sources(job.sources.size());
+    for(uint64_t i = 0; i < job.sources.size(); ++i){
+        sources[i].tables = &job.sources[i];
+        sources[i].newerTombstones = &newerTombstones[i];
+    }
+
+    // 当前文件读完时打开下一个文件，与本段不相交或在本段内整个被更新的范围删除标记覆盖的文件不必读出
+    auto advance = [&](MergeSource &source){
+        while((source.reader == nullptr || !source.reader->valid()) && source.nextIndex < source.tables->size()){
+            SSTables* table = (*source.tables)[source.nextIndex];
+            ++source.nextIndex;
+            delete source.reader;
+            source.reader = nullptr;
+            if(table->getPairsNum() == 0 || table->getMaxKey() < key1 || table->getMinKey() > key2) continue;
+            uint64_t minKey = std::max(key1, table->getMinKey());
+            uint64_t maxKey = std::min(key2, table->getMaxKey());
+            if(source.newerTombstones->coversRange(minKey, maxKey)){
+                // 不必归并，但其中的值日志指针随之被丢弃，同样要计入失效字节
+                if(job.readCoveredTables){
+                    SSTableReaders reader(table, minKey, maxKey, options.rateLimitCompactionReads ? &rateLimiter : nullptr, options.dropCompactionPageCache);
+                    for(; reader.valid(); reader.next()){
+                        if(ValueLogs::isPointer(reader.value(), reader.valueSize())) droppedPointers.emplace_back(reader.value(), reader.valueSize());
                     }
-                    findTableInNextLevel = true;
-                    findStartIndex = true;
-                    startIndex = now;
-                }
-                if(maxKeyLevel < nowMinKey)
-                {
-                    findTableInNextLevel = true;
-                    findEndIndex = true;
-                    endIndex = now - 1;
-                    break;
                 }
-                ++now;
+                continue;
             }
-            if(!findEndIndex){
-                endIndex = maxIndex;
+            source.reader = new SSTableReaders(table, key1, key2, options.rateLimitCompactionReads ? &rateLimiter : nullptr, options.dropCompactionPageCache);
+        }
+    };
+    auto valid = [&](uint64_t index){
+        return sources[index].reader != nullptr && sources[index].reader->valid();
+    };
+    for(auto it = sources.begin(); it != sources.end(); ++it) advance(*it);
+
+    // key 小的先输出，key 相同时来源下标小（更新）的先输出，读完的路排在最后
+    auto less = [&](uint64_t a, uint64_t b){
+        if(!valid(a)) return false;
+        if(!valid(b)) return true;
+        uint64_t keyA = sources[a].reader->key();
+        uint64_t keyB = sources[b].reader->key();
+        return keyA < keyB || (keyA == keyB && a < b);
+    };
+    LoserTrees<decltype(less)> tree(sources.size(), less);
+
+    static const std::string deleted = "~DELETED~";
+    uint64_t fileSize = targetFileSize(job.outputLevel);
+    SSTableBuilders* builder = new SSTableBuilders(tempTablePath(), blockCodec(), fileSize, options.fixedWidthValues, &rateLimiter, false);
+    bool hasLastKey = false;
+    uint64_t lastKey = 0;
+    // 相同 key 只保留最新的一个，被更新的范围删除标记覆盖的直接丢弃，value 从读缓冲区直接追加到 builder 中
+    while(valid(tree.top())){
+        MergeSource &source = sources[tree.top()];
+        uint64_t key = source.reader->key();
+        if((!hasLastKey || lastKey != key) && !source.newerTombstones->covers(key)){
+            uint64_t size = source.reader->valueSize();
+            const char* value = source.reader->value();
+            // 更深的层中不可能有该 key 时删除标记也不再需要
+            if(!(size == deleted.size() && deleted.compare(0, size, value, size) == 0 && !job.deeperKeyRanges.covers(key))){
+                // 到输出层的目标大小，转化成 SSTable
+                if(builder->getPairsNum() != 0 && builder->getSize() + size + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE > fileSize){
+                    outputs.push_back(finishSSTable(*builder, outputTombstones, builder->getMaxKey(), job.timeStamp, dir + "/.compacting"));
+                    delete builder;
+                    builder = new SSTableBuilders(tempTablePath(), blockCodec(), fileSize, options.fixedWidthValues, &rateLimiter, false);
+                }
+                builder->add(key, value, size);
             }
-            if(findTableInNextLevel && endIndex < startIndex) findTableInNextLevel = false;
+        } else if(ValueLogs::isPointer(source.reader->value(), source.reader->valueSize())){
+            droppedPointers.emplace_back(source.reader->value(), source.reader->valueSize());
         }
+        hasLastKey = true;
+        lastKey = key;
+        source.reader->next();
+        advance(source);
+        tree.replay();
+    }
+    for(auto it = sources.begin(); it != sources.end(); ++it) delete (*it).reader;
 
-        // 如果没有在下一层找到区间相交的
-        if(!findTableInNextLevel){
+    // 所有数据都被删除时不产生文件，否则最后一个文件拿走全部剩余的范围删除标记
+    if(builder->getPairsNum() != 0 || !outputTombstones.empty())
+        outputs.push_back(finishSSTable(*builder, outputTombstones, UINT64_MAX, job.timeStamp, dir + "/.compacting"));
+    delete builder;
+}
 
+// 将 job 的结果放入目标层并淘汰输入文件（持有 mutex 时调用）
+void KVStore::installCompaction(CompactionJob &job)
+{
+    uint64_t level = job.outputLevel;
+    std::vector<SSTables*> inputs;
+    for(auto it = job.sources.begin(); it != job.sources.end(); ++it){
+        inputs.insert(inputs.end(), (*it).begin(), (*it).end());
+    }
+    auto isInput = [&](SSTables* table){
+        return std::find(inputs.begin(), inputs.end(), table) != inputs.end();
+    };
+    for(uint64_t i = 0; i <= level; ++i){
+        cache[i].erase(std::remove_if(cache[i].begin(), cache[i].end(), isInput), cache[i].end());
+    }
+    // 释放 pickCompaction 中持有的引用
+    for(auto it = inputs.begin(); it != inputs.end(); ++it){
+        (*it)->unref();
+    }
+    for(auto it = job.droppedValuePointers.begin(); it != job.droppedValuePointers.end(); ++it){
+        valueLog->addGarbage((*it).data());
+    }
+
+    std::string levelDir = dir + "/level-" + std::to_string(level);
+    if(job.trivialMove){
+        // 文件改名移入下一层，内存中的 SSTables 对象（包括被快照引用的）随之更新路径，继续使用
+        for(auto it = inputs.begin(); it != inputs.end(); ++it){
+            (*it)->relocate(levelDir, (*it)->fileName);
+            cache[level].push_back(*it);
         }
+        std::sort(cache[level].begin(), cache[level].end(), cmpSSTableMinKey);
+        return;
+    }
 
-        uint64_t maxTimeStamp = 0;
-        // 将涉及到的文件读到内存，进行归并排序，并生成SSTable文件写回下一层
-        // level 中所有被选中文件当做一路
-        std::list<std::pair<std::pair<uint64_t, std::string>, uint64_t> > level_list;
-        auto cacheLevelSize = cache[level].size();
-        std::string level_str = "/level-" + std::to_string(level);
-        std::vector<SSTables*> newLevelCache;
-        for(auto j = 0; j < cacheLevelSize; ++j){
-            // 直接把 timeStamp 信息一起弄进去
-            if(!fileIndex.empty() && fileIndex.front() == j) {
-                fileIndex.pop_front();
-                (cache[level][j])->readAllIndexAndDataWithTimeStamp(level_list);
-                maxTimeStamp = getMax(maxTimeStamp, (cache[level][j])->getTimeStamp());
-                std::string currentFileName = cache[level][j]->fileName + ".sst";
-                // 删除文件与对应缓存
-                if(utils::rmfile((dir+level_str+"/"+currentFileName).c_str())){
-                    throw("remove file error in compaction!");
-                }
-                delete (cache[level][j]);
-            } else {
-                newLevelCache.push_back(cache[level][j]);
+    // 新文件可能与下一层中尚未淘汰的输入文件同名，先淘汰同名的输入，再移入新文件，最后淘汰其余输入
+    for(auto it = job.outputs.begin(); it != job.outputs.end(); ++it){
+        std::string newPath = levelDir + "/" + (*it)->fileName + ".sst";
+        for(auto _it = inputs.begin(); _it != inputs.end(); ++_it){
+            if((*_it)->getFilePath() == newPath){
+                retireTable(*_it);
+                inputs.erase(_it);
+                break;
             }
         }
+        (*it)->relocate(levelDir, (*it)->fileName);
+        cache[level].push_back(*it);
+    }
+    for(auto it = inputs.begin(); it != inputs.end(); ++it){
+        retireTable(*it);
+    }
+    job.outputs.clear();
+
+    // 对目标层的 cache 进行由小到大重新排序
+    std::sort(cache[level].begin(), cache[level].end(), cmpSSTableMinKey);
+}
 
-        if(newLevelCache.size() != (2 << level)){
-            throw("newLevelCache size incorrect !");
+// 放弃一次失败的 compaction：删除已写出的新文件，释放输入文件的引用（持有 mutex 时调用）
+void KVStore::abortCompaction(CompactionJob &job)
+{
+    for(auto it = job.outputs.begin(); it != job.outputs.end(); ++it){
+        utils::rmfile((*it)->getFilePath().c_str());
+        delete *it;
+    }
+    job.outputs.clear();
+    for(auto it = job.sources.begin(); it != job.sources.end(); ++it){
+        for(auto _it = (*it).begin(); _it != (*it).end(); ++_it){
+            unrefTable(*_it);
         }
+    }
+}
 
-        cache[level].clear();
-        cache[level] = std::move(newLevelCache);
-
-        // next level 中区间相交的文件可能有很多很多，不能同时放在一个 list 中
-        std::list<std::pair<std::pair<uint64_t, std::string>, uint64_t> > nextLevel_list;
-        uint64_t nextIndex = startIndex + 1;
-        if(findTableInNextLevel){
-            for(auto j = startIndex; j <= endIndex; ++j){
-                // 直接把 timeStamp 信息一起弄进去
-                maxTimeStamp = getMax(maxTimeStamp, (cache[level + 1][j])->getTimeStamp());
-            }
-            (cache[level + 1][startIndex])->readAllIndexAndDataWithTimeStamp(nextLevel_list);
-        }
-
-        std::list<std::pair<uint64_t, std::string> > result;
-        // 为了缓解内存占用过大的问题，在 result 具备一定规模时尝试写一部分，nextLevelTempCache 暂存这一部分的 cache
-        std::vector<SSTables *> nextLevelTempCache;
-        // 记录 result 中放了多少 key-val 对，达到一定程度就先写入 SSTable
-        uint64_t cnt = 0;
-        // 本层挑选出的文件 level_list 与下一层挑选出的文件 nextLevel_list 进行两路归并
-        while(!level_list.empty()){
-            if(cnt > KV_NUM_TO_WRITE_IN_COMPACTION){
-                tryWriteSomeListToSSTables(result, maxTimeStamp, level+1, nextLevelTempCache);
-                cnt = 0;
-            }
-            if(findTableInNextLevel){
-                if(nextLevel_list.empty()){
-                    if(nextIndex <= endIndex){
-                        nextLevel_list.clear();
-                        (cache[level + 1][nextIndex])->readAllIndexAndDataWithTimeStamp(nextLevel_list);
-                        ++nextIndex;
-                    } else {
-                        break;
-                    }
-                }
-            } else break;
-            auto level_front = level_list.front();
-            auto nextLevel_front = nextLevel_list.front();
-            if(level_front.first.first == nextLevel_front.first.first){
-                if(level_front.second > nextLevel_front.second){
-                    result.push_back(level_front.first);
-                    ++cnt;
-                } else {
-                    result.push_back(nextLevel_front.first);
-                    ++cnt;
-                }
-                level_list.pop_front();
-                nextLevel_list.pop_front();
-                continue;
+// 后台 compaction 线程：没有需要 compaction 的层时等待 compactionCv，由 memTable 写出 SSTable 后唤醒
+// 只在选取输入与安装结果时持有 mutex，读写文件期间前台的读写照常进行
+void KVStore::backgroundCompaction()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true){
+        CompactionJob* job = nullptr;
+        while(!stopping && backgroundError == nullptr && (job = pickCompaction()) == nullptr){
+            // 没有需要 compaction 的层时回收值日志
+            bool collected = false;
+            try {
+                collected = collectValueLogGarbage(lock);
+            } catch(...){
+                setBackgroundError(std::current_exception());
             }
-            if(level_front.first.first > nextLevel_front.first.first){
-                result.push_back(nextLevel_front.first);
-                ++cnt;
-                nextLevel_list.pop_front();
-            } else {
-                result.push_back(level_front.first);
-                ++cnt;
-                level_list.pop_front();
+            if(!collected) compactionCv.wait(lock);
+        }
+        if(job == nullptr) break;
+        job->readCoveredTables = !valueLog->empty();
+
+        compacting = true;
+        std::exception_ptr error;
+        // 直接移动文件时不需要读写数据，持有 mutex 完成即可
+        if(!job->trivialMove){
+            lock.unlock();
+            try {
+                runCompaction(*job);
+            } catch(...){
+                error = std::current_exception();
             }
+            lock.lock();
         }
-        if(level_list.empty()){
-            while(!nextLevel_list.empty()){
-                auto nextLevel_front = nextLevel_list.front();
-                result.push_back(nextLevel_front.first);
-                ++cnt;
-                nextLevel_list.pop_front();
-                if(cnt > KV_NUM_TO_WRITE_IN_COMPACTION){
-                    tryWriteSomeListToSSTables(result, maxTimeStamp, level+1, nextLevelTempCache);
-                    cnt = 0;
-                }
+        if(!error){
+            installCompaction(*job);
+            if(job->trivialMove) ++stats.trivialMoves;
+            else ++stats.compactions;
+            if(job->byTombstones) ++stats.tombstoneCompactions;
+            if(job->byCompactionPri){
+                if(job->compactionPri == COMPACTION_PRI_MIN_OVERLAP) ++stats.minOverlapPicks;
+                else ++stats.oldestFirstPicks;
             }
         } else {
-            while(!level_list.empty()){
-                auto level_front = level_list.front();
-                result.push_back(level_front.first);
-                ++cnt;
-                level_list.pop_front();
-            }
+            abortCompaction(*job);
+            setBackgroundError(error);
         }
+        delete job;
+        compacting = false;
+        // 唤醒因 level 0 文件过多而阻塞的写以及等待 compaction 结束的 reset / 析构
+        stallCv.notify_all();
+    }
+}
 
-        std::vector<SSTables*> tempCache;
-        auto cacheSize = cache[level + 1].size();
-        level_str = "/level-" + std::to_string(level+1);
-        if(findTableInNextLevel){
-
-            // 依据已经判断好在下一层 level 中 startIndex, endIndex，将下一层 level 的 cache
-            // 分为两个部分，后半部分取出之后再拼凑上去，只留下前半部分
-            // 因为文件在 level 中要按照 key 顺序排（与原来已有的契合），而 fileName 和 cache 也与这个有关
+void KVStore::setBackgroundError(std::exception_ptr error)
+{
+    if(backgroundError != nullptr) return;
+    try {
+        std::rethrow_exception(error);
+    } catch(const char* e){
+        backgroundError = e;
+    } catch(const std::exception &e){
+        backgroundErrorMessage = std::string("ERROR  background compaction: ") + e.what();
+        backgroundError = backgroundErrorMessage.c_str();
+    } catch(...){
+        backgroundError = "ERROR  background compaction: unknown exception";
+    }
+}
 
-            for(auto j = endIndex + 1; j < cacheSize; ++j){
-                tempCache.push_back(cache[level + 1][j]);
-            }
-            for(auto j = endIndex + 1; j < cacheSize; ++j){
-                cache[level + 1].pop_back();
+// 回收值日志文件：每次不加锁读出文件中的一段记录，再分批持有 mutex 检查每条记录是否仍被最新的数据引用，
+// 仍有效的 value 重新写入值日志并把新指针写入 memTable（比原来的版本新，遮蔽 SSTable 中的旧指针）；
+// 回收期间写出的 memTable（包括前台写入触发的）与其引用的新记录都 fdatasync，全部重写并写出 memTable 后才删除旧文件，
+// 保证崩溃后不会有指向已删除文件的指针。旧指针可能仍被快照读到，因此有快照时不回收，
+// 回收期间出现快照时本次只重写不删除，文件标记为全部失效，待之后再删除
+bool KVStore::collectValueLogGarbage(std::unique_lock<std::mutex> &lock)
+{
+    uint64_t fileNum;
+    if(options.valueLogGCRatio <= 0 || !snapshots.empty() || !valueLog->pickGarbageFile(options.valueLogGCRatio, fileNum)) return false;
+
+    // compacting 使 reset 与析构等待回收结束
+    compacting = true;
+    collectingValueLog = true;
+    uint64_t relocatedBytes = 0;
+    std::exception_ptr error;
+    try {
+        std::vector<char> data;
+        std::vector<ValueLogRecord> records;
+        uint64_t offset = 0;
+        while(true){
+            // data 从文件的 start 处开始
+            uint64_t start = offset;
+            data.clear();
+            records.clear();
+            lock.unlock();
+            try {
+                offset = valueLog->readRecords(fileNum, start, data, records);
+            } catch(...){
+                lock.lock();
+                throw;
             }
-
-            // 删除原来的 SSTable 文件，cache中对应的也要 delete！！！（因为 new 出来）
-            for(auto j = startIndex; j <= endIndex; ++j){
-                std::string currentFileName = cache[level + 1][j]->fileName + ".sst";
-                // delete that file
-                if(utils::rmfile((dir+level_str+"/"+currentFileName).c_str())){
-                    throw("remove file error in compaction!");
+            lock.lock();
+            if(records.empty()) break;
+
+            for(uint64_t i = 0; i < records.size(); ++i){
+                // 每批之间释放 mutex，让前台的读写进行
+                if(i != 0 && i % VLOG_GC_BATCH_SIZE == 0){
+                    lock.unlock();
+                    lock.lock();
                 }
-                // delete that cache
-                delete (cache[level + 1][j]);
-            }
-
-            for(auto j = startIndex; j <= endIndex; ++j){
-                cache[level + 1].pop_back();
+                const ValueLogRecord &record = records[i];
+                std::string memValue;
+                SSTables* table;
+                uint64_t pos;
+                if(!lookup(record.key, nullptr, memValue, table, pos)) continue;
+                std::string stored = (table == nullptr) ? std::move(memValue) : table->getValue(pos);
+                if(!ValueLogs::isPointer(stored.data(), stored.size())) continue;
+                uint64_t storedFileNum, storedOffset;
+                uint32_t storedSize;
+                ValueLogs::decodePointer(stored.data(), storedFileNum, storedOffset, storedSize);
+                if(storedFileNum != fileNum || storedOffset != record.offset) continue;
+                insertIntoMemTable(record.key, valueLog->append(record.key, &data[record.offset - start], record.size));
+                relocatedBytes += record.size;
             }
         }
-
-        // 将中途为避免占用内存过大事先读走的 nextLevelTempCache 先放入 level+1 cache 中
-        for(auto j = 0; j < nextLevelTempCache.size(); ++j){
-            cache[level + 1].push_back(nextLevelTempCache[j]);
+        if(memTableBytes() > INIT_BYTES_SIZE){
+            convertMemToSS();
+            memTable->reset();
         }
-        nextLevelTempCache.clear();
-
-        // 将结果每 2 MB 分成一个新的 SSTable 文件（最后一个 SSTable 可以不足 2MB），写入到 Level 1 中
-        // 在其中操作时 cache 直接 push_back 即可
-        // 取最大 maxTimeStamp 作为共同 timeStamp
-        writeAllListToSSTables(result, maxTimeStamp, level + 1);
+        valueLog->markObsolete(fileNum);
+        if(snapshots.empty()){
+            valueLog->removeFile(fileNum);
+            ++stats.valueLogGCs;
+        }
+    } catch(...){
+        error = std::current_exception();
+    }
+    stats.valueLogRelocatedBytes += relocatedBytes;
+    compacting = false;
+    collectingValueLog = false;
+    stallCv.notify_all();
+    if(error) std::rethrow_exception(error);
+    return true;
+}
 
-        // 将临时缓存与目前的缓存合并
-        if(findTableInNextLevel)
-            for(auto j = endIndex + 1; j < cacheSize; ++j){
-                cache[level + 1].push_back(tempCache[j-endIndex-1]);
+// 值日志的失效字节只在内存中累计，启动时重新统计（构造函数中调用）：各层 SSTable 中仍有指针指向的记录有效，其余都已失效；
+// 被更新的数据遮蔽而尚未被 compaction 丢弃的指针也算作有效，丢弃时再计入
+void KVStore::rebuildValueLogGarbage()
+{
+    for(auto it = cache.begin(); it != cache.end(); ++it){
+        for(auto _it = (*it).begin(); _it != (*it).end(); ++_it){
+            for(SSTableReaders reader(*_it); reader.valid(); reader.next()){
+                if(ValueLogs::isPointer(reader.value(), reader.valueSize())) valueLog->addLive(reader.value());
             }
-        tempCache.clear();
-
-        // 对下一个 level 层的 cache 进行由小到大重新排序
-        std::sort(cache[level + 1].begin(), cache[level + 1].end(), cmpSSTableMinKey);
-
-        return;
+        }
     }
+}
 
+// 写入前检查 level 0 的文件数：达到 level0SlowdownTrigger 时本次写先延迟约 1ms，让后台 compaction 追上写入速度；
+// 本次写需要写出 memTable 而 level 0 已达到 level0StopTrigger 时阻塞，直到 compaction 完成
+// writeBytes 为本次写入 memTable 增加的字节数
+void KVStore::makeRoomForWrite(std::unique_lock<std::mutex> &lock, uint64_t writeBytes)
+{
+    bool allowDelay = true;
+    while(true){
+        if(backgroundError != nullptr) throw(backgroundError);
+        bool needFlush = memTableBytes() + writeBytes > options.writeBufferSize;
+        auto start = std::chrono::steady_clock::now();
+        if(allowDelay && cache[0].size() >= options.level0SlowdownTrigger){
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            lock.lock();
+            allowDelay = false;
+            ++stats.slowdownWrites;
+        } else if(needFlush && cache[0].size() >= options.level0StopTrigger){
+            compactionCv.notify_one();
+            stallCv.wait(lock);
+            ++stats.stoppedWrites;
+        } else {
+            break;
+        }
+        stats.stallMicros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
 }
 
-// 每次新增 SSTable 都调用检查一次
-void KVStore::checkCompaction()
+// 等待后台 compaction 结束（持有 mutex 时调用）；drain 为 true 时一直等到没有需要 compaction 的层
+void KVStore::waitForCompaction(std::unique_lock<std::mutex> &lock, bool drain)
 {
-    uint64_t current = 0;
-    uint64_t fileNum = 2;
-    while(current <= this->maxLevel){
-        auto size = cache[current].size();
-        if(size > fileNum)
-            compaction(current, size - fileNum);
-        else return;
-        ++current;
-        fileNum *= 2;
+    while(backgroundError == nullptr && (compacting || (drain && needsCompaction()))){
+        compactionCv.notify_one();
+        stallCv.wait(lock);
     }
 }
 
-// 函数将所有 allList 中的 key-value 对写入 SSTables （每达到 2MB 分新文件），并记录对应缓存
-// 第一个参数为 allList，第二个参数为临时的指向缓存的指针（new 出来的）
-void KVStore::writeAllListToSSTables(std::list<std::pair<uint64_t, std::string> > &allList, const uint64_t &timeStamp, const uint64_t &level)
+// 将 builder 中的 key-value 对写成 tableDir 下的一个新 SSTable（new 出来，由调用者放入缓存）
+// 同时从 rangeTombstones 中取出起点不超过 upto 的范围删除标记一并写入，文件的键区间随之扩展
+// dropCompactionPageCache 只作用于 compaction 的输出，memTable 的写出持有 mutex，不为丢弃页缓存而 fdatasync
+// flush 为 true 时为 memTable 的写出（builder 以高优先级经 rateLimiter 限速）；sync 为 true 时不论 syncTableWrites 都落盘
+SSTables* KVStore::finishSSTable(SSTableBuilders &builder, RangeTombstones &rangeTombstones, uint64_t upto, const uint64_t &timeStamp, const std::string &tableDir, bool flush, bool sync)
 {
-    bool isMaxLvl = (level == this->maxLevel);
-    uint64_t size = INIT_BYTES_SIZE;
-    std::string level_str = "/level-" + std::to_string(level);
-    std::list<std::pair<uint64_t, std::string>> currentList;
-    uint64_t numKey = 0;
-    while (!allList.empty()){
-        auto tmp = allList.front();
-        allList.pop_front();
-        std::string tmpVal = tmp.second;
-        size += (tmpVal.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-        if(size <= MAX_BYTES_SIZE){
-            if(isMaxLvl)
-                if(tmpVal == "~DELETED~"){
-                    size -= (tmpVal.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-                    continue;
-                }
-            currentList.push_back(std::move(tmp));
-            ++numKey;
-        } else {
-            // 到 2MB，转化成 SSTable
-            // 获取有关信息
-            uint64_t minKey = currentList.front().first;
-            uint64_t maxKey = currentList.back().first;
-            if(maxKey < minKey)
-                throw("ERROR   maxKey < minKey in writeListToSSTables");
-            std::string currentFileName = generateFileName(timeStamp, minKey, maxKey, numKey);
-            // 新建 SSTables 并存入对应缓存
-            SSTables* ssTable = new SSTables(dir + level_str, currentList, minKey, maxKey, numKey, timeStamp, currentFileName);
-            cache[level].push_back(ssTable);
-            // 将刚刚未能转换的插入 currentList
-            currentList.clear();
-            numKey = 0;
-            size = INIT_BYTES_SIZE;
-            size += (tmpVal.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-            currentList.push_back(tmp);
-            ++numKey;
-        }
+    RangeTombstones tableTombstones;
+    rangeTombstones.takeUpTo(upto, tableTombstones);
+    uint64_t numKey = builder.getPairsNum();
+    uint64_t minKey = 0;
+    uint64_t maxKey = 0;
+    if(numKey != 0){
+        minKey = builder.getMinKey();
+        maxKey = builder.getMaxKey();
     }
-    uint64_t minKey = currentList.front().first;
-    uint64_t maxKey = currentList.back().first;
+    if(!tableTombstones.empty()){
+        if(numKey == 0 || tableTombstones.getMinKey() < minKey) minKey = tableTombstones.getMinKey();
+        if(numKey == 0 || tableTombstones.getMaxKey() > maxKey) maxKey = tableTombstones.getMaxKey();
+    }
+    if(maxKey < minKey)
+        throw("ERROR   maxKey < minKey in finishSSTable");
     std::string currentFileName = generateFileName(timeStamp, minKey, maxKey, numKey);
-    // 新建 SSTables 并存入对应缓存
-    SSTables* ssTable = new SSTables(dir + level_str, currentList, minKey, maxKey, numKey, timeStamp, currentFileName);
-    cache[level].push_back(ssTable);
-    currentList.clear();
+    return new SSTables(tableDir, builder, minKey, maxKey, timeStamp, currentFileName, tableTombstones, options.rangeFilter, options.checksumVerification, sync || options.syncTableWrites, options.dropCompactionPageCache && !flush);
+}
+
+// 构建中的 SSTable 写入的临时文件：dir/.compacting 下不重名的文件，写完后改名为正式的文件
+std::string KVStore::tempTablePath()
+{
+    std::string tempDir = dir + "/.compacting";
+    if(!utils::dirExists(tempDir)) utils::mkdir(tempDir.c_str());
+    return tempDir + "/" + std::to_string(nextTempTableNum++) + ".tmp";
 }
 
 void KVStore::clearAllCacheAndFiles() {
     // Clear by level
-    std::string fileName;
     uint64_t level = 0;
     while(level <= this->maxLevel){
         std::string level_str = "/level-" + std::to_string(level);
         uint64_t tableNum = cache[level].size();
         while(tableNum > 0){
-            fileName = cache[level][tableNum - 1]->fileName +".sst";
-            // delete that file
-            if(utils::rmfile((dir+level_str+"/"+fileName).c_str())){
-                throw("remove file error in reset!");
-            }
-            // delete that cache
-            delete (cache[level][tableNum - 1]);
+            // delete that file and cache
+            retireTable(cache[level][tableNum - 1]);
             --tableNum;
         }
         cache[level].clear();
@@ -823,68 +1420,30 @@ void KVStore::clearAllCacheAndFiles() {
     this->maxLevel = 0;
 }
 
-// 为了缓解内存占用过大的问题，在 result 具备一定规模时尝试写一部分，nextLevelTempCache 暂存这一部分的 cache
-void KVStore::tryWriteSomeListToSSTables(std::list<std::pair<uint64_t, std::string>> &allList, const uint64_t &timeStamp, const uint64_t &level, std::vector<SSTables *> &nextLevelTempCache) {
-
-    bool isMaxLvl = (level == this->maxLevel);
-    uint64_t size = INIT_BYTES_SIZE;
-    std::string level_str = "/level-" + std::to_string(level);
-    std::list<std::pair<uint64_t, std::string> > currentList;
-    uint64_t numKey = 0;
-    while (!allList.empty()){
-        auto tmp = allList.front();
-        allList.pop_front();
-        std::string tmpVal = tmp.second;
-        size += (tmpVal.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-        if(size <= MAX_BYTES_SIZE){
-            if(isMaxLvl)
-                if(tmpVal == "~DELETED~"){
-                    size -= (tmpVal.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-                    continue;
-                }
-            currentList.push_back(std::move(tmp));
-            ++numKey;
-        } else {
-            // 到 2MB，转化成 SSTable
-            // 获取有关信息
-            uint64_t minKey = currentList.front().first;
-            uint64_t maxKey = currentList.back().first;
-            if(maxKey < minKey)
-                throw("ERROR   maxKey < minKey in writeListToSSTables");
-            std::string currentFileName = generateFileName(timeStamp, minKey, maxKey, numKey);
-            // 新建 SSTables 并存入对应缓存
-            SSTables* ssTable = new SSTables(dir + level_str, currentList, minKey, maxKey, numKey, timeStamp, currentFileName);
-            nextLevelTempCache.push_back(ssTable);
-            // 将刚刚未能转换的插入 currentList
-            currentList.clear();
-            numKey = 0;
-            size = INIT_BYTES_SIZE;
-            size += (tmpVal.length() + KEY_BYTES_SIZE + OFFSET_BYTES_SIZE);
-            currentList.push_back(tmp);
-            ++numKey;
-        }
-    }
-    // 剩下的没有来得及写的再放回去
-    allList = std::move(currentList);
-}
-
 // 在启动时，需检查现有的数据目录中各层 SSTable 文件，并在内存中构建相应的缓存
 // 如果有找到文件并重建成功返回 true，如果现有数据目录为空返回 false
 bool KVStore::rebuildCacheFromDir() {
     // reload cache
     cache.clear();
 
+    std::vector<std::string> dirNames;
+    utils::scanDir(dir, dirNames);
+    // 只计入各层的目录（值日志目录 vlog 不算）
     std::vector<std::string> levelDirNames;
-    int levelDirNum = utils::scanDir(dir, levelDirNames);
+    for(auto it = dirNames.begin(); it != dirNames.end(); ++it){
+        if((*it).compare(0, 6, "level-") == 0) levelDirNames.push_back(*it);
+    }
+    int levelDirNum = levelDirNames.size();
     if(levelDirNum == 0) return false;
 
+    // scanDir 返回的顺序不固定，按层号逐层检查 level-0 ... level-(levelDirNum-1) 都存在
     uint64_t maxLevel = levelDirNum - 1;
     uint64_t level = 0;
     uint64_t maxTimeStamp = 1;
     while(levelDirNum > 0){
-        auto levelDirName = levelDirNames[level];
         std::string level_str = "level-" + std::to_string(level);
-        if(levelDirName != level_str) throw("ERROR  in rebuildCacheFromDir: levelDir problem when rebuilding " + level_str);
+        if(std::find(levelDirNames.begin(), levelDirNames.end(), level_str) == levelDirNames.end())
+            throw("ERROR  in rebuildCacheFromDir: levelDir problem when rebuilding " + level_str);
 
         // std::cout << "rebuilding " << levelDirName << std::endl;
         std::vector<SSTables*> levelCache;
@@ -893,14 +1452,13 @@ bool KVStore::rebuildCacheFromDir() {
         std::vector<std::string> fileNames;
         std::string fileName;
         int fileNum = utils::scanDir(dir + "/" + level_str, fileNames);
-        if(level != 0 && level != maxLevel && fileNum != (2 << level)) throw("ERROR  in rebuildCacheFromDir: files num incorrect in " + level_str);
         int index = 0;
         while(index < fileNum){
             fileName = fileNames[index];
             auto idx = fileName.find(".sst");//在a中查找b.
             if(idx == std::string::npos) throw("ERROR  in rebuildCacheFromDir: file name not including .sst");
             std::string pureFileName = fileName.substr(0, idx);
-            SSTables* ssTable = new SSTables(dir + "/" + level_str, pureFileName);
+            SSTables* ssTable = new SSTables(dir + "/" + level_str, pureFileName, options.checksumVerification);
             // 比较获取最大的时间戳
             maxTimeStamp = getMax(maxTimeStamp, ssTable->getTimeStamp());
             cache[level].push_back(ssTable);
@@ -922,25 +1480,149 @@ bool KVStore::rebuildCacheFromDir() {
 
     this->maxLevel = maxLevel;
     this->nextTimeStamp = maxTimeStamp + 1;
-
+    return true;
 }
 
 void KVStore::convertMemToSS() {
+    // 有冻结的 memTable 时，从旧到新合并成一个再写出：冻结的 memTable 可能仍被快照引用，
+    // 最旧的一个不再被引用时直接并入其中，否则复制一份；合并后释放所有冻结的 memTable
+    MemTables* mem = memTable;
+    if(!immMemTables.empty()){
+        mem = immMemTables.back();
+        if(mem->getRefs() == 1) immMemTables.pop_back();
+        else mem = new MemTables(dir);
+        for(auto it = immMemTables.rbegin(); it != immMemTables.rend(); ++it){
+            mem->absorb(**it);
+        }
+        mem->absorb(*memTable);
+        releaseImmMemTables();
+    }
+
     // convert to SSTable
-    std::list<std::pair<uint64_t, std::string> > all;
-    uint64_t numKey = 0;
-    uint64_t minKey = 0;
-    uint64_t maxKey = 0;
-    memTable->getAll(all, minKey, maxKey, numKey);
-    assert(numKey != 0);
+    // 直接从跳表按 key 顺序编码进 builder，不再复制出一份 list
+    SSTableBuilders builder(tempTablePath(), blockCodec(), options.writeBufferSize, options.fixedWidthValues, &rateLimiter, true);
+    bool separate = options.valueLogThreshold > 0;
+    mem->forEach([&](uint64_t key, const std::string &value){
+        // 较大的 value 写入值日志，SSTable 中只保存指针；已经是指针的 value 保持不变
+        if(separate && value.size() >= options.valueLogThreshold && value.size() > VALUE_POINTER_BYTES_SIZE){
+            std::string pointer = valueLog->append(key, value.data(), value.size());
+            builder.add(key, pointer.data(), pointer.size());
+        } else {
+            builder.add(key, value.data(), value.size());
+        }
+    });
+    // 只有范围删除标记时 builder 可能为空，此时键区间由删除标记决定
+    RangeTombstones rangeTombstones = mem->getRangeTombstones();
+    if(mem != memTable) delete mem;
+    assert(builder.getPairsNum() != 0 || !rangeTombstones.empty());
+    // 表中的指针所指的记录须先于表写出，表要落盘时记录也先落盘
+    bool sync = options.syncTableWrites || collectingValueLog;
+    valueLog->sync(sync);
     uint64_t level = 0;
     std::string level_str = "/level-" + std::to_string(level);
-    // 确定文件名并赋值到此处，不包含.sst
-    // 文件命名格式 timeStamp minKey-maxKey pairsNum
-    std::string currentFileName = generateFileName(nextTimeStamp, minKey, maxKey, numKey);
-    SSTables* ssTable = new SSTables(dir + level_str, all, minKey, maxKey, numKey, nextTimeStamp, currentFileName);
+    SSTables* ssTable = finishSSTable(builder, rangeTombstones, UINT64_MAX, nextTimeStamp, dir + level_str, true, sync);
     ++nextTimeStamp;
 
     cache[0].push_back(ssTable);
-    checkCompaction();
+    // 唤醒后台线程检查是否需要 compaction
+    compactionCv.notify_one();
+}
+
+KVStoreStats KVStore::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    KVStoreStats result = stats;
+    result.rateLimitedMicros = rateLimiter.getThrottledMicros();
+    for(uint64_t level = 0; level < cache.size(); ++level){
+        uint64_t rawBytes = 0, dataBytes = 0;
+        for(auto it = cache[level].begin(); it != cache[level].end(); ++it){
+            rawBytes += (*it)->getRawDataBytes();
+            dataBytes += (*it)->getDataBytes();
+            if((*it)->isBloomFilterLoaded()) ++result.loadedBloomFilters;
+        }
+        result.levelCompressionRatios.push_back(dataBytes == 0 ? 1 : (double)rawBytes / (double)dataBytes);
+    }
+    result.valueLogBytes = valueLog->getTotalBytes();
+    return result;
+}
+
+// 新写出的 SSTable 数据块使用的 codec
+uint32_t KVStore::blockCodec()
+{
+    return (options.compression == COMPRESSION_LZ) ? BLOCK_CODEC_LZ : BLOCK_CODEC_NONE;
+}
+
+// compaction 输出到 level 层的 SSTable 的目标大小：level 1 及以上为 targetFileSizeBase * targetFileSizeMultiplier ^ (level - 1)
+uint64_t KVStore::targetFileSize(uint64_t level)
+{
+    uint64_t size = options.targetFileSizeBase;
+    for(uint64_t l = 1; l < level && options.targetFileSizeMultiplier > 1; ++l){
+        if(size > UINT64_MAX / options.targetFileSizeMultiplier) return UINT64_MAX;
+        size *= options.targetFileSizeMultiplier;
+    }
+    return size;
+}
+
+void KVStore::setCompactionRateLimit(uint64_t bytesPerSecond)
+{
+    rateLimiter.setBytesPerSecond(bytesPerSecond);
+}
+
+// 释放 PinnableValue 持有的 SSTable 引用
+void KVStore::releasePinnedTable(SSTables* table)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    unrefTable(table);
+}
+
+void PinnableValue::reset()
+{
+    if(pinnedTable != nullptr) store->releasePinnedTable(pinnedTable);
+    pinnedTable = nullptr;
+    store = nullptr;
+    buffer.clear();
+    valueData = "";
+    valueSize = 0;
+}
+
+void PinnableValue::moveFrom(PinnableValue &other)
+{
+    bool usesBuffer = (other.pinnedTable == nullptr && other.valueData == other.buffer.data() && other.valueSize > 0);
+    buffer = std::move(other.buffer);
+    userBuffer = other.userBuffer;
+    userCapacity = other.userCapacity;
+    store = other.store;
+    pinnedTable = other.pinnedTable;
+    valueData = usesBuffer ? buffer.data() : other.valueData;
+    valueSize = other.valueSize;
+    // 引用已经转移，other 析构时不再释放
+    other.pinnedTable = nullptr;
+    other.store = nullptr;
+    other.reset();
+}
+
+void PinnableValue::pin(KVStore* _store, SSTables* table, const char* data, uint64_t size)
+{
+    reset();
+    table->ref();
+    store = _store;
+    pinnedTable = table;
+    valueData = data;
+    valueSize = size;
+}
+
+char* PinnableValue::assign(const char* data, uint64_t size)
+{
+    reset();
+    char* dest;
+    if(userBuffer != nullptr && size <= userCapacity){
+        dest = userBuffer;
+    } else {
+        buffer.resize(size);
+        dest = &buffer[0];
+    }
+    if(data != nullptr && size > 0) memcpy(dest, data, size);
+    valueData = dest;
+    valueSize = size;
+    return dest;
 }
@@ -4,46 +4,20 @@
 #include "MemTables.h"
 #include "SSTables.h"
 #include "constant.h"
+#include "Options.h"
+#include "LoserTrees.h"
+#include "ValueLogs.h"
+#include "ThreadPools.h"
 #include <vector>
 #include <queue>
 #include <algorithm>
 #include <string>
-
-// 用于解决 bad_alloc 问题，通过在过程中先写一部分到硬盘上，减少内存压力的方式
-// 该值定义了在 result 积累到多少时尝试进行一批 SSTable 的写
-// 300
-#define KV_NUM_TO_WRITE_IN_COMPACTION 500
-
-// 自定义 compaction 中要使用的堆的比较函数
-// heap 会首先按照 first.first 来进行排序，之后按照 first.second 排序
-// 其中 first.first 越小越先输出（key小的在前输出）
-// 当  first.first 一样时候， second越大越先输出（时间戳大的先输出）
-// heap 出来的结果存入 list
-// 之后遍历 list，遇到重复的 key 只保留第一个即可
-struct cmpHeap{
-    bool operator() ( std::pair<std::pair<uint64_t, std::string>, uint64_t> &a, std::pair<std::pair<uint64_t, std::string>, uint64_t> &b ){
-        if( a.first.first == b.first.first ) {
-            return a.second < b.second;
-        }
-        return a.first.first > b.first.first;
-    }
-};
-
-
-// 自定义 scan 中要使用的堆的比较函数
-// heap 会首先按照 first.first 来进行排序，之后按照 first.second 排序
-// 其中 first.first 越小越先输出（key小的在前输出）
-// 当  first.first 一样时候， second越小越先输出（level 小的优先级更高，先输出）
-// heap 出来的结果存入 list
-// 之后遍历 list，遇到重复的 key 只保留第一个即可
-struct cmpScanHeap{
-    bool operator() ( std::pair<std::pair<uint64_t, std::string>, uint64_t> &a, std::pair<std::pair<uint64_t, std::string>, uint64_t> &b ){
-        if( a.first.first == b.first.first ) {
-            return a.second > b.second;
-        }
-        return a.first.first > b.first.first;
-    }
-};
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <exception>
 
 // 自定义 list unique 的比较函数，按照 key 比较（不会比较 value）是否相等
 // 遍历 list，遇到重复的 key 只保留第一个
@@ -66,43 +40,259 @@ inline bool cmpSSTableTimeStamp( SSTables* &a, SSTables* &b )
     return a->getTimeStamp() < b->getTimeStamp();
 }
 
+// 只读快照，由 KVStore::getSnapshot() 创建，必须通过 KVStore::releaseSnapshot() 释放
+// 固定创建时刻 memTable 的内容以及各层的 SSTable 集合，之后的 put / del 与 compaction 对其不可见
+// 创建时 memTable 被冻结并与 KVStore 共享（只增加引用计数，不复制），之后的写入进入新的 memTable
+// 被快照引用的 SSTable 在 compaction 中被淘汰时不会立即删除，而是移入 dir/.pinned，待快照释放后再删除
+// reset 同样如此：快照仍读到 reset 之前的数据，其引用的值日志文件待最后一个快照释放后再删除
+class Snapshot {
+    friend class KVStore;
+private:
+    std::vector<MemTables*> memTables;  // 创建时冻结的 memTable，新的在前，均已 ref()
+    std::vector<std::vector<SSTables*>> cache;  // 创建时各层的 SSTable，均已 ref()
+    Snapshot() {}
+};
+
+class KVStore;
+
+// get / scan 的零拷贝结果
+// value 在 SSTable 的文件映射中时直接指向映射，并持有该 SSTable 的一份引用（文件在 compaction 中被淘汰也不会删除）；
+// 否则（memTable 中的数据、值日志中的 value 或映射不可用）拷贝到调用者提供的缓冲区（放得下时）或自身的缓冲区
+// 持有引用的 PinnableValue 必须在 KVStore 析构之前 reset() 或析构
+class PinnableValue {
+    friend class KVStore;
+public:
+    PinnableValue() {}
+    // 使用调用者提供的缓冲区，capacity 为其大小
+    PinnableValue(char* buffer, uint64_t capacity): userBuffer(buffer), userCapacity(capacity) {}
+    PinnableValue(PinnableValue &&other) { moveFrom(other); }
+    PinnableValue &operator=(PinnableValue &&other) { if(this != &other){ reset(); moveFrom(other); } return *this; }
+    PinnableValue(const PinnableValue &) = delete;
+    PinnableValue &operator=(const PinnableValue &) = delete;
+    ~PinnableValue() { reset(); }
+
+    const char* data() const {return valueData;};
+    uint64_t size() const {return valueSize;};
+    // 是否直接指向 SSTable 的文件映射
+    bool isPinned() const {return pinnedTable != nullptr;};
+    std::string toString() const {return std::string(valueData, valueSize);};
+    // 释放持有的 SSTable 引用并清空
+    void reset();
+
+private:
+    const char* valueData = "";
+    uint64_t valueSize = 0;
+    std::string buffer;
+    char* userBuffer = nullptr;
+    uint64_t userCapacity = 0;
+    KVStore* store = nullptr;
+    SSTables* pinnedTable = nullptr;
+
+    void moveFrom(PinnableValue &other);
+    // 指向 table 的文件映射并持有引用
+    void pin(KVStore* store, SSTables* table, const char* data, uint64_t size);
+    // 拷贝 size 字节（data 为 nullptr 时只分配空间），返回可写入的地址
+    char* assign(const char* data, uint64_t size);
+};
+
+// approximateStats 的返回值：区间内估计的 key 个数与占用字节数
+// 同一个 key 在 memTable 与多层 SSTable 中的多个版本（包括删除标记）会被重复计入
+struct ApproximateStats {
+    uint64_t keyCount = 0;
+    uint64_t byteSize = 0;
+};
+
+// 后台 compaction 的累计统计，由 KVStore::getStats() 返回
+struct KVStoreStats {
+    uint64_t compactions = 0;     // 完成的 compaction 次数（不含直接移动文件的）
+    uint64_t trivialMoves = 0;    // 直接把文件移到下一层的 compaction 次数
+    uint64_t tombstoneCompactions = 0;  // 因删除标记占比过高而进行的 compaction 次数
+    uint64_t oldestFirstPicks = 0;  // level >= 1 按 COMPACTION_PRI_OLDEST_FIRST 选取输入的 compaction 次数
+    uint64_t minOverlapPicks = 0;   // level >= 1 按 COMPACTION_PRI_MIN_OVERLAP 选取输入的 compaction 次数
+    uint64_t slowdownWrites = 0;  // 因 level 0 文件数达到 level0SlowdownTrigger 被延迟的写
+    uint64_t stoppedWrites = 0;   // 因 level 0 文件数达到 level0StopTrigger 被阻塞的写
+    uint64_t stallMicros = 0;     // 写被延迟与阻塞的总时长（微秒）
+    uint64_t rateLimitedMicros = 0;  // compaction 读写被限速等待的总时长（微秒）
+    uint64_t loadedBloomFilters = 0;  // 现有 SSTable 中 bloom filter 已载入内存的个数
+    uint64_t scanFilteredTables = 0;  // scan 时键区间与范围相交、但经 RangeFilter 判定没有数据而不读的 SSTable 个数
+    uint64_t valueLogGCs = 0;  // 回收的值日志文件个数
+    uint64_t valueLogRelocatedBytes = 0;  // 回收时重新写入值日志的 value 字节数
+    uint64_t valueLogBytes = 0;  // 现有值日志文件的总大小
+    // 各层数据区压缩前与实际大小之比（空层为 1），下标为层号
+    std::vector<double> levelCompressionRatios;
+};
+
+// 一次 compaction：leveled 模式下将 level 层的输入与 level + 1 层中与之相交的文件归并，结果写入 outputLevel = level + 1 层
+// （最后一层中删除标记过多的文件原地重写，outputLevel = level）；
+// universal 模式下将最新的若干个 sorted run 归并，结果写入 outputLevel 层
+struct CompactionJob {
+    uint64_t level = 0;
+    uint64_t outputLevel = 1;
+    // 归并的各路输入，下标越小越新，每一路内的文件按 key 有序无交集
+    std::vector<std::vector<SSTables*> > sources;
+    // sources 的最后一路是否为 outputLevel 层中的文件（层内有序无交集，可按其边界切分 subcompaction）
+    bool withNextLevel = false;
+    // 不重写数据，直接把输入文件移到 outputLevel 层
+    bool trivialMove = false;
+    // 写出的新文件，安装前位于 dir/.compacting
+    std::vector<SSTables*> outputs;
+    uint64_t timeStamp = 0;
+    // 比 outputLevel 更深的各层中所有文件的键区间（合并后），落在其外的 key 已经没有更旧的数据需要遮蔽，删除标记可以直接丢弃
+    // 在 pickCompaction 中取得，归并期间只有后台线程修改各层，更深的层不会变化
+    RangeTombstones deeperKeyRanges;
+    // 因删除标记占比过高而选出
+    bool byTombstones = false;
+    // level >= 1 的输入文件按 compactionPri 选出（level 0、universal 与删除标记触发的 compaction 不使用）
+    bool byCompactionPri = false;
+    CompactionPri compactionPri = COMPACTION_PRI_OLDEST_FIRST;
+    // 归并中被丢弃的值日志指针，安装时计入值日志的失效字节
+    std::vector<std::string> droppedValuePointers;
+    // 值日志中有文件时，整个被更新的范围删除标记覆盖而不必归并的文件也要读出，其中的指针同样计入 droppedValuePointers
+    bool readCoveredTables = false;
+};
+
 class KVStore : public KVStoreAPI {
 	// You can add your implementation here
+    friend class PinnableValue;
 private:
     MemTables* memTable = nullptr;
+    // 创建快照时冻结的 memTable，新的在前，不再修改，与快照共享；写出 memTable 时与 memTable 一起写成一个 SSTable
+    std::vector<MemTables*> immMemTables;
+    // memTable 与 immMemTables 的总大小，按写出后一个 SSTable 的大小计算
+    uint64_t memTableBytes();
+    void unrefMemTable(MemTables* mem);
+    void releaseImmMemTables();
     // 使用 cache[i][j] 表示第 i 层第 j 个文件，第0层越后面文件越新，之后层越后面索引越大
     std::vector<std::vector<SSTables*>> cache;
 
     std::string dir;
+    Options options;
+    // 值日志，保存 memTable 写出时超过 options.valueLogThreshold 的 value
+    ValueLogs* valueLog = nullptr;
     uint64_t nextTimeStamp = 1;
     uint64_t maxLevel = 0;
-    void checkCompaction();  // 每次新增 SSTable 都调用检查一次
-    void compaction(uint64_t level, unsigned int moreNum);
-    void writeAllListToSSTables(std::list<std::pair<uint64_t, std::string> > &allList, const uint64_t &timeStamp, const uint64_t &level);
-    void tryWriteSomeListToSSTables(std::list<std::pair<uint64_t, std::string> > &allList, const uint64_t &timeStamp, const uint64_t &level, std::vector<SSTables *> &nextLevelTempCache);
+    // COMPACTION_PRI_MIN_OVERLAP 的轮转游标：各层上一次选中的最大键之后的位置，下一次从这里开始比较
+    std::vector<uint64_t> compactCursors;
+
+    // 尚未释放的快照
+    std::list<Snapshot*> snapshots;
+    // 移入 .pinned 目录的文件序号，避免与同名文件冲突
+    uint64_t nextPinnedNum = 1;
+    // 构建中的 SSTable 的临时文件序号，subcompaction 不持有 mutex 时也会取用
+    std::atomic<uint64_t> nextTempTableNum{1};
+    // 从 cache 中淘汰一个 SSTable：若没有快照引用则直接删除文件与对象，否则移入 .pinned 等待快照释放
+    void retireTable(SSTables* table);
+    void unrefTable(SSTables* table);
+    void clearTempDir(const std::string &tempDir);
+    void releasePinnedTable(SSTables* table);
+
+    // 所有公开接口都持有 mutex；compaction 由后台线程进行，只在选取输入与安装结果时持有 mutex
+    std::mutex mutex;
+    std::condition_variable compactionCv;  // 唤醒后台线程
+    std::condition_variable stallCv;  // compaction 结束时唤醒被阻塞的写、reset 与析构
+    std::thread compactionThread;
+    bool stopping = false;
+    bool compacting = false;
+    // 正在回收值日志：期间写出的 memTable 可能含有重写后的指针，旧文件删除前须连同新记录一起落盘
+    bool collectingValueLog = false;
+    // 后台 compaction 出错时记录错误，之后的写入抛出该错误
+    const char* backgroundError = nullptr;
+    // 不是 const char* 的异常的说明，backgroundError 指向其内容
+    std::string backgroundErrorMessage;
+    // 记录后台线程捕获的异常（持有 mutex 时调用），已有错误时忽略
+    void setBackgroundError(std::exception_ptr error);
+    // 与后台线程一起执行 subcompaction 的常驻线程，options.maxSubcompactions 不大于 1 时为 nullptr
+    ThreadPools* subcompactionPool = nullptr;
+    KVStoreStats stats;
+    // compaction 写出（以及可选的读入）与 memTable 写出共用的限速器
+    RateLimiters rateLimiter;
+    void backgroundCompaction();
+    uint64_t levelBytes(uint64_t level);
+    uint64_t levelTargetBytes(uint64_t level);
+    int64_t pickCompactionLevel();
+    CompactionJob* pickCompaction();
+    bool needsCompaction();
+    CompactionJob* pickLevelCompaction();
+    CompactionJob* pickTombstoneCompaction();
+    void pickMinOverlapFiles(uint64_t level, std::vector<SSTables*> &selected);
+    void universalSortedRuns(std::vector<uint64_t> &bytes, std::vector<uint64_t> &levels);
+    uint64_t pickUniversalRunNum();
+    CompactionJob* pickUniversalCompaction();
+    void shiftLevelsDown();
+    void runCompaction(CompactionJob &job);
+    void runSubcompaction(const CompactionJob &job, const std::vector<RangeTombstones> &newerTombstones, uint64_t key1, uint64_t key2, RangeTombstones &outputTombstones, std::vector<SSTables*> &outputs, std::vector<std::string> &droppedPointers);
+    void installCompaction(CompactionJob &job);
+    void abortCompaction(CompactionJob &job);
+    void makeRoomForWrite(std::unique_lock<std::mutex> &lock, uint64_t writeBytes);
+    void waitForCompaction(std::unique_lock<std::mutex> &lock, bool drain);
+    void writeToMemTable(std::unique_lock<std::mutex> &lock, uint64_t key, const std::string &s);
+    // 写入 memTable，放不下时先写出为 SSTable，不检查 level 0 的文件数（后台线程使用，不能等待 compaction）
+    void insertIntoMemTable(uint64_t key, const std::string &s);
+    // 回收一个失效字节占比达到 options.valueLogGCRatio 的值日志文件（后台线程持有 mutex 时调用），没有可回收的文件时返回 false
+    bool collectValueLogGarbage(std::unique_lock<std::mutex> &lock);
+    // 启动时按各层 SSTable 中的指针重新统计值日志各文件的失效字节
+    void rebuildValueLogGarbage();
+    uint32_t blockCodec();
+    uint64_t targetFileSize(uint64_t level);
+    std::string tempTablePath();
+    SSTables* finishSSTable(SSTableBuilders &builder, RangeTombstones &rangeTombstones, uint64_t upto, const uint64_t &timeStamp, const std::string &tableDir, bool flush = false, bool sync = false);
 
     // 确定文件名并赋值到此处，不包含.sst
     // 文件命名格式 timeStamp minKey-maxKey pairsNum
     std::string generateFileName(uint64_t timeStamp, uint64_t minKey, uint64_t maxKey, uint64_t numKey) {
         return std::to_string(timeStamp)+" "+std::to_string(minKey)+"-"+std::to_string(maxKey)+" "+ std::to_string(numKey);
     }
+    // 在 tables（同一层，按 minKey 有序且互不相交）中找到与 [minKey, maxKey] 有交集的文件下标区间 [startIndex, endIndex]
+    // 没有交集时返回 false
+    static bool findOverlapTables(const std::vector<SSTables*> &tables, uint64_t minKey, uint64_t maxKey, uint64_t &startIndex, uint64_t &endIndex);
+
     // 返回两数最大值
     uint64_t getMax(uint64_t a, uint64_t b){
         return ( a > b ) ? a : b;
     }
 
+    // 在 memTable 与各层 SSTable 中查找 key 的最新版本（已删除视为不存在）
+    // 找到时，在 memTable 中则 table 为 nullptr、value 放入 memValue，否则 table 与 pos 为所在文件与 index 下标
+    bool lookup(uint64_t key, const Snapshot* snapshot, std::string &memValue, SSTables* &table, uint64_t &pos);
+    // 对 memTable 与各层 SSTable 做多路归并，按 key 从小到大对每个可见的 key 调用一次 emit
+    // emit(key, memValue, table, pos) 的参数含义同 lookup
+    template<typename Emit>
+    void scanSources(uint64_t key1, uint64_t key2, const Snapshot* snapshot, Emit emit);
+    // 取出 lookup / scanSources 找到的 value，值日志指针读出其指向的 value
+    std::string loadValue(std::string &memValue, SSTables* table, uint64_t pos);
+    // 同上，放入 PinnableValue：SSTable 中的 value 尽量直接指向文件映射
+    void loadValue(std::string &memValue, SSTables* table, uint64_t pos, PinnableValue &value);
+
     void clearAllCacheAndFiles();
     bool rebuildCacheFromDir();
     void convertMemToSS();
 
 public:
 
-    KVStore(const std::string &dir);
+    KVStore(const std::string &dir, const Options &options = Options());
     ~KVStore();
 
 	void put(uint64_t key, const std::string &s) override;
 	std::string get(uint64_t key) override;
 	bool del(uint64_t key) override;
 	void reset() override;
+    void deleteRange(uint64_t begin, uint64_t end);
 	void scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &allList) override;
+
+    // 快照读：snapshot 为 nullptr 时等同于读当前状态
+    const Snapshot* getSnapshot();
+    void releaseSnapshot(const Snapshot* snapshot);
+    std::string get(uint64_t key, const Snapshot* snapshot);
+    void scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &allList, const Snapshot* snapshot);
+
+    // 零拷贝读：找到时返回 true，结果的生命周期见 PinnableValue
+    bool get(uint64_t key, PinnableValue &value, const Snapshot* snapshot = nullptr);
+    void scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, PinnableValue> > &allList, const Snapshot* snapshot = nullptr);
+
+    // 不读文件，仅由各 SSTable 内存中的 index 与 memTable 跳表的高层节点估计 [key1, key2] 内的数据量
+    ApproximateStats approximateStats(uint64_t key1, uint64_t key2);
+
+    KVStoreStats getStats();
+    // 运行时调整 compaction 的 I/O 速度（字节/秒），0 为不限速
+    void setCompactionRateLimit(uint64_t bytesPerSecond);
 };
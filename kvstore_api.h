@@ -14,6 +14,7 @@ public:
 	 */
 	KVStoreAPI(const std::string &dir) { }
 	KVStoreAPI() = delete;
+	virtual ~KVStoreAPI() { }
 
 	/**
 	 * Insert/Update the key-value pair.
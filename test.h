@@ -14,6 +14,7 @@ protected:
 	uint64_t nr_passed_tests;
 	uint64_t nr_phases;
 	uint64_t nr_passed_phases;
+	bool all_passed;
 
 #define EXPECT(exp, got) expect<decltype(got)>((exp), (got), __FILE__, __LINE__)
 	template<typename T>
@@ -43,8 +44,10 @@ protected:
 		if (nr_tests == nr_passed_tests) {
 			++nr_passed_phases;
 			std::cout << "[PASS]" << std::endl;
-		} else
+		} else {
+			all_passed = false;
 			std::cout << "[FAIL]" << std::endl;
+		}
 
 		std::cout.flush();
 
@@ -73,6 +76,13 @@ public:
 		nr_passed_tests = 0;
 		nr_phases = 0;
 		nr_passed_phases = 0;
+		all_passed = true;
+	}
+
+	// 目前为止所有的 phase 是否都通过
+	bool passed(void) const
+	{
+		return all_passed;
 	}
 
 	virtual void start_test(void *args = NULL)